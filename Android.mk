@@ -12,6 +12,7 @@ ifeq (1,$(strip $(BUILD_TEST_fpsprof)))
     fpsprofiler_SRC := $(LOCAL_PATH)/test/fpsprof.cc
     test_c_SRC := $(LOCAL_PATH)/test/test_c.c
     test_cpp_SRC := $(LOCAL_PATH)/test/test_cpp.cc
+    bench_kernels_SRC := $(LOCAL_PATH)/test/bench_kernels.cc
 	define MACRO_TEST_APP # use $app variable
         include $$(CLEAR_VARS) 
         LOCAL_MODULE := $${app}
@@ -20,5 +21,5 @@ ifeq (1,$(strip $(BUILD_TEST_fpsprof)))
         LOCAL_STATIC_LIBRARIES := fpsprof
         include $$(BUILD_EXECUTABLE)
     endef
-    $(foreach app, fpsprofiler test_c test_cpp,$(eval $(call MACRO_TEST_APP)))
+    $(foreach app, fpsprofiler test_c test_cpp bench_kernels,$(eval $(call MACRO_TEST_APP)))
 endif
@@ -9,6 +9,8 @@
 
 #define FPSPROF_SERIALIZE_STREAM(stream)    FPSPROF_serialize_stream(stream);
 #define FPSPROF_SERIALIZE_FILE(filename)    FPSPROF_serialize_file(filename);
+#define FPSPROF_SERIALIZE_FORMAT(fmt)       FPSPROF_serialize_format(fmt);
+#define FPSPROF_SERIALIZE_COMPRESS(enable)  FPSPROF_serialize_compress(enable);
 #define FPSPROF_REPORT_STREAM(stream)       FPSPROF_report_stream(stream);
 #define FPSPROF_REPORT_FILE(filename)       FPSPROF_report_file(filename);
 
@@ -28,6 +30,10 @@ extern "C" {
 // All writers set to NULL by default
 void FPSPROF_serialize_stream(FILE* fp);
 void FPSPROF_serialize_file(const char* filename);
+// 1 - text, 2 - binary (default)
+void FPSPROF_serialize_format(unsigned fmt);
+// built-in block compression (disabled by default), the reader detects it automatically
+void FPSPROF_serialize_compress(int compress);
 void FPSPROF_report_stream(FILE* fp);
 void FPSPROF_report_file(const char* filename);
 
@@ -0,0 +1,317 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "blockcomp.h"
+#include "parallel.h"
+
+#include <string.h>
+#include <assert.h>
+#include <vector>
+#include <algorithm>
+
+namespace fpsprof {
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 8 // keep the tail literal, so that a decoder never reads a match past the block end
+#define HASH_BITS 14
+#define MAX_OFFSET 0xffff
+
+static inline uint32_t read_u32(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline unsigned hash_u32(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+static inline void write_u32le(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+static inline uint32_t read_u32le(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint8_t* put_length_ext(uint8_t* dst, size_t len)
+{
+    while (len >= 255) {
+        *dst++ = 255;
+        len -= 255;
+    }
+    *dst++ = (uint8_t)len;
+    return dst;
+}
+static inline uint8_t* put_sequence(uint8_t* dst, const uint8_t* literals, size_t num_literals, size_t offset, size_t match_len)
+{
+    uint8_t* token = dst++;
+    *token = (uint8_t)(std::min(num_literals, (size_t)15) << 4);
+    if (num_literals >= 15) {
+        dst = put_length_ext(dst, num_literals - 15);
+    }
+    memcpy(dst, literals, num_literals);
+    dst += num_literals;
+    if (match_len) {
+        size_t len = match_len - MIN_MATCH;
+        *token |= (uint8_t)std::min(len, (size_t)15);
+        *dst++ = (uint8_t)offset;
+        *dst++ = (uint8_t)(offset >> 8);
+        if (len >= 15) {
+            dst = put_length_ext(dst, len - 15);
+        }
+    }
+    return dst;
+}
+
+size_t lz_compress_bound(size_t raw_size)
+{
+    return raw_size + raw_size / 255 + 16;
+}
+
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst)
+{
+    std::vector<uint32_t> table(1 << HASH_BITS, 0);
+    const uint8_t* const base = src;
+    const uint8_t* const match_limit = size > LAST_LITERALS ? src + size - LAST_LITERALS : src;
+    const uint8_t* anchor = src;
+    const uint8_t* ip = src + 1;
+    uint8_t* op = dst;
+
+    while (ip + MIN_MATCH <= match_limit) {
+        uint32_t seq = read_u32(ip);
+        unsigned h = hash_u32(seq);
+        const uint8_t* ref = base + table[h];
+        table[h] = (uint32_t)(ip - base);
+        if (ref >= ip || ip - ref > MAX_OFFSET || read_u32(ref) != seq) {
+            ip++;
+            continue;
+        }
+        size_t offset = ip - ref;
+        const uint8_t* match_end = ip + MIN_MATCH;
+        ref += MIN_MATCH;
+        while (match_end < match_limit && *match_end == *ref) {
+            match_end++;
+            ref++;
+        }
+        op = put_sequence(op, anchor, ip - anchor, offset, match_end - ip);
+        ip = anchor = match_end;
+    }
+    op = put_sequence(op, anchor, base + size - anchor, 0, 0);
+    return op - dst;
+}
+
+static inline bool get_length_ext(const uint8_t*& ip, const uint8_t* end, size_t& len)
+{
+    uint8_t b;
+    do {
+        if (ip >= end) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t raw_size)
+{
+    const uint8_t* ip = src;
+    const uint8_t* const ip_end = src + size;
+    uint8_t* op = dst;
+    uint8_t* const op_end = dst + raw_size;
+
+    while (ip < ip_end) {
+        unsigned token = *ip++;
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && !get_length_ext(ip, ip_end, num_literals)) {
+            return false;
+        }
+        if ((size_t)(ip_end - ip) < num_literals || (size_t)(op_end - op) < num_literals) {
+            return false;
+        }
+        memcpy(op, ip, num_literals);
+        ip += num_literals;
+        op += num_literals;
+        if (ip == ip_end) {
+            break; // last sequence
+        }
+        if (ip_end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length_ext(ip, ip_end, match_len)) {
+            return false;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(op_end - op) < match_len) {
+            return false;
+        }
+        const uint8_t* ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len--) { // overlapped copy
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == op_end;
+}
+
+bool blockcomp_detect(const uint8_t* data, size_t size)
+{
+    return size >= strlen(BLOCKCOMP_MAGIC) && 0 == memcmp(data, BLOCKCOMP_MAGIC, strlen(BLOCKCOMP_MAGIC));
+}
+
+bool blockcomp_decompress(const uint8_t* data, size_t size, std::string& out)
+{
+    struct block_t { const uint8_t* src; size_t packed_size; size_t raw_size; size_t out_offset; };
+    std::vector<block_t> blocks;
+
+    const uint8_t* p = data + strlen(BLOCKCOMP_MAGIC);
+    const uint8_t* end = data + size;
+    size_t out_size = 0;
+    for (;;) {
+        if (end - p < 4) {
+            return false;
+        }
+        size_t raw_size = read_u32le(p);
+        p += 4;
+        if (raw_size == 0) {
+            break;
+        }
+        if (end - p < 4) {
+            return false;
+        }
+        size_t packed_size = read_u32le(p);
+        p += 4;
+        if ((size_t)(end - p) < packed_size || packed_size > raw_size) {
+            return false;
+        }
+        blocks.push_back({ p, packed_size, raw_size, out_size });
+        p += packed_size;
+        out_size += raw_size;
+    }
+
+    out.resize(out_size);
+    uint8_t* dst = (uint8_t*)&out[0];
+    std::atomic<bool> ok(true);
+    parallel_for((unsigned)blocks.size(), [&](unsigned i) {
+        const auto& block = blocks[i];
+        if (block.packed_size == block.raw_size) {
+            memcpy(dst + block.out_offset, block.src, block.raw_size);
+        } else if (!lz_decompress(block.src, block.packed_size, dst + block.out_offset, block.raw_size)) {
+            ok = false;
+        }
+    });
+    return ok;
+}
+
+static std::string pack_block(const std::string& block)
+{
+    std::string packed(8 + lz_compress_bound(block.size()), '\0');
+    uint8_t* dst = (uint8_t*)&packed[0];
+    size_t packed_size = lz_compress((const uint8_t*)block.data(), block.size(), dst + 8);
+    if (packed_size >= block.size()) {
+        packed_size = block.size();
+        memcpy(dst + 8, block.data(), block.size());
+    }
+    write_u32le(dst, (uint32_t)block.size());
+    write_u32le(dst + 4, (uint32_t)packed_size);
+    packed.resize(8 + packed_size);
+    return packed;
+}
+
+BlockCompressOStream::Buf::Buf(std::ostream& dst, size_t block_size)
+    : _dst(dst)
+    , _block_size(block_size)
+    , _max_pending(num_workers() > 1 ? 2 * num_workers() : 0)
+{
+    _dst.write(BLOCKCOMP_MAGIC, strlen(BLOCKCOMP_MAGIC));
+    _block.reserve(_block_size);
+}
+
+std::streambuf::int_type BlockCompressOStream::Buf::overflow(int_type ch)
+{
+    if (ch != traits_type::eof()) {
+        char c = (char)ch;
+        xsputn(&c, 1);
+    }
+    return ch;
+}
+
+std::streamsize BlockCompressOStream::Buf::xsputn(const char* s, std::streamsize n)
+{
+    assert(!_finished);
+    std::streamsize left = n;
+    while (left > 0) {
+        size_t chunk = std::min((size_t)left, _block_size - _block.size());
+        _block.append(s, chunk);
+        s += chunk;
+        left -= chunk;
+        if (_block.size() == _block_size) {
+            submit();
+        }
+    }
+    return n;
+}
+
+void BlockCompressOStream::Buf::submit()
+{
+    if (_block.empty()) {
+        return;
+    }
+    if (_max_pending == 0) {
+        std::string packed = pack_block(_block);
+        _dst.write(packed.data(), packed.size());
+    } else {
+        _pending.push_back(std::async(std::launch::async, pack_block, std::move(_block)));
+        while (_pending.size() > _max_pending) {
+            write_front();
+        }
+    }
+    _block.clear();
+    _block.reserve(_block_size);
+}
+
+void BlockCompressOStream::Buf::write_front()
+{
+    std::string packed = _pending.front().get();
+    _pending.pop_front();
+    _dst.write(packed.data(), packed.size());
+}
+
+void BlockCompressOStream::Buf::finish()
+{
+    if (_finished) {
+        return;
+    }
+    submit();
+    while (!_pending.empty()) {
+        write_front();
+    }
+    uint8_t eos[4];
+    write_u32le(eos, 0);
+    _dst.write((const char*)eos, sizeof(eos));
+    _dst.flush();
+    _finished = true;
+}
+
+BlockCompressOStream::BlockCompressOStream(std::ostream& dst, size_t block_size)
+    : std::ostream(NULL)
+    , _buf(dst, block_size)
+{
+    rdbuf(&_buf);
+}
+
+BlockCompressOStream::~BlockCompressOStream()
+{
+    finish();
+}
+
+void BlockCompressOStream::finish()
+{
+    _buf.finish();
+}
+
+}
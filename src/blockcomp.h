@@ -0,0 +1,70 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <deque>
+#include <future>
+
+namespace fpsprof {
+
+/*
+    Dependency-free LZ77 block compression for the serialized logs.
+
+    stream:  "FPSZ" { u32le raw_size u32le packed_size data } u32le(0)
+             packed_size == raw_size means the block is stored as is
+    block:   sequence of { token [literal_len_ext] literals [u16le offset] [match_len_ext] },
+             token = literal_len << 4 | (match_len - 4), nibble value 15 means an extension follows
+             as a run of 255-bytes terminated by a smaller one, the last sequence has no match
+*/
+#define BLOCKCOMP_MAGIC "FPSZ"
+
+size_t lz_compress_bound(size_t raw_size);
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst);
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t raw_size);
+
+// true if the data starts with a compressed stream header
+bool blockcomp_detect(const uint8_t* data, size_t size);
+// decompress the whole stream, blocks are processed in parallel
+bool blockcomp_decompress(const uint8_t* data, size_t size, std::string& out);
+
+// Compressing ostream adapter: the blocks are packed on worker threads
+// and written to the destination in order
+class BlockCompressOStream : public std::ostream {
+public:
+    explicit BlockCompressOStream(std::ostream& dst, size_t block_size = 1 << 20);
+    ~BlockCompressOStream();
+
+    void finish();
+
+private:
+    class Buf : public std::streambuf {
+    public:
+        Buf(std::ostream& dst, size_t block_size);
+        void finish();
+
+    protected:
+        int_type overflow(int_type ch) override;
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+    private:
+        void submit();
+        void write_front();
+
+        std::ostream& _dst;
+        size_t _block_size;
+        std::string _block;
+        std::deque<std::future<std::string> > _pending;
+        unsigned _max_pending;
+        bool _finished = false;
+    } _buf;
+};
+
+}
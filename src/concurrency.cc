@@ -0,0 +1,180 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "concurrency.h"
+#include "thread.h"
+#include "event.h"
+#include "mapped_file.h"
+#include "writer.h"
+
+#include <algorithm>
+
+namespace fpsprof {
+
+// the time up to 'to' with the current number of busy threads, the frames passed are closed
+void ConcurrencyProfile::advance(uint64_t to)
+{
+    if (to <= _now) {
+        return;
+    }
+    if (_busy >= _busy_nsec.size()) {
+        _busy_nsec.resize(_busy + 1);
+    }
+    _busy_nsec[_busy] += to - _now;
+    for (frame_t& frame : _frames) {
+        if (frame.start_nsec >= to) {
+            break;
+        }
+        uint64_t a = std::max(frame.start_nsec, _now), b = std::min(frame.stop_nsec, to);
+        if (a < b) {
+            frame.busy_nsec += _busy * (b - a);
+        }
+    }
+    _now = to;
+    while (!_frames.empty() && _frames.front().stop_nsec <= _now) {
+        const frame_t& frame = _frames.front();
+        uint64_t duration = frame.stop_nsec - frame.start_nsec;
+        _parallelism.emplace_back(duration ? (double)frame.busy_nsec / duration : 0, frame.index);
+        _frames.pop_front();
+    }
+}
+
+// A thread is counted once, a top-level scope that overlaps the previous one of the thread
+// starts at its stop.
+bool ConcurrencyProfile::Collect(const char* filename, const frame_range_t& range)
+{
+    MappedFile file;
+    EventStream events;
+    if (!file.Open(filename) || !events.Open(file.data(), file.size(), range)) {
+        return false;
+    }
+    for (int thread_id : events.thread_ids()) {
+        _threads[thread_id];
+    }
+    _busy_nsec.assign(_threads.size() + 1, 0);
+
+    unsigned index = range.first;
+    bool first = true;
+    int thread_id;
+    Event event;
+    while (events.Next(thread_id, event)) {
+        if (event.stack_level() > 0) {
+            continue;
+        }
+        if (first) {
+            _now = _start_nsec = event.start_nsec();
+            first = false;
+        }
+        if (thread_id == 0 && event.frame_flag() && events.frame_thread_found()) {
+            _frames.push_back(frame_t{ index++, event.start_nsec(), event.stop_nsec(), 0 });
+        }
+        thread_t& thread = _threads[thread_id];
+        uint64_t start = std::max(event.start_nsec(), thread.last_stop_nsec), stop = event.stop_nsec();
+        if (stop <= start) {
+            continue;
+        }
+        if (thread.scopes) {
+            uint64_t gap = start - thread.last_stop_nsec;
+            thread.gap_nsec += gap;
+            thread.max_gap_nsec = std::max(thread.max_gap_nsec, gap);
+        }
+        thread.scopes++;
+        thread.busy_nsec += stop - start;
+        thread.last_stop_nsec = stop;
+
+        while (!_stops.empty() && _stops.top() <= start) {
+            advance(_stops.top());
+            _stops.pop();
+            _busy--;
+        }
+        advance(start);
+        _busy++;
+        _stops.push(stop);
+    }
+    while (!_stops.empty()) {
+        advance(_stops.top());
+        _stops.pop();
+        _busy--;
+    }
+    for (const frame_t& frame : _frames) { // empty frames at the end
+        _parallelism.emplace_back(0, frame.index);
+    }
+    _frames.clear();
+    return !events.failed();
+}
+
+void ConcurrencyProfile::Write(BufferedWriter& w) const
+{
+    uint64_t span = _now - _start_nsec;
+    uint64_t busy_total = 0;
+    for (size_t k = 0; k < _busy_nsec.size(); k++) {
+        busy_total += k * _busy_nsec[k];
+    }
+    w.printf("Concurrency [ %zu thread(s), %.3f ms, average parallelism %.2f ]\n",
+        _threads.size(), 1e-6 * span, span ? (double)busy_total / span : 0);
+    w.printf("%7s %12s %8s %8s\n", "busy", "time ms", "time%", "cum%");
+    uint64_t at_least = span;
+    for (size_t k = 0; k < _busy_nsec.size(); k++) {
+        w.printf("%7zu ", k);
+        w.put_fixed(1e-6 * _busy_nsec[k], 12, 3);
+        w.put(' ');
+        w.put_fixed(span ? 100. * _busy_nsec[k] / span : 0, 8, 2);
+        w.put(' ');
+        w.put_fixed(span ? 100. * at_least / span : 0, 8, 2);
+        w.put('\n');
+        at_least -= std::min(at_least, _busy_nsec[k]);
+    }
+    w.put('\n');
+
+    w.printf("Thread utilization [ idle gaps are between the top-level scopes, thread 0 runs the frames ]\n");
+    w.printf("%7s %7s %12s %8s %8s %12s %12s %12s\n", "thread", "scopes", "busy ms", "busy%", "idle%", "gaps ms", "mean gap ms", "max gap ms");
+    for (const auto& item : _threads) {
+        const thread_t& th = item.second;
+        double busy = span ? 100. * th.busy_nsec / span : 0;
+        w.printf("%7d %7u ", item.first, th.scopes);
+        w.put_fixed(1e-6 * th.busy_nsec, 12, 3);
+        w.put(' ');
+        w.put_fixed(busy, 8, 2);
+        w.put(' ');
+        w.put_fixed(span ? 100. - busy : 0, 8, 2);
+        w.put(' ');
+        w.put_fixed(1e-6 * th.gap_nsec, 12, 3);
+        w.put(' ');
+        w.put_fixed(th.scopes > 1 ? 1e-6 * th.gap_nsec / (th.scopes - 1) : 0, 12, 3);
+        w.put(' ');
+        w.put_fixed(1e-6 * th.max_gap_nsec, 12, 3);
+        w.put('\n');
+    }
+
+    if (_parallelism.empty()) {
+        return;
+    }
+    std::vector<std::pair<double, unsigned> > order(_parallelism);
+    std::stable_sort(order.begin(), order.end(), [](const std::pair<double, unsigned>& a, const std::pair<double, unsigned>& b) {
+        return a.first < b.first;
+    });
+    double sum = 0;
+    for (const auto& frame : order) {
+        sum += frame.first;
+    }
+    w.put('\n');
+    w.printf("Parallelism per frame [ %zu frame(s), mean %.2f, min %.2f (frame %u), median %.2f, max %.2f (frame %u) ]\n",
+        order.size(), sum / order.size(), order.front().first, order.front().second,
+        order[order.size() / 2].first, order.back().first, order.back().second);
+    std::vector<unsigned> buckets(_threads.size() + 1);
+    for (const auto& frame : order) {
+        buckets[std::min(buckets.size() - 1, (size_t)frame.first)]++;
+    }
+    w.printf("%12s %8s %8s\n", "busy", "frames", "frames%");
+    for (size_t k = 0; k < buckets.size(); k++) {
+        if (buckets[k]) {
+            w.printf("%5zu - %-4zu %8u ", k, k + 1, buckets[k]);
+            w.put_fixed(100. * buckets[k] / order.size(), 8, 2);
+            w.put('\n');
+        }
+    }
+}
+
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <deque>
+#include <queue>
+#include <functional>
+
+namespace fpsprof {
+
+class BufferedWriter;
+struct frame_range_t;
+
+// The number of busy threads over time, a thread is busy within its top-level scopes. The
+// events come merged by the start time, a sweep line keeps the stop times of the running
+// scopes in a heap of one entry per thread at most, O(n log threads) for n events.
+class ConcurrencyProfile {
+public:
+    bool Collect(const char* filename, const frame_range_t& range);
+
+    // the time with k busy threads, the busy and idle time of every thread and the average
+    // number of busy threads within the frames
+    void Write(BufferedWriter& w) const;
+
+private:
+    struct thread_t {
+        unsigned scopes = 0;
+        uint64_t busy_nsec = 0;
+        uint64_t gap_nsec = 0; // idle time between the top-level scopes
+        uint64_t max_gap_nsec = 0;
+        uint64_t last_stop_nsec = 0;
+    };
+    struct frame_t {
+        unsigned index;
+        uint64_t start_nsec;
+        uint64_t stop_nsec;
+        uint64_t busy_nsec; // sum over the threads
+    };
+
+    void advance(uint64_t to);
+
+    std::map<int, thread_t> _threads;
+    std::vector<uint64_t> _busy_nsec; // time by the number of busy threads
+    std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t> > _stops;
+    std::deque<frame_t> _frames; // not passed by the sweep yet
+    std::vector<std::pair<double, unsigned> > _parallelism; // average busy threads, frame
+    unsigned _busy = 0;
+    uint64_t _now = 0;
+    uint64_t _start_nsec = 0;
+};
+
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "critpath.h"
+#include "thread.h"
+#include "event.h"
+#include "mapped_file.h"
+#include "writer.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace fpsprof {
+
+CriticalPath::CriticalPath(unsigned max_sites)
+    : _max_sites(max_sites)
+{
+}
+
+// Same streaming as SlowFrames: a frame is complete when an event starts after its stop. The
+// scopes of the other threads running at the frame start come from their latest top-level scope.
+bool CriticalPath::Collect(const char* filename, const frame_range_t& range)
+{
+    MappedFile file;
+    EventStream events;
+    if (!file.Open(filename) || !events.Open(file.data(), file.size(), range)) {
+        return false;
+    }
+
+    std::unordered_map<const char*, unsigned> interned; // the stream names are interned
+    std::map<int, std::vector<event_t> > last_scope; // the latest top-level scope of every other thread
+    unsigned index = range.first;
+    frame_t cur;
+    bool filling = false;
+    int thread_id;
+    Event event;
+    while (events.Next(thread_id, event)) {
+        if (filling && event.start_nsec() > cur.events.front().stop_nsec) {
+            add_frame(cur);
+            filling = false;
+        }
+
+        auto it = interned.find(event.name());
+        if (it == interned.end()) {
+            it = interned.emplace(event.name(), (unsigned)_names.size()).first;
+            _names.push_back(event.name());
+        }
+        event_t e{ it->second, event.start_nsec(), event.stop_nsec() };
+        bool top = event.stack_level() <= 0;
+
+        if (thread_id == 0 && top && event.frame_flag() && events.frame_thread_found()) {
+            if (filling) {
+                add_frame(cur);
+            }
+            cur.index = index++;
+            cur.events.assign(1, e);
+            cur.others.clear();
+            for (const auto& scope : last_scope) { // already running
+                if (!scope.second.empty() && scope.second.front().stop_nsec > e.start_nsec) {
+                    cur.others[scope.first] = scope.second;
+                }
+            }
+            filling = true;
+            continue;
+        }
+        if (thread_id != 0) {
+            std::vector<event_t>& scope = last_scope[thread_id];
+            if (top) {
+                scope.clear();
+            }
+            if (top || !scope.empty()) {
+                scope.push_back(e);
+            }
+        }
+        if (filling && e.start_nsec < cur.events.front().stop_nsec) {
+            if (thread_id == 0) {
+                cur.events.push_back(e);
+            } else if (top || cur.others.count(thread_id)) {
+                cur.others[thread_id].push_back(e);
+            }
+        }
+    }
+    if (filling) {
+        add_frame(cur);
+    }
+    return !events.failed();
+}
+
+// The events come in the call order, a child is cut to its parent. The spans are cut to [start, stop).
+void CriticalPath::build_timeline(const std::vector<event_t>& events, uint64_t start, uint64_t stop, timeline_t& timeline)
+{
+    timeline.segments.clear();
+    timeline.tops.clear();
+    std::vector<std::pair<unsigned, uint64_t> > stack; // event, stop time
+    uint64_t cursor = 0;
+    auto emit = [&](uint64_t to) {
+        uint64_t a = std::max(cursor, start), b = std::min(to, stop);
+        if (a < b) {
+            timeline.segments.push_back({ a, b, stack.back().first, (unsigned)timeline.tops.size() - 1 });
+        }
+        cursor = std::max(cursor, to);
+    };
+    for (unsigned i = 0; i < events.size(); i++) {
+        const event_t& e = events[i];
+        while (!stack.empty() && stack.back().second <= e.start_nsec) {
+            emit(stack.back().second);
+            stack.pop_back();
+        }
+        if (stack.empty()) {
+            timeline.tops.push_back(i);
+        } else {
+            emit(e.start_nsec);
+        }
+        cursor = std::max(cursor, e.start_nsec);
+        uint64_t to = stack.empty() ? e.stop_nsec : std::min(e.stop_nsec, stack.back().second);
+        stack.emplace_back(i, std::max(to, cursor));
+    }
+    while (!stack.empty()) {
+        emit(stack.back().second);
+        stack.pop_back();
+    }
+}
+
+void CriticalPath::credit(unsigned frame, bool frame_thread, unsigned name, uint64_t nsec)
+{
+    if (!nsec) {
+        return;
+    }
+    site_t& site = _sites[std::make_pair(name, frame_thread)];
+    site.path_nsec += nsec;
+    if (site.last_frame != frame) {
+        site.last_frame = frame;
+        site.frames++;
+    }
+    if (frame_thread) {
+        _frame_thread_nsec += nsec;
+    }
+}
+
+void CriticalPath::add_frame(const frame_t& frame)
+{
+    uint64_t start = frame.events.front().start_nsec, stop = frame.events.front().stop_nsec;
+    _num_frames++;
+    _frames_nsec += stop - start;
+
+    timeline_t main;
+    build_timeline(frame.events, start, stop, main);
+    std::vector<std::pair<const std::vector<event_t>*, timeline_t> > others(frame.others.size());
+    size_t n = 0;
+    for (const auto& item : frame.others) {
+        others[n].first = &item.second;
+        build_timeline(item.second, start, stop, others[n++].second);
+    }
+    for (const segment_t& seg : main.segments) {
+        _sites[std::make_pair(frame.events[seg.event].name, true)].self_nsec += seg.stop_nsec - seg.start_nsec;
+    }
+    for (const auto& other : others) {
+        for (const segment_t& seg : other.second.segments) {
+            _sites[std::make_pair((*other.first)[seg.event].name, false)].self_nsec += seg.stop_nsec - seg.start_nsec;
+        }
+    }
+
+    uint64_t t = stop;
+    size_t i = main.segments.size();
+    while (t > start) {
+        while (i > 0 && main.segments[i - 1].start_nsec >= t) {
+            i--;
+        }
+        if (i == 0) {
+            break;
+        }
+        const segment_t& seg = main.segments[i - 1];
+        unsigned name = frame.events[seg.event].name;
+
+        // the other thread that finishes a top-level scope last within the piece, the lowest id on a tie
+        const std::pair<const std::vector<event_t>*, timeline_t>* waited = NULL;
+        unsigned waited_top = 0;
+        uint64_t waited_stop = seg.start_nsec;
+        for (const auto& other : others) {
+            const std::vector<event_t>& events = *other.first;
+            const std::vector<unsigned>& tops = other.second.tops;
+            auto it = std::upper_bound(tops.begin(), tops.end(), t, [&events](uint64_t time, unsigned top) {
+                return time < events[top].stop_nsec;
+            });
+            if (it == tops.begin()) {
+                continue;
+            }
+            const event_t& e = events[*(it - 1)];
+            if (e.stop_nsec > waited_stop && e.start_nsec < e.stop_nsec) {
+                waited = &other;
+                waited_top = (unsigned)(it - 1 - tops.begin());
+                waited_stop = e.stop_nsec;
+            }
+        }
+        if (!waited) {
+            credit(frame.index, true, name, t - seg.start_nsec);
+            t = seg.start_nsec;
+            continue;
+        }
+        credit(frame.index, true, name, t - waited_stop);
+        _hops++;
+
+        // the scope up to its start or the frame start, then back to the frame thread
+        const std::vector<event_t>& events = *waited->first;
+        const std::vector<segment_t>& segments = waited->second.segments;
+        uint64_t from = std::max(events[waited->second.tops[waited_top]].start_nsec, start);
+        auto end = std::upper_bound(segments.begin(), segments.end(), waited_top, [](unsigned top, const segment_t& s) {
+            return top < s.top;
+        });
+        for (auto s = end; s != segments.begin() && (s - 1)->top == waited_top; s--) {
+            const segment_t& piece = *(s - 1);
+            uint64_t a = std::max(piece.start_nsec, from), b = std::min(piece.stop_nsec, waited_stop);
+            if (a < b) {
+                credit(frame.index, false, events[piece.event].name, b - a);
+            }
+        }
+        t = from;
+    }
+}
+
+void CriticalPath::Write(BufferedWriter& w) const
+{
+    typedef std::pair<const std::pair<unsigned, bool>, site_t> site_item_t;
+    std::vector<const site_item_t*> sites;
+    for (const auto& site : _sites) {
+        if (site.second.path_nsec) {
+            sites.push_back(&site);
+        }
+    }
+    std::stable_sort(sites.begin(), sites.end(), [](const site_item_t* a, const site_item_t* b) {
+        return a->second.path_nsec > b->second.path_nsec;
+    });
+
+    double frames_nsec = (double)_frames_nsec;
+    w.printf("Critical path [ %u frame(s), mean %.3f ms, frame thread %.2f%%, other threads %.2f%%, %.2f move(s) per frame ]\n",
+        _num_frames, _num_frames ? 1e-6 * frames_nsec / _num_frames : 0,
+        _frames_nsec ? 100. * _frame_thread_nsec / frames_nsec : 0,
+        _frames_nsec ? 100. * (_frames_nsec - _frame_thread_nsec) / frames_nsec : 0,
+        _num_frames ? (double)_hops / _num_frames : 0);
+    if (sites.empty()) {
+        return;
+    }
+    w.printf("%7s %10s %8s %7s %6s  %s\n", "path%", "ms/frame", "self%", "frames", "thread", "site");
+    size_t i = 0;
+    for (; i < sites.size() && i < _max_sites; i++) {
+        const site_t& site = sites[i]->second;
+        w.put_fixed(100. * site.path_nsec / frames_nsec, 7, 2);
+        w.put(' ');
+        w.put_fixed(1e-6 * site.path_nsec / _num_frames, 10, 3);
+        w.put(' ');
+        w.put_fixed(site.self_nsec ? 100. * site.path_nsec / site.self_nsec : 0, 8, 2);
+        w.printf(" %7u %6s  %s\n", site.frames, sites[i]->first.second ? "frame" : "other", _names[sites[i]->first.first].c_str());
+    }
+    if (i < sites.size()) {
+        uint64_t rest = 0;
+        for (size_t j = i; j < sites.size(); j++) {
+            rest += sites[j]->second.path_nsec;
+        }
+        w.printf("+%zu more site(s), %.2f%% of the path\n", sites.size() - i, 100. * rest / frames_nsec);
+    }
+}
+
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace fpsprof {
+
+class BufferedWriter;
+struct frame_range_t;
+
+// The critical path of every frame from the absolute event times of all threads. The path is
+// walked back from the frame stop on the frame thread. A piece of the frame thread in which
+// another thread finishes a top-level scope is taken as waiting for the scope that finishes
+// last, the path moves to that scope and comes back to the frame thread at its start. The rest
+// of the frame thread is its own work. Every piece of the path is given to the innermost scope
+// running there, the call site. The times are the logged ones, no penalty compensation.
+class CriticalPath {
+public:
+    explicit CriticalPath(unsigned max_sites);
+
+    bool Collect(const char* filename, const frame_range_t& range);
+
+    unsigned num_frames() const { return _num_frames; }
+
+    // the sites by their time on the path, the share of the frame time and of their own
+    // exclusive time within the frames
+    void Write(BufferedWriter& w) const;
+
+private:
+    struct event_t {
+        unsigned name;
+        uint64_t start_nsec;
+        uint64_t stop_nsec;
+    };
+    struct segment_t { // the innermost event of a thread over a time span
+        uint64_t start_nsec;
+        uint64_t stop_nsec;
+        unsigned event;
+        unsigned top; // the top-level event the span is in
+    };
+    struct timeline_t {
+        std::vector<segment_t> segments;
+        std::vector<unsigned> tops; // events by the start time, stop times grow too
+    };
+    struct frame_t {
+        unsigned index;
+        std::vector<event_t> events; // the frame first, then the nested events in the call order
+        std::map<int, std::vector<event_t> > others; // the other threads, top-level scopes with the nested ones
+    };
+    struct site_t {
+        uint64_t path_nsec = 0;
+        uint64_t self_nsec = 0; // exclusive time within the frames
+        unsigned frames = 0;    // frames the site is on the path of
+        unsigned last_frame = ~0u;
+    };
+
+    static void build_timeline(const std::vector<event_t>& events, uint64_t start, uint64_t stop, timeline_t& timeline);
+    void add_frame(const frame_t& frame);
+    void credit(unsigned frame, bool frame_thread, unsigned name, uint64_t nsec);
+
+    unsigned _max_sites;
+    std::vector<std::string> _names;
+    std::map<std::pair<unsigned, bool>, site_t> _sites; // name, frame thread
+    unsigned _num_frames = 0;
+    uint64_t _frames_nsec = 0;
+    uint64_t _frame_thread_nsec = 0; // the path on the frame thread
+    uint64_t _hops = 0;               // moves to the other threads
+};
+
+}
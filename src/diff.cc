@@ -0,0 +1,585 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "diff.h"
+#include "thread.h"
+#include "event.h"
+#include "node.h"
+#include "stat.h"
+#include "mapped_file.h"
+#include "writer.h"
+
+#include <math.h>
+#include <string.h>
+#include <limits.h>
+
+#include <algorithm>
+
+namespace fpsprof {
+
+// the time of the current frame is folded into the moments once a later frame shows up
+struct FrameSamples::accum_t {
+    int64_t cur = 0;
+    unsigned frame = 0;
+    moments_t moments;
+
+    void add(unsigned frame_idx, int64_t nsec) {
+        if (frame_idx != frame) {
+            flush();
+            frame = frame_idx;
+        }
+        cur += nsec;
+    }
+    void flush() {
+        moments.sum += (double)cur;
+        moments.sum_sq += (double)cur * (double)cur;
+        cur = 0;
+    }
+};
+
+struct FrameSamples::thread_t {
+    std::unordered_map<uint64_t, unsigned> children; // parent path << 32 | name id -> path
+    std::vector<unsigned> path_names;
+    std::vector<accum_t> paths;
+    std::vector<accum_t> functions; // by name id
+    std::vector<unsigned> stack;    // path by stack level + 1
+    unsigned frame = 0;             // frame of the current top-level scope
+
+    thread_t() : path_names(1, NONE), paths(1), stack(1, 0) {}
+};
+
+FrameSamples::FrameSamples()
+{
+}
+
+FrameSamples::~FrameSamples()
+{
+}
+
+bool FrameSamples::Collect(const char* filename, const frame_range_t& range)
+{
+    MappedFile file;
+    EventStream events;
+    if (!file.Open(filename) || !events.Open(file.data(), file.size(), range)) {
+        return false;
+    }
+    for (int thread_id : events.thread_ids()) {
+        _threads[thread_id].reset(new thread_t);
+    }
+
+    std::unordered_map<const char*, unsigned> interned; // the stream names are interned
+    int thread_id;
+    Event event;
+    while (events.Next(thread_id, event)) {
+        auto it = interned.find(event.name());
+        if (it == interned.end()) {
+            auto res = _name_ids.emplace(event.name(), (unsigned)_names.size());
+            if (res.second) {
+                _names.push_back(event.name());
+            }
+            it = interned.emplace(event.name(), res.first->second).first;
+        }
+        unsigned name = it->second;
+        thread_t& th = *_threads[thread_id];
+
+        int64_t nsec = (int64_t)(event.stop_nsec() - event.start_nsec());
+        if (event.stack_level() <= 0) {
+            if (thread_id == 0 && event.frame_flag() && events.frame_thread_found()) {
+                _num_frames++;
+                _frame_time.sum += (double)nsec;
+                _frame_time.sum_sq += (double)nsec * (double)nsec;
+            }
+            th.frame = _num_frames ? _num_frames - 1 : 0; // the events before the first frame go to the first one
+        }
+        size_t depth = std::min(th.stack.size(), (size_t)std::max(0, event.stack_level()) + 1);
+        th.stack.resize(depth);
+        unsigned parent = th.stack.back();
+        auto res = th.children.emplace((uint64_t)parent << 32 | name, (unsigned)th.paths.size());
+        unsigned path = res.first->second;
+        if (res.second) {
+            th.paths.emplace_back();
+            th.path_names.push_back(name);
+        }
+        th.stack.push_back(path);
+        if (th.functions.size() <= name) {
+            th.functions.resize(name + 1);
+        }
+
+        // the exclusive time, a child takes its time from the parent
+        th.paths[path].add(th.frame, nsec);
+        th.functions[name].add(th.frame, nsec);
+        if (parent != 0) {
+            th.paths[parent].add(th.frame, -nsec);
+            th.functions[th.path_names[parent]].add(th.frame, -nsec);
+        }
+    }
+    for (auto& thread : _threads) {
+        for (auto& acc : thread.second->paths) {
+            acc.flush();
+        }
+        for (auto& acc : thread.second->functions) {
+            acc.flush();
+        }
+    }
+    return !events.failed();
+}
+
+unsigned FrameSamples::name_id(const char* name) const
+{
+    auto it = _name_ids.find(name);
+    return it == _name_ids.end() ? NONE : it->second;
+}
+
+unsigned FrameSamples::child(int thread_id, unsigned parent, unsigned name_id) const
+{
+    auto th = _threads.find(thread_id);
+    if (th == _threads.end() || parent == NONE || name_id == NONE) {
+        return NONE;
+    }
+    auto it = th->second->children.find((uint64_t)parent << 32 | name_id);
+    return it == th->second->children.end() ? NONE : it->second;
+}
+
+FrameSamples::moments_t FrameSamples::path(int thread_id, unsigned path) const
+{
+    auto th = _threads.find(thread_id);
+    if (th == _threads.end() || path >= th->second->paths.size()) {
+        return moments_t();
+    }
+    return th->second->paths[path].moments;
+}
+
+FrameSamples::moments_t FrameSamples::function(int thread_id, unsigned name_id) const
+{
+    auto th = _threads.find(thread_id);
+    if (th == _threads.end() || name_id >= th->second->functions.size()) {
+        return moments_t();
+    }
+    return th->second->functions[name_id].moments;
+}
+
+// Welch's statistic of the per-frame mean, the frames without the scope count as zero time.
+// NAN if either log has too few frames.
+static double welch_z(const FrameSamples::moments_t& a, unsigned na, const FrameSamples::moments_t& b, unsigned nb)
+{
+    if (na < 2 || nb < 2) {
+        return NAN;
+    }
+    double ma = a.sum / na, mb = b.sum / nb;
+    double va = std::max(0., (a.sum_sq - a.sum * ma) / (na - 1));
+    double vb = std::max(0., (b.sum_sq - b.sum * mb) / (nb - 1));
+    double se = sqrt(va / na + vb / nb);
+    if (se == 0) {
+        return ma == mb ? 0 : (mb > ma ? INFINITY : -INFINITY);
+    }
+    return (mb - ma) / se;
+}
+
+// Thread ids are given at the first use and differ between runs, the threads of the two logs
+// are matched by role instead: the frame thread with the frame thread, any other thread by its
+// heaviest top-level scope, same as the scaling study. A role run by several threads in either
+// log is a pool, the work moves between its threads from run to run, so it is not compared.
+enum { NO_THREAD = INT_MIN };
+
+struct thread_match_t {
+    std::vector<std::pair<int, int> > pairs; // base, new thread id, NO_THREAD if the role is not in the log
+    std::vector<std::string> pools;          // "role (base -> new threads)"
+};
+
+static const char* thread_role(const NodeView& view)
+{
+    const Node* head = NULL;
+    for (const auto& child : view.root().children()) {
+        if (!head || view.realtime_used(child) > view.realtime_used(*head)) {
+            head = &child;
+        }
+    }
+    return head ? head->name() : NULL;
+}
+
+static void match_threads(const diff_side_t& base, const diff_side_t& cur, thread_match_t& match)
+{
+    const diff_side_t* side[2] = { &base, &cur };
+    std::map<std::string, std::vector<int> > roles[2];
+    bool frame_thread = false;
+    for (int k = 0; k < 2; k++) {
+        for (const auto& thread : *side[k]->threads) {
+            const char* role = thread_role(thread.second);
+            if (thread.first == 0) {
+                frame_thread = true;
+            } else if (role) {
+                roles[k][role].push_back(thread.first);
+                roles[1 - k][role];
+            }
+        }
+    }
+    if (frame_thread) {
+        match.pairs.emplace_back(0, 0);
+    }
+    for (const auto& role : roles[0]) {
+        const std::vector<int>& ids0 = role.second;
+        const std::vector<int>& ids1 = roles[1][role.first];
+        if (ids0.size() > 1 || ids1.size() > 1) {
+            match.pools.push_back(role.first + " (" + std::to_string(ids0.size()) + " -> " + std::to_string(ids1.size()) + " threads)");
+            continue;
+        }
+        match.pairs.emplace_back(ids0.empty() ? NO_THREAD : ids0[0], ids1.empty() ? NO_THREAD : ids1[0]);
+    }
+    // the base order, the roles new in the second log go last
+    std::stable_sort(match.pairs.begin(), match.pairs.end(), [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+        return (unsigned)a.first < (unsigned)b.first;
+    });
+}
+
+struct diff_row_t {
+    int thread_id; // of the base log, of the new one for a new role
+    unsigned path; // call path or function name
+    uint64_t incl[2];
+    uint64_t excl[2];
+    unsigned count[2];
+    double z;
+    double impact; // change of the exclusive time per frame, percent of the base frame time
+};
+
+// Rows of the call paths of all threads or of the functions, the paths are kept as
+// (parent, name) entries and spelled out when printed
+class DiffBuilder {
+public:
+    DiffBuilder(const diff_side_t& base, const diff_side_t& cur, const thread_match_t& match) : _side{ &base, &cur }, _match(match) {}
+
+    void CollectPaths();
+    void CollectFunctions();
+
+    const std::vector<diff_row_t>& rows() const { return _rows; }
+    void write_path(BufferedWriter& w, unsigned path);
+
+private:
+    struct path_t {
+        unsigned parent; // 0 is an empty path
+        const char* name;
+    };
+    template<class item_t>
+    void add_row(unsigned path, const item_t* const item[2], const uint64_t incl[2], const uint64_t children[2], const unsigned sample[2], bool function);
+    void walk(const Node* const node[2], const unsigned sample[2], unsigned path);
+    unsigned name_id(int k, const char* name);
+    void reset();
+
+    const diff_side_t* _side[2];
+    const thread_match_t& _match;
+    const NodeView* _view[2];
+    int _thread_id[2] = { 0, 0 };
+    std::vector<diff_row_t> _rows;
+    std::vector<path_t> _paths;
+    std::unordered_map<const char*, unsigned> _name_ids[2]; // the tree names are interned
+    std::vector<const Node*> _children[2];                  // scratch of walk()
+    std::vector<std::pair<const Node*, const Node*> > _pairs;
+    std::vector<const char*> _names;                        // scratch of write_path()
+};
+
+void DiffBuilder::reset()
+{
+    _rows.clear();
+    _paths.assign(1, path_t{ 0, NULL });
+}
+
+void DiffBuilder::write_path(BufferedWriter& w, unsigned path)
+{
+    _names.clear();
+    for (; path != 0; path = _paths[path].parent) {
+        _names.push_back(_paths[path].name);
+    }
+    for (size_t i = _names.size(); i-- > 0; ) {
+        w.puts(_names[i]);
+        if (i) {
+            w.write(" > ", 3);
+        }
+    }
+}
+
+unsigned DiffBuilder::name_id(int k, const char* name)
+{
+    auto it = _name_ids[k].find(name);
+    if (it == _name_ids[k].end()) {
+        it = _name_ids[k].emplace(name, _side[k]->samples->name_id(name)).first;
+    }
+    return it->second;
+}
+
+template<class item_t>
+void DiffBuilder::add_row(unsigned path, const item_t* const item[2], const uint64_t incl[2], const uint64_t children[2], const unsigned sample[2], bool function)
+{
+    diff_row_t row;
+    row.thread_id = _thread_id[0] != NO_THREAD ? _thread_id[0] : _thread_id[1];
+    row.path = path;
+    FrameSamples::moments_t moments[2];
+    for (int k = 0; k < 2; k++) {
+        row.incl[k] = incl[k];
+        row.excl[k] = incl[k] > children[k] ? incl[k] - children[k] : 0;
+        row.count[k] = item[k] ? item[k]->count() : 0;
+        if (item[k]) {
+            moments[k] = function ? _side[k]->samples->function(_thread_id[k], sample[k]) : _side[k]->samples->path(_thread_id[k], sample[k]);
+        }
+    }
+    if (row.incl[0] == row.incl[1] && row.excl[0] == row.excl[1] && row.count[0] == row.count[1]) {
+        return;
+    }
+    row.z = welch_z(moments[0], _side[0]->samples->num_frames(), moments[1], _side[1]->samples->num_frames());
+    row.impact = 0;
+    if (_side[0]->frame_realtime && _side[1]->frame_count) {
+        double per_frame_base = (double)row.excl[0] / _side[0]->frame_count;
+        double per_frame_cur = (double)row.excl[1] / _side[1]->frame_count;
+        row.impact = 100. * (per_frame_cur - per_frame_base) * _side[0]->frame_count / _side[0]->frame_realtime;
+    }
+    _rows.push_back(row);
+}
+
+// The children of both trees are sorted by name and merged, the scratch vectors grow
+// with the depth and are truncated back on return
+void DiffBuilder::walk(const Node* const node[2], const unsigned sample[2], unsigned path)
+{
+    auto by_name = [](const Node* a, const Node* b) { return strcmp(a->name(), b->name()) < 0; };
+    size_t first[2], last[2];
+    for (int k = 0; k < 2; k++) {
+        first[k] = _children[k].size();
+        if (node[k]) {
+            for (const auto& child : node[k]->children()) {
+                _children[k].push_back(&child);
+            }
+        }
+        last[k] = _children[k].size();
+        std::sort(_children[k].begin() + first[k], _children[k].end(), by_name);
+    }
+    size_t pairs_first = _pairs.size();
+    for (size_t i = first[0], j = first[1]; i < last[0] || j < last[1]; ) {
+        int cmp = i == last[0] ? 1 : j == last[1] ? -1 : strcmp(_children[0][i]->name(), _children[1][j]->name());
+        _pairs.emplace_back(cmp <= 0 ? _children[0][i++] : nullptr, cmp >= 0 ? _children[1][j++] : nullptr);
+    }
+    _children[0].resize(first[0]);
+    _children[1].resize(first[1]);
+
+    size_t pairs_last = _pairs.size();
+    for (size_t i = pairs_first; i < pairs_last; i++) {
+        const Node* child[2] = { _pairs[i].first, _pairs[i].second };
+        const char* name = child[0] ? child[0]->name() : child[1]->name();
+        unsigned child_sample[2];
+        uint64_t incl[2] = { 0, 0 }, children[2] = { 0, 0 };
+        for (int k = 0; k < 2; k++) {
+            child_sample[k] = FrameSamples::NONE;
+            if (child[k]) {
+                child_sample[k] = _side[k]->samples->child(_thread_id[k], sample[k], name_id(k, name));
+                incl[k] = _view[k]->realtime_used(*child[k]);
+                children[k] = _view[k]->children_realtime_used(*child[k]);
+            }
+        }
+        _paths.push_back(path_t{ path, name });
+        unsigned child_path = (unsigned)_paths.size() - 1;
+        add_row(child_path, child, incl, children, child_sample, false);
+        walk(child, child_sample, child_path);
+    }
+    _pairs.resize(pairs_first);
+}
+
+void DiffBuilder::CollectPaths()
+{
+    reset();
+    for (const auto& pair : _match.pairs) {
+        _thread_id[0] = pair.first;
+        _thread_id[1] = pair.second;
+        for (int k = 0; k < 2; k++) {
+            auto it = _side[k]->threads->find(_thread_id[k]);
+            _view[k] = it == _side[k]->threads->end() ? nullptr : &it->second;
+        }
+        const Node* root[2] = { _view[0] ? &_view[0]->root() : nullptr, _view[1] ? &_view[1]->root() : nullptr };
+        const unsigned sample[2] = { 0, 0 };
+        walk(root, sample, 0);
+    }
+}
+
+void DiffBuilder::CollectFunctions()
+{
+    reset();
+    auto by_name = [](const Stat* a, const Stat* b) { return strcmp(a->name(), b->name()) < 0; };
+    for (const auto& pair : _match.pairs) {
+        _thread_id[0] = pair.first;
+        _thread_id[1] = pair.second;
+        std::vector<const Stat*> stats[2];
+        for (int k = 0; k < 2; k++) {
+            auto it = _side[k]->stats->find(_thread_id[k]);
+            if (it != _side[k]->stats->end()) {
+                for (const auto& stat : it->second) {
+                    stats[k].push_back(&stat);
+                }
+            }
+            std::sort(stats[k].begin(), stats[k].end(), by_name);
+        }
+        for (size_t i = 0, j = 0; i < stats[0].size() || j < stats[1].size(); ) {
+            int cmp = i == stats[0].size() ? 1 : j == stats[1].size() ? -1 : strcmp(stats[0][i]->name(), stats[1][j]->name());
+            const Stat* stat[2] = { cmp <= 0 ? stats[0][i++] : nullptr, cmp >= 0 ? stats[1][j++] : nullptr };
+            unsigned sample[2] = { FrameSamples::NONE, FrameSamples::NONE };
+            uint64_t incl[2] = { 0, 0 }, children[2] = { 0, 0 };
+            for (int k = 0; k < 2; k++) {
+                if (stat[k]) {
+                    sample[k] = name_id(k, stat[k]->name());
+                    incl[k] = stat[k]->realtime_used();
+                    children[k] = stat[k]->children_realtime_used();
+                }
+            }
+            _paths.push_back(path_t{ 0, stat[0] ? stat[0]->name() : stat[1]->name() });
+            add_row((unsigned)_paths.size() - 1, stat, incl, children, sample, true);
+        }
+    }
+}
+
+#define DIFF_LINE_WIDTH 100
+
+static void print_header(BufferedWriter& w, const std::string& name)
+{
+    w.fill('-', DIFF_LINE_WIDTH);
+    w.put('\n');
+    w.write(name);
+    w.put('\n');
+    w.fill('-', DIFF_LINE_WIDTH);
+    w.put('\n');
+}
+
+static bool significant(double z, const diff_options_t& options)
+{
+    return !std::isnan(z) && fabs(z) >= options.z_threshold;
+}
+
+static void print_rows(BufferedWriter& w, const char* title, DiffBuilder& builder,
+    const diff_side_t& base, const diff_side_t& cur, const diff_options_t& options, diff_result_t& result)
+{
+    const std::vector<diff_row_t>& rows = builder.rows();
+    std::vector<std::pair<double, unsigned> > order; // rows by impact, the collection order for ties
+    order.reserve(rows.size());
+    for (size_t i = 0; i < rows.size(); i++) {
+        order.emplace_back(-fabs(rows[i].impact), (unsigned)i);
+    }
+    std::sort(order.begin(), order.end());
+
+    print_header(w, std::string(title) + " [ " + std::to_string(rows.size()) + " changed ]");
+    w.printf("%3s %6s %7s %6s %7s %10s %10s %9s %9s %7s %7s  %s\n", "th",
+        "inc%", "dinc%", "exc%", "dexc%", "fps", "dfps", "call/fr", "dcall/fr", "imp%", "z", "name");
+    const diff_side_t* side[2] = { &base, &cur };
+    bool percents = base.frame_realtime && cur.frame_realtime;
+    for (const auto& item : order) {
+        const diff_row_t& row = rows[item.second];
+        double inc[2], exc[2], fps[2], calls[2];
+        for (int k = 0; k < 2; k++) {
+            uint64_t frame_realtime = side[k]->frame_realtime;
+            unsigned frame_count = side[k]->frame_count;
+            inc[k] = frame_realtime ? 100. * row.incl[k] / frame_realtime : 0;
+            exc[k] = frame_realtime ? 100. * row.excl[k] / frame_realtime : 0;
+            fps[k] = row.incl[k] ? 1e9 * frame_count / row.incl[k] : 0;
+            calls[k] = frame_count ? (double)row.count[k] / frame_count : 0;
+        }
+        // the rows are formatted in place, a large diff has as many rows as the trees
+        w.put_fixed(row.thread_id, 3, 0);
+        if (percents) {
+            w.put(' '); w.put_fixed(inc[1], 6, 2);
+            w.put(' '); w.put_fixed(inc[1] - inc[0], 7, 2, true);
+            w.put(' '); w.put_fixed(exc[1], 6, 2);
+            w.put(' '); w.put_fixed(exc[1] - exc[0], 7, 2, true);
+        } else {
+            w.printf(" %6s %7s %6s %7s", "-", "-", "-", "-");
+        }
+        w.put(' ');
+        if (fps[1]) {
+            w.put_fixed(fps[1], 10, 1);
+        } else {
+            w.printf("%10s", "-");
+        }
+        w.put(' ');
+        if (fps[0] && fps[1]) {
+            w.put_fixed(fps[1] - fps[0], 10, 1, true);
+        } else {
+            w.printf("%10s", "-");
+        }
+        w.put(' '); w.put_fixed(calls[1], 9, 2);
+        w.put(' '); w.put_fixed(calls[1] - calls[0], 9, 2, true);
+        w.put(' '); w.put_fixed(row.impact, 7, 2, true);
+        w.put(' ');
+        if (std::isnan(row.z)) {
+            w.printf("%7s ", "-");
+        } else {
+            w.put_fixed(row.z, 7, 1, true);
+            w.put(significant(row.z, options) ? '*' : ' ');
+        }
+        w.put(' ');
+        builder.write_path(w, row.path);
+        w.put('\n');
+
+        if (significant(row.z, options)) {
+            result.num_significant++;
+            result.max_regression_percent = std::max(result.max_regression_percent, row.impact);
+        }
+    }
+    w.put('\n');
+}
+
+static void print_frames(BufferedWriter& w, const diff_side_t& base, const diff_side_t& cur, const diff_options_t& options, diff_result_t& result)
+{
+    print_header(w, std::string("Differential report: ") + base.name + " -> " + cur.name);
+    w.printf("%-6s %9s %12s %10s\n", "", "frames", "ms/frame", "fps");
+    const diff_side_t* side[2] = { &base, &cur };
+    double frame_ms[2] = { 0, 0 };
+    for (int k = 0; k < 2; k++) {
+        unsigned frame_count = side[k]->frame_count;
+        frame_ms[k] = frame_count ? 1e-6 * side[k]->frame_realtime / frame_count : 0;
+        w.printf("%-6s %9u %12.3f", k ? "new" : "base", frame_count, frame_ms[k]);
+        if (frame_ms[k] > 0) {
+            w.printf(" %10.1f\n", 1e3 / frame_ms[k]);
+        } else {
+            w.printf(" %10s\n", "-");
+        }
+    }
+    if (frame_ms[0] > 0 && frame_ms[1] > 0) {
+        double change = 100. * (frame_ms[1] - frame_ms[0]) / frame_ms[0];
+        double z = welch_z(base.samples->frame_time(), base.samples->num_frames(), cur.samples->frame_time(), cur.samples->num_frames());
+        w.printf("%-6s %9s %+11.2f%% %+10.1f", "change", "", change, 1e3 / frame_ms[1] - 1e3 / frame_ms[0]);
+        if (std::isnan(z)) {
+            w.printf("  z -\n");
+        } else {
+            w.printf("  z %+.1f%s\n", z, significant(z, options) ? " *" : "");
+        }
+        if (significant(z, options)) {
+            result.num_significant++;
+            result.max_regression_percent = std::max(result.max_regression_percent, change);
+        }
+    }
+    w.put('\n');
+}
+
+static void print_threads(BufferedWriter& w, const thread_match_t& match)
+{
+    w.printf("Threads: %zu compared by role, the frame thread with the frame thread, th is the base thread id\n", match.pairs.size());
+    if (!match.pools.empty()) {
+        w.printf("Pools, not compared:");
+        for (size_t i = 0; i < match.pools.size(); i++) {
+            w.printf("%s %s", i ? "," : "", match.pools[i].c_str());
+        }
+        w.put('\n');
+    }
+    w.put('\n');
+}
+
+void WriteDiff(BufferedWriter& w, const diff_side_t& base, const diff_side_t& cur, const diff_options_t& options, diff_result_t& result)
+{
+    result = diff_result_t();
+    print_frames(w, base, cur, options, result);
+
+    thread_match_t match;
+    match_threads(base, cur, match);
+    print_threads(w, match);
+
+    DiffBuilder builder(base, cur, match);
+    builder.CollectPaths();
+    print_rows(w, "Call paths", builder, base, cur, options, result);
+    builder.CollectFunctions();
+    print_rows(w, "Functions", builder, base, cur, options, result);
+}
+
+}
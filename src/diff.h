@@ -0,0 +1,87 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+
+namespace fpsprof {
+
+class NodeView;
+class Stat;
+class BufferedWriter;
+struct frame_range_t;
+
+struct diff_options_t {
+    double z_threshold = 3; // a change is significant when |z| of the per-frame time reaches it
+};
+
+struct diff_result_t {
+    unsigned num_significant = 0;
+    // the largest significant growth of the exclusive time per frame, percent of the base frame time
+    double max_regression_percent = 0;
+};
+
+// Per-frame exclusive time of every call path and every function of a log, the noise estimate
+// of the differential report. An event belongs to the frame its top-level scope started in,
+// the frames are the top-level frame scopes of the frame thread.
+class FrameSamples {
+public:
+    enum : unsigned { NONE = ~0u };
+
+    struct moments_t {
+        double sum = 0;
+        double sum_sq = 0;
+    };
+
+    FrameSamples();
+    ~FrameSamples();
+    FrameSamples(const FrameSamples&) = delete;
+    FrameSamples& operator= (const FrameSamples&) = delete;
+
+    bool Collect(const char* filename, const frame_range_t& range);
+
+    unsigned num_frames() const { return _num_frames; }
+    const moments_t& frame_time() const { return _frame_time; }
+
+    // NONE if the name is not in the log
+    unsigned name_id(const char* name) const;
+    // path 0 is the root of a thread, NONE if the path is not in the log
+    unsigned child(int thread_id, unsigned parent, unsigned name_id) const;
+    moments_t path(int thread_id, unsigned path) const;
+    moments_t function(int thread_id, unsigned name_id) const;
+
+private:
+    struct accum_t;
+    struct thread_t;
+
+    std::vector<std::string> _names;
+    std::unordered_map<std::string, unsigned> _name_ids;
+    std::map<int, std::unique_ptr<thread_t> > _threads;
+    unsigned _num_frames = 0;
+    moments_t _frame_time;
+};
+
+// one log of the comparison: the compensated full trees and their statistics
+struct diff_side_t {
+    const char* name;
+    const std::map<int, NodeView>* threads;
+    const std::map<int, std::list<Stat> >* stats;
+    const FrameSamples* samples;
+    uint64_t frame_realtime;
+    unsigned frame_count;
+};
+
+// Frame summary, call paths and functions of both logs aligned by name,
+// sorted by the change of the exclusive time per frame
+void WriteDiff(BufferedWriter& w, const diff_side_t& base, const diff_side_t& cur, const diff_options_t& options, diff_result_t& result);
+
+}
@@ -7,6 +7,7 @@
 
 #include <list>
 #include <assert.h>
+#include <stdlib.h>
 
 #include "timers.h"
 
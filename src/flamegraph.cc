@@ -0,0 +1,191 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "flamegraph.h"
+#include "node.h"
+#include "writer.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace fpsprof {
+
+static uint64_t exclusive_time(const NodeView& view, const Node& node)
+{
+    uint64_t incl = view.realtime_used(node), children = view.children_realtime_used(node);
+    return incl > children ? incl - children : 0; // the compensation may overshoot
+}
+
+// ';' separates the frames, the count follows the last space
+static void append_frame_name(std::string& path, const char* name)
+{
+    for (; *name; name++) {
+        path += (*name == ';' || *name == '\n') ? '_' : *name;
+    }
+}
+
+static void write_folded(BufferedWriter& w, const NodeView& view, const Node& node, std::string& path)
+{
+    size_t len = path.size();
+    path += ';';
+    append_frame_name(path, node.name());
+    uint64_t excl = exclusive_time(view, node);
+    if (excl) {
+        w.write(path);
+        w.put(' ');
+        w.put_uint(excl);
+        w.put('\n');
+    }
+    for (const auto& child : node.children()) {
+        write_folded(w, view, child, path);
+    }
+    path.resize(len);
+}
+
+void WriteFolded(BufferedWriter& w, const std::map<int, NodeView>& threads)
+{
+    std::string path;
+    for (const auto& thread : threads) {
+        path = "thread " + std::to_string(thread.first);
+        for (const auto& child : thread.second.root().children()) {
+            write_folded(w, thread.second, child, path);
+        }
+    }
+}
+
+#define SVG_WIDTH 1200
+#define SVG_PAD 10
+#define SVG_TITLE_HEIGHT 40
+#define SVG_FRAME_HEIGHT 16
+#define SVG_FONT_SIZE 12
+#define SVG_CHAR_WIDTH (0.59 * SVG_FONT_SIZE)
+#define SVG_MIN_WIDTH 0.1 // px, narrower frames and their children are not drawn
+
+struct flame_frame_t {
+    const char* name; // NULL for the thread frames
+    int thread_id;
+    unsigned depth;
+    uint64_t x, width, self; // nsec
+};
+
+static void collect_frames(const NodeView& view, const Node& node, int thread_id, unsigned depth, uint64_t x,
+    double min_width, std::vector<flame_frame_t>& frames)
+{
+    uint64_t width = view.realtime_used(node);
+    if (width < min_width) {
+        return;
+    }
+    frames.push_back({ node.name(), thread_id, depth, x, width, exclusive_time(view, node) });
+    for (const auto& child : node.children()) {
+        collect_frames(view, child, thread_id, depth + 1, x, min_width, frames);
+        x += view.realtime_used(child);
+    }
+}
+
+static void put_xml_text(BufferedWriter& w, const char* s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        switch (s[i]) {
+        case '&': w.puts("&amp;"); break;
+        case '<': w.puts("&lt;"); break;
+        case '>': w.puts("&gt;"); break;
+        case '"': w.puts("&quot;"); break;
+        default: w.put(s[i]); break;
+        }
+    }
+}
+
+// flamegraph.pl "hot" palette, the color is stable for a name
+static void put_color(BufferedWriter& w, const char* name)
+{
+    uint32_t h = 2166136261u;
+    for (const char* p = name; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    unsigned r = 205 + (h & 0xff) * 50 / 255, g = ((h >> 8) & 0xff) * 230 / 255, b = ((h >> 16) & 0xff) * 55 / 255;
+    w.printf("rgb(%u,%u,%u)", r, g, b);
+}
+
+void WriteFlameGraphSvg(BufferedWriter& w, const std::map<int, NodeView>& threads, const char* title)
+{
+    uint64_t total = 0;
+    for (const auto& thread : threads) {
+        total += thread.second.children_realtime_used(thread.second.root());
+    }
+    double scale = total ? (double)(SVG_WIDTH - 2 * SVG_PAD) / total : 0;
+    double min_width = total ? SVG_MIN_WIDTH / scale : 1;
+
+    // "all" at depth 0, the threads at depth 1
+    std::vector<flame_frame_t> frames;
+    frames.push_back({ "all", -1, 0, 0, total, 0 });
+    uint64_t x = 0;
+    for (const auto& thread : threads) {
+        const NodeView& view = thread.second;
+        uint64_t width = view.children_realtime_used(view.root());
+        if (width >= min_width) {
+            frames.push_back({ NULL, thread.first, 1, x, width, 0 });
+            uint64_t cx = x;
+            for (const auto& child : view.root().children()) {
+                collect_frames(view, child, thread.first, 2, cx, min_width, frames);
+                cx += view.realtime_used(child);
+            }
+        }
+        x += width;
+    }
+    unsigned depth_max = 0;
+    for (const auto& frame : frames) {
+        depth_max = std::max(depth_max, frame.depth);
+    }
+    unsigned height = SVG_TITLE_HEIGHT + (depth_max + 1) * SVG_FRAME_HEIGHT + 2 * SVG_PAD;
+
+    w.puts("<?xml version=\"1.0\" standalone=\"no\"?>\n");
+    w.printf("<svg version=\"1.1\" width=\"%u\" height=\"%u\" viewBox=\"0 0 %u %u\" xmlns=\"http://www.w3.org/2000/svg\">\n",
+        SVG_WIDTH, height, SVG_WIDTH, height);
+    w.printf("<style>text{font-family:Verdana,sans-serif;font-size:%upx;fill:#000}rect{stroke:#fff;stroke-width:0.5}</style>\n", SVG_FONT_SIZE);
+    w.puts("<rect x=\"0\" y=\"0\" width=\"100%\" height=\"100%\" fill=\"#f8f8f8\" style=\"stroke:none\"/>\n");
+    w.printf("<text x=\"%u\" y=\"%u\" text-anchor=\"middle\" style=\"font-size:17px\">", SVG_WIDTH / 2, SVG_TITLE_HEIGHT / 2 + SVG_PAD);
+    put_xml_text(w, title, strlen(title));
+    w.puts("</text>\n");
+
+    std::string name;
+    for (const auto& frame : frames) {
+        name = frame.name ? frame.name : "thread " + std::to_string(frame.thread_id);
+        double fx = SVG_PAD + frame.x * scale;
+        double fw = frame.width * scale;
+        unsigned fy = height - SVG_PAD - (frame.depth + 1) * SVG_FRAME_HEIGHT;
+
+        w.puts("<g><title>");
+        put_xml_text(w, name.c_str(), name.size());
+        w.printf(" (%.3f ms, %.2f%%", frame.width * 1e-6, total ? 100. * frame.width / total : 0);
+        if (frame.self) {
+            w.printf(", self %.3f ms", frame.self * 1e-6);
+        }
+        w.printf(")</title><rect x=\"%.1f\" y=\"%u\" width=\"%.1f\" height=\"%u\" fill=\"", fx, fy, fw, SVG_FRAME_HEIGHT - 1);
+        if (frame.name) {
+            put_color(w, frame.name);
+        } else {
+            w.puts("rgb(200,200,200)");
+        }
+        w.puts("\"/>");
+        int fit = (int)((fw - 6) / SVG_CHAR_WIDTH);
+        if (fit >= 3) {
+            w.printf("<text x=\"%.1f\" y=\"%u\">", fx + 3, fy + SVG_FRAME_HEIGHT - 4);
+            if ((size_t)fit >= name.size()) {
+                put_xml_text(w, name.c_str(), name.size());
+            } else {
+                put_xml_text(w, name.c_str(), fit - 2);
+                w.puts("..");
+            }
+            w.puts("</text>");
+        }
+        w.puts("</g>\n");
+    }
+    w.puts("</svg>\n");
+}
+
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <map>
+
+namespace fpsprof {
+
+class NodeView;
+class BufferedWriter;
+
+// Collapsed stacks, one line per call path: "thread N;outer;inner <exclusive nsec>".
+// The input of flamegraph.pl, speedscope and most of the flame graph tools.
+void WriteFolded(BufferedWriter& w, const std::map<int, NodeView>& threads);
+
+// Self-contained SVG flame graph of the same stacks: the width is the inclusive time,
+// the threads are the children of the "all" frame. No script, a frame tooltip shows the time.
+void WriteFlameGraphSvg(BufferedWriter& w, const std::map<int, NodeView>& threads, const char* title);
+
+}
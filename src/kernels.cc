@@ -0,0 +1,563 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define FPSPROF_X86 1
+    #include <immintrin.h>
+    #if _MSC_VER && !__clang__
+        #include <intrin.h>
+        #define _target_sse4
+        #define _target_avx2
+    #else
+        #define _target_sse4 __attribute__ ((target("sse4.2")))
+        #define _target_avx2 __attribute__ ((target("avx2")))
+    #endif
+#endif
+
+namespace fpsprof {
+
+struct kernels_t {
+    const char* name;
+    void (*minmax_u64)(const uint64_t* data, size_t n, uint64_t& min, uint64_t& max);
+    uint64_t (*sum_u64)(const uint64_t* data, size_t n);
+    uint64_t (*sum_below_u64)(const uint64_t* data, size_t n, uint64_t limit, size_t& count);
+    void (*histogram_u64)(const uint64_t* data, size_t n, uint64_t bin_width, uint32_t* hist, size_t hist_size);
+    double (*sum_f64)(const double* data, size_t n);
+    double (*sum_sq_dev_f64)(const double* data, size_t n, double mean);
+    double (*sum_in_range_f64)(const double* data, size_t n, double lo, double hi, size_t& count);
+};
+
+/*
+    Scalar reference
+*/
+static void minmax_u64_scalar(const uint64_t* data, size_t n, uint64_t& min, uint64_t& max)
+{
+    uint64_t lo = UINT64_MAX, hi = 0;
+    for (size_t i = 0; i < n; i++) {
+        lo = data[i] < lo ? data[i] : lo;
+        hi = data[i] > hi ? data[i] : hi;
+    }
+    min = lo;
+    max = hi;
+}
+
+static uint64_t sum_u64_scalar(const uint64_t* data, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static uint64_t sum_below_u64_scalar(const uint64_t* data, size_t n, uint64_t limit, size_t& count)
+{
+    uint64_t sum = 0;
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (data[i] < limit) {
+            sum += data[i];
+            cnt += 1;
+        }
+    }
+    count = cnt;
+    return sum;
+}
+
+static void histogram_u64_scalar(const uint64_t* data, size_t n, uint64_t bin_width, uint32_t* hist, size_t hist_size)
+{
+    for (size_t i = 0; i < n; i++) {
+        size_t idx = (size_t)(data[i] / bin_width);
+        hist[idx < hist_size ? idx : hist_size - 1] += 1;
+    }
+}
+
+static double sum_f64_scalar(const double* data, size_t n)
+{
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static double sum_sq_dev_f64_scalar(const double* data, size_t n, double mean)
+{
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += (data[i] - mean)*(data[i] - mean);
+    }
+    return sum;
+}
+
+static double sum_in_range_f64_scalar(const double* data, size_t n, double lo, double hi, size_t& count)
+{
+    double sum = 0;
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (lo < data[i] && data[i] < hi) {
+            sum += data[i];
+            cnt += 1;
+        }
+    }
+    count = cnt;
+    return sum;
+}
+
+static const kernels_t g_scalar = {
+    "scalar",
+    minmax_u64_scalar, sum_u64_scalar, sum_below_u64_scalar, histogram_u64_scalar,
+    sum_f64_scalar, sum_sq_dev_f64_scalar, sum_in_range_f64_scalar,
+};
+
+#if FPSPROF_X86
+
+// The vector kernels compute the bin index in double precision and clamp it to the last bin.
+// Below 2^52 all the products are exact and the index is corrected in the vector registers,
+// otherwise the increment loop fixes the index up with integer math.
+static const double k_exact_limit = 4503599627370496.; // 2^52
+
+// Neighbour values tend to hit the same bin, so the increments go round-robin to four
+// copies of the histogram to avoid waiting on the previous store.
+static inline void histogram_increment(const uint64_t* data, const int32_t* bins, size_t n, uint64_t bin_width, bool exact, uint32_t* hist4, size_t hist_size)
+{
+    if (exact) {
+        for (size_t i = 0; i < n; i += 4) {
+            hist4[bins[i]] += 1;
+            hist4[hist_size + bins[i + 1]] += 1;
+            hist4[2*hist_size + bins[i + 2]] += 1;
+            hist4[3*hist_size + bins[i + 3]] += 1;
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint64_t q = (uint32_t)bins[i];
+        while (q > 0 && q*bin_width > data[i]) {
+            q -= 1;
+        }
+        while (q + 1 < hist_size && (q + 1)*bin_width <= data[i]) {
+            q += 1;
+        }
+        hist4[(i & 3)*hist_size + q] += 1;
+    }
+}
+
+template<class bins_fn_t>
+static inline void histogram_simd(const uint64_t* data, size_t n, uint64_t bin_width, uint32_t* hist, size_t hist_size, bins_fn_t bins_fn)
+{
+    bool exact = (double)bin_width*(hist_size + 1) < k_exact_limit;
+    std::vector<uint32_t> hist4(4*hist_size);
+    int32_t bins[256];
+    while (n >= 4) {
+        size_t m = n < 256 ? n & ~(size_t)3 : 256;
+        bins_fn(data, m, bins);
+        histogram_increment(data, bins, m, bin_width, exact, hist4.data(), hist_size);
+        data += m;
+        n -= m;
+    }
+    histogram_u64_scalar(data, n, bin_width, hist, hist_size);
+    for (size_t i = 0; i < hist_size; i++) {
+        hist[i] += hist4[i] + hist4[hist_size + i] + hist4[2*hist_size + i] + hist4[3*hist_size + i];
+    }
+}
+
+/*
+    SSE4.2
+*/
+_target_sse4 static inline __m128d u64_to_f64_sse4(__m128i x)
+{
+    // exact for the low and high halves, a single rounding on the final add
+    const __m128i lo_exp = _mm_set1_epi64x(0x4330000000000000ll); // 2^52
+    const __m128i hi_exp = _mm_set1_epi64x(0x4530000000000000ll); // 2^84
+    const __m128d bias = _mm_set1_pd(19342813118337666422669312.); // 2^84 + 2^52
+    __m128i lo = _mm_blend_epi16(x, lo_exp, 0xcc);
+    __m128i hi = _mm_or_si128(_mm_srli_epi64(x, 32), hi_exp);
+    return _mm_add_pd(_mm_sub_pd(_mm_castsi128_pd(hi), bias), _mm_castsi128_pd(lo));
+}
+
+_target_sse4 static void minmax_u64_sse4(const uint64_t* data, size_t n, uint64_t& min, uint64_t& max)
+{
+    // unsigned compare by flipping the sign bit
+    const __m128i sign = _mm_set1_epi64x(INT64_MIN);
+    __m128i lo = _mm_set1_epi64x(INT64_MAX), hi = _mm_set1_epi64x(INT64_MIN);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data + i)), sign);
+        lo = _mm_blendv_epi8(lo, x, _mm_cmpgt_epi64(lo, x));
+        hi = _mm_blendv_epi8(hi, x, _mm_cmpgt_epi64(x, hi));
+    }
+    uint64_t l[2], h[2];
+    _mm_storeu_si128((__m128i*)l, _mm_xor_si128(lo, sign));
+    _mm_storeu_si128((__m128i*)h, _mm_xor_si128(hi, sign));
+    minmax_u64_scalar(data + i, n - i, min, max);
+    for (int k = 0; k < 2; k++) {
+        min = l[k] < min ? l[k] : min;
+        max = h[k] > max ? h[k] : max;
+    }
+}
+
+_target_sse4 static uint64_t sum_u64_sse4(const uint64_t* data, size_t n)
+{
+    __m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_epi64(s0, _mm_loadu_si128((const __m128i*)(data + i)));
+        s1 = _mm_add_epi64(s1, _mm_loadu_si128((const __m128i*)(data + i + 2)));
+    }
+    uint64_t s[2];
+    _mm_storeu_si128((__m128i*)s, _mm_add_epi64(s0, s1));
+    return s[0] + s[1] + sum_u64_scalar(data + i, n - i);
+}
+
+_target_sse4 static uint64_t sum_below_u64_sse4(const uint64_t* data, size_t n, uint64_t limit, size_t& count)
+{
+    const __m128i sign = _mm_set1_epi64x(INT64_MIN);
+    const __m128i lim = _mm_xor_si128(_mm_set1_epi64x((int64_t)limit), sign);
+    __m128i sum = _mm_setzero_si128(), cnt = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i mask = _mm_cmpgt_epi64(lim, _mm_xor_si128(x, sign));
+        sum = _mm_add_epi64(sum, _mm_and_si128(mask, x));
+        cnt = _mm_sub_epi64(cnt, mask);
+    }
+    uint64_t s[2], c[2];
+    _mm_storeu_si128((__m128i*)s, sum);
+    _mm_storeu_si128((__m128i*)c, cnt);
+    uint64_t tail = sum_below_u64_scalar(data + i, n - i, limit, count);
+    count += (size_t)(c[0] + c[1]);
+    return s[0] + s[1] + tail;
+}
+
+_target_sse4 static void histogram_bins_sse4(const uint64_t* data, size_t n, uint64_t bin_width, size_t hist_size, int32_t* bins)
+{
+    const __m128d w = _mm_set1_pd((double)bin_width), inv_w = _mm_set1_pd(1./bin_width);
+    const __m128d one = _mm_set1_pd(1.), last = _mm_set1_pd((double)(hist_size - 1));
+    for (size_t i = 0; i < n; i += 2) {
+        __m128d x = u64_to_f64_sse4(_mm_loadu_si128((const __m128i*)(data + i)));
+        __m128d q = _mm_floor_pd(_mm_mul_pd(x, inv_w));
+        q = _mm_sub_pd(q, _mm_and_pd(_mm_cmpgt_pd(_mm_mul_pd(q, w), x), one));
+        q = _mm_add_pd(q, _mm_and_pd(_mm_cmple_pd(_mm_mul_pd(_mm_add_pd(q, one), w), x), one));
+        _mm_storel_epi64((__m128i*)(bins + i), _mm_cvttpd_epi32(_mm_min_pd(q, last)));
+    }
+}
+
+static void histogram_u64_sse4(const uint64_t* data, size_t n, uint64_t bin_width, uint32_t* hist, size_t hist_size)
+{
+    histogram_simd(data, n, bin_width, hist, hist_size, [=](const uint64_t* data, size_t n, int32_t* bins) {
+        histogram_bins_sse4(data, n, bin_width, hist_size, bins);
+    });
+}
+
+_target_sse4 static double hsum_sse4(__m128d v)
+{
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+_target_sse4 static double sum_f64_sse4(const double* data, size_t n)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(data + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(data + i + 2));
+    }
+    return hsum_sse4(_mm_add_pd(s0, s1)) + sum_f64_scalar(data + i, n - i);
+}
+
+_target_sse4 static double sum_sq_dev_f64_sse4(const double* data, size_t n, double mean)
+{
+    const __m128d m = _mm_set1_pd(mean);
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128d d0 = _mm_sub_pd(_mm_loadu_pd(data + i), m);
+        __m128d d1 = _mm_sub_pd(_mm_loadu_pd(data + i + 2), m);
+        s0 = _mm_add_pd(s0, _mm_mul_pd(d0, d0));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(d1, d1));
+    }
+    return hsum_sse4(_mm_add_pd(s0, s1)) + sum_sq_dev_f64_scalar(data + i, n - i, mean);
+}
+
+_target_sse4 static double sum_in_range_f64_sse4(const double* data, size_t n, double lo, double hi, size_t& count)
+{
+    const __m128d l = _mm_set1_pd(lo), h = _mm_set1_pd(hi);
+    __m128d sum = _mm_setzero_pd();
+    __m128i cnt = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(data + i);
+        __m128d mask = _mm_and_pd(_mm_cmplt_pd(l, x), _mm_cmplt_pd(x, h));
+        sum = _mm_add_pd(sum, _mm_and_pd(mask, x));
+        cnt = _mm_sub_epi64(cnt, _mm_castpd_si128(mask));
+    }
+    uint64_t c[2];
+    _mm_storeu_si128((__m128i*)c, cnt);
+    double tail = sum_in_range_f64_scalar(data + i, n - i, lo, hi, count);
+    count += (size_t)(c[0] + c[1]);
+    return hsum_sse4(sum) + tail;
+}
+
+static const kernels_t g_sse4 = {
+    "sse4",
+    minmax_u64_sse4, sum_u64_sse4, sum_below_u64_sse4, histogram_u64_sse4,
+    sum_f64_sse4, sum_sq_dev_f64_sse4, sum_in_range_f64_sse4,
+};
+
+/*
+    AVX2
+*/
+_target_avx2 static inline __m256d u64_to_f64_avx2(__m256i x)
+{
+    const __m256i lo_exp = _mm256_set1_epi64x(0x4330000000000000ll); // 2^52
+    const __m256i hi_exp = _mm256_set1_epi64x(0x4530000000000000ll); // 2^84
+    const __m256d bias = _mm256_set1_pd(19342813118337666422669312.); // 2^84 + 2^52
+    __m256i lo = _mm256_blend_epi32(x, lo_exp, 0xaa);
+    __m256i hi = _mm256_or_si256(_mm256_srli_epi64(x, 32), hi_exp);
+    return _mm256_add_pd(_mm256_sub_pd(_mm256_castsi256_pd(hi), bias), _mm256_castsi256_pd(lo));
+}
+
+_target_avx2 static void minmax_u64_avx2(const uint64_t* data, size_t n, uint64_t& min, uint64_t& max)
+{
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    __m256i lo = _mm256_set1_epi64x(INT64_MAX), hi = _mm256_set1_epi64x(INT64_MIN);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(data + i)), sign);
+        lo = _mm256_blendv_epi8(lo, x, _mm256_cmpgt_epi64(lo, x));
+        hi = _mm256_blendv_epi8(hi, x, _mm256_cmpgt_epi64(x, hi));
+    }
+    uint64_t l[4], h[4];
+    _mm256_storeu_si256((__m256i*)l, _mm256_xor_si256(lo, sign));
+    _mm256_storeu_si256((__m256i*)h, _mm256_xor_si256(hi, sign));
+    minmax_u64_scalar(data + i, n - i, min, max);
+    for (int k = 0; k < 4; k++) {
+        min = l[k] < min ? l[k] : min;
+        max = h[k] > max ? h[k] : max;
+    }
+}
+
+_target_avx2 static uint64_t sum_u64_avx2(const uint64_t* data, size_t n)
+{
+    __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_epi64(s0, _mm256_loadu_si256((const __m256i*)(data + i)));
+        s1 = _mm256_add_epi64(s1, _mm256_loadu_si256((const __m256i*)(data + i + 4)));
+    }
+    uint64_t s[4];
+    _mm256_storeu_si256((__m256i*)s, _mm256_add_epi64(s0, s1));
+    return s[0] + s[1] + s[2] + s[3] + sum_u64_scalar(data + i, n - i);
+}
+
+_target_avx2 static uint64_t sum_below_u64_avx2(const uint64_t* data, size_t n, uint64_t limit, size_t& count)
+{
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i lim = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)limit), sign);
+    __m256i sum = _mm256_setzero_si256(), cnt = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i mask = _mm256_cmpgt_epi64(lim, _mm256_xor_si256(x, sign));
+        sum = _mm256_add_epi64(sum, _mm256_and_si256(mask, x));
+        cnt = _mm256_sub_epi64(cnt, mask);
+    }
+    uint64_t s[4], c[4];
+    _mm256_storeu_si256((__m256i*)s, sum);
+    _mm256_storeu_si256((__m256i*)c, cnt);
+    uint64_t tail = sum_below_u64_scalar(data + i, n - i, limit, count);
+    count += (size_t)(c[0] + c[1] + c[2] + c[3]);
+    return s[0] + s[1] + s[2] + s[3] + tail;
+}
+
+_target_avx2 static void histogram_bins_avx2(const uint64_t* data, size_t n, uint64_t bin_width, size_t hist_size, int32_t* bins)
+{
+    const __m256d w = _mm256_set1_pd((double)bin_width), inv_w = _mm256_set1_pd(1./bin_width);
+    const __m256d one = _mm256_set1_pd(1.), last = _mm256_set1_pd((double)(hist_size - 1));
+    for (size_t i = 0; i < n; i += 4) {
+        __m256d x = u64_to_f64_avx2(_mm256_loadu_si256((const __m256i*)(data + i)));
+        __m256d q = _mm256_floor_pd(_mm256_mul_pd(x, inv_w));
+        q = _mm256_sub_pd(q, _mm256_and_pd(_mm256_cmp_pd(_mm256_mul_pd(q, w), x, _CMP_GT_OQ), one));
+        q = _mm256_add_pd(q, _mm256_and_pd(_mm256_cmp_pd(_mm256_mul_pd(_mm256_add_pd(q, one), w), x, _CMP_LE_OQ), one));
+        _mm_storeu_si128((__m128i*)(bins + i), _mm256_cvttpd_epi32(_mm256_min_pd(q, last)));
+    }
+}
+
+static void histogram_u64_avx2(const uint64_t* data, size_t n, uint64_t bin_width, uint32_t* hist, size_t hist_size)
+{
+    histogram_simd(data, n, bin_width, hist, hist_size, [=](const uint64_t* data, size_t n, int32_t* bins) {
+        histogram_bins_avx2(data, n, bin_width, hist_size, bins);
+    });
+}
+
+_target_avx2 static double hsum_avx2(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+_target_avx2 static double sum_f64_avx2(const double* data, size_t n)
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(data + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(data + i + 4));
+    }
+    return hsum_avx2(_mm256_add_pd(s0, s1)) + sum_f64_scalar(data + i, n - i);
+}
+
+_target_avx2 static double sum_sq_dev_f64_avx2(const double* data, size_t n, double mean)
+{
+    const __m256d m = _mm256_set1_pd(mean);
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(data + i), m);
+        __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(data + i + 4), m);
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(d0, d0));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(d1, d1));
+    }
+    return hsum_avx2(_mm256_add_pd(s0, s1)) + sum_sq_dev_f64_scalar(data + i, n - i, mean);
+}
+
+_target_avx2 static double sum_in_range_f64_avx2(const double* data, size_t n, double lo, double hi, size_t& count)
+{
+    const __m256d l = _mm256_set1_pd(lo), h = _mm256_set1_pd(hi);
+    __m256d sum = _mm256_setzero_pd();
+    __m256i cnt = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(data + i);
+        __m256d mask = _mm256_and_pd(_mm256_cmp_pd(l, x, _CMP_LT_OQ), _mm256_cmp_pd(x, h, _CMP_LT_OQ));
+        sum = _mm256_add_pd(sum, _mm256_and_pd(mask, x));
+        cnt = _mm256_sub_epi64(cnt, _mm256_castpd_si256(mask));
+    }
+    uint64_t c[4];
+    _mm256_storeu_si256((__m256i*)c, cnt);
+    double tail = sum_in_range_f64_scalar(data + i, n - i, lo, hi, count);
+    count += (size_t)(c[0] + c[1] + c[2] + c[3]);
+    return hsum_avx2(sum) + tail;
+}
+
+static const kernels_t g_avx2 = {
+    "avx2",
+    minmax_u64_avx2, sum_u64_avx2, sum_below_u64_avx2, histogram_u64_avx2,
+    sum_f64_avx2, sum_sq_dev_f64_avx2, sum_in_range_f64_avx2,
+};
+
+static int cpu_level() // 0 - scalar, 1 - sse4.2, 2 - avx2
+{
+#if _MSC_VER && !__clang__
+    int regs[4];
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    bool sse4 = (regs[2] & (1 << 20)) != 0;
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    bool avx = (regs[2] & (1 << 28)) != 0;
+    bool avx2 = false;
+    if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(regs, 7, 0);
+        avx2 = (regs[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    bool sse4 = __builtin_cpu_supports("sse4.2");
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return avx2 ? 2 : sse4 ? 1 : 0;
+}
+#endif
+
+static const kernels_t* select_kernels(const char* name)
+{
+    int level = 0;
+#if FPSPROF_X86
+    level = cpu_level();
+#endif
+    if (name) {
+        int requested = !strcmp(name, "avx2") ? 2 : !strcmp(name, "sse4") ? 1 : 0;
+        level = requested < level ? requested : level;
+    }
+#if FPSPROF_X86
+    if (level == 2) {
+        return &g_avx2;
+    }
+    if (level == 1) {
+        return &g_sse4;
+    }
+#endif
+    return &g_scalar;
+}
+
+static std::atomic<const kernels_t*> g_kernels{ NULL };
+
+static const kernels_t& kernels()
+{
+    const kernels_t* k = g_kernels.load(std::memory_order_relaxed);
+    if (!k) {
+        k = select_kernels(getenv("FPSPROF_SIMD"));
+        g_kernels.store(k, std::memory_order_relaxed);
+    }
+    return *k;
+}
+
+const char* simd_level()
+{
+    return kernels().name;
+}
+
+const char* set_simd_level(const char* name)
+{
+    const kernels_t* k = select_kernels(name);
+    g_kernels.store(k, std::memory_order_relaxed);
+    return k->name;
+}
+
+void minmax_u64(const uint64_t* data, size_t n, uint64_t& min, uint64_t& max)
+{
+    kernels().minmax_u64(data, n, min, max);
+}
+
+uint64_t sum_u64(const uint64_t* data, size_t n)
+{
+    return kernels().sum_u64(data, n);
+}
+
+uint64_t sum_below_u64(const uint64_t* data, size_t n, uint64_t limit, size_t& count)
+{
+    return kernels().sum_below_u64(data, n, limit, count);
+}
+
+void histogram_u64(const uint64_t* data, size_t n, uint64_t bin_width, uint32_t* hist, size_t hist_size)
+{
+    kernels().histogram_u64(data, n, bin_width, hist, hist_size);
+}
+
+double sum_f64(const double* data, size_t n)
+{
+    return kernels().sum_f64(data, n);
+}
+
+double sum_sq_dev_f64(const double* data, size_t n, double mean)
+{
+    return kernels().sum_sq_dev_f64(data, n, mean);
+}
+
+double sum_in_range_f64(const double* data, size_t n, double lo, double hi, size_t& count)
+{
+    return kernels().sum_in_range_f64(data, n, lo, hi, count);
+}
+
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace fpsprof {
+
+// Reductions over contiguous duration arrays. The implementation is picked once at runtime:
+// AVX2, SSE4.2 or scalar, FPSPROF_SIMD=avx2|sse4|scalar environment variable lowers the choice.
+// All variants return exactly the same integer results, floating point sums may differ
+// in the last bits because of the summation order.
+const char* simd_level();
+// switch to the best supported level not above 'name', returns the level in use
+const char* set_simd_level(const char* name);
+
+void minmax_u64(const uint64_t* data, size_t n, uint64_t& min, uint64_t& max);
+uint64_t sum_u64(const uint64_t* data, size_t n);
+// sum and number of the values less than 'limit'
+uint64_t sum_below_u64(const uint64_t* data, size_t n, uint64_t limit, size_t& count);
+// hist[value / bin_width] += 1, the caller guarantees max / bin_width < hist_size
+void histogram_u64(const uint64_t* data, size_t n, uint64_t bin_width, uint32_t* hist, size_t hist_size);
+
+double sum_f64(const double* data, size_t n);
+double sum_sq_dev_f64(const double* data, size_t n, double mean);
+// sum and number of the values in the open range (lo, hi)
+double sum_in_range_f64(const double* data, size_t n, double lo, double hi, size_t& count);
+
+}
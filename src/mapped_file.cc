@@ -0,0 +1,151 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "mapped_file.h"
+#include "parallel.h"
+
+#include <string.h>
+
+#if _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+namespace fpsprof {
+
+#if _WIN32
+bool MappedFile::Open(const char* filename)
+{
+    Close();
+
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return false;
+    }
+    _file = file;
+    _size = (size_t)size.QuadPart;
+    if (_size == 0) {
+        return true;
+    }
+    _mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (_mapping) {
+        _data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!_data) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data) {
+        UnmapViewOfFile(_data);
+    }
+    if (_mapping) {
+        CloseHandle(_mapping);
+    }
+    if (_file) {
+        CloseHandle(_file);
+    }
+    _data = NULL;
+    _mapping = NULL;
+    _file = NULL;
+    _size = 0;
+}
+#else
+bool MappedFile::Open(const char* filename)
+{
+    Close();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    _size = (size_t)st.st_size;
+    if (_size == 0) {
+        close(fd);
+        return true;
+    }
+    void* data = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // mapping keeps the file referenced
+    if (data == MAP_FAILED) {
+        _size = 0;
+        return false;
+    }
+    madvise(data, _size, MADV_SEQUENTIAL);
+    _data = (const uint8_t*)data;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data) {
+        munmap((void*)_data, _size);
+    }
+    _data = NULL;
+    _size = 0;
+}
+#endif
+
+// xxhash64-like rounds over 4 lanes, the block hashes are combined in order
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+static const size_t HASH_BLOCK_SIZE = 4 << 20;
+
+static inline uint64_t rotl(uint64_t v, unsigned n) { return (v << n) | (v >> (64 - n)); }
+static inline uint64_t hash_round(uint64_t acc, uint64_t v) { return rotl(acc + v * PRIME2, 31) * PRIME1; }
+static inline uint64_t hash_mix(uint64_t h) { h ^= h >> 33; h *= PRIME2; h ^= h >> 29; h *= PRIME1; return h ^ (h >> 32); }
+
+static uint64_t block_hash(const uint8_t* data, size_t size)
+{
+    uint64_t lane[4] = { PRIME1, PRIME2, ~PRIME1, ~PRIME2 };
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        for (unsigned i = 0; i < 4; i++) {
+            uint64_t v;
+            memcpy(&v, data + pos + 8 * i, 8);
+            lane[i] = hash_round(lane[i], v);
+        }
+    }
+    uint64_t h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18);
+    for (; pos < size; pos++) {
+        h = hash_round(h, data[pos]);
+    }
+    return hash_mix(h ^ size);
+}
+
+uint64_t content_hash(const uint8_t* data, size_t size)
+{
+    size_t num_blocks = (size + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE;
+    std::vector<uint64_t> hashes(num_blocks);
+    parallel_for((unsigned)num_blocks, [&](unsigned i) {
+        size_t pos = i * HASH_BLOCK_SIZE;
+        hashes[i] = block_hash(data + pos, std::min(HASH_BLOCK_SIZE, size - pos));
+    });
+    uint64_t h = hash_mix(size);
+    for (auto block : hashes) {
+        h = hash_round(h, block);
+    }
+    return hash_mix(h);
+}
+
+}
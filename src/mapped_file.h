@@ -0,0 +1,39 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace fpsprof {
+
+// Read-only view of the whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator= (const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const char* filename);
+    void Close();
+
+    const uint8_t* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    const uint8_t* _data = NULL;
+    size_t _size = 0;
+#if _WIN32
+    void* _file = NULL;
+    void* _mapping = NULL;
+#endif
+};
+
+// 64-bit fingerprint of the content, blocks are hashed in parallel
+uint64_t content_hash(const uint8_t* data, size_t size);
+
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "merge.h"
+#include "node.h"
+#include "stat.h"
+#include "writer.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define FILL_LEN(stack_level) std::min(128, 2 * std::max(0, int(stack_level)))
+
+namespace fpsprof {
+
+enum { METRIC_INCL, METRIC_EXCL, METRIC_FPS, METRIC_CALLS, NUM_METRICS };
+
+struct RunMerge::metrics_t {
+    double mean[NUM_METRICS], sd[NUM_METRICS], min[NUM_METRICS], max[NUM_METRICS];
+    unsigned n[NUM_METRICS];
+};
+
+RunMerge::RunMerge(const std::vector<std::string>& run_names)
+    : _run_names(run_names)
+    , _frame_realtime(run_names.size(), 0)
+    , _frame_count(run_names.size(), 0)
+{
+}
+
+unsigned RunMerge::intern(const char* name)
+{
+    auto res = _name_ids.emplace(name, (unsigned)_names.size());
+    if (res.second) {
+        _names.push_back(name);
+    }
+    return res.first->second;
+}
+
+// a thread root, 'parent' ~0u, is always a new node, it is found through section.roots only
+unsigned RunMerge::add_node(section_t& section, unsigned parent, unsigned name, int stack_level, uint64_t order)
+{
+    unsigned idx = (unsigned)section.nodes.size();
+    if (parent != ~0u) {
+        auto res = section.children.emplace((uint64_t)parent << 32 | name, idx);
+        if (!res.second) {
+            idx = res.first->second;
+            section.nodes[idx].order = std::min(section.nodes[idx].order, order);
+            return idx;
+        }
+    }
+    section.nodes.push_back(node_t{ name, stack_level, order, true, 0, {} });
+    section.values.resize(section.nodes.size() * _run_names.size());
+    if (parent != ~0u) {
+        section.nodes[parent].children.push_back(idx);
+    }
+    return idx;
+}
+
+void RunMerge::add_tree(section_t& section, unsigned run, const NodeView& view, const Node& node, unsigned merged)
+{
+    value_t& value = section.values[merged * _run_names.size() + run];
+    value.realtime_used = view.realtime_used(node);
+    value.children_realtime_used = view.children_realtime_used(node);
+    value.count = node.count();
+    value.present = true;
+
+    uint64_t pos = 0;
+    for (const auto& child : node.children()) {
+        unsigned idx = add_node(section, merged, intern(child.name()), child.stack_level(), (uint64_t)run << 32 | pos++);
+        section.nodes[idx].num_recursions = std::max(section.nodes[idx].num_recursions, child.num_recursions());
+        add_tree(section, run, view, child, idx);
+    }
+}
+
+void RunMerge::add_stats(section_t& section, unsigned run, const std::list<Stat>& stats, unsigned root)
+{
+    uint64_t pos = 0;
+    for (const auto& stat : stats) {
+        unsigned idx = add_node(section, root, intern(stat.name()), stat.stack_level_min(), (uint64_t)run << 32 | pos++);
+        section.nodes[idx].child_free &= stat.child_free();
+        section.nodes[idx].num_recursions = std::max(section.nodes[idx].num_recursions, stat.num_recursions());
+        value_t& value = section.values[idx * _run_names.size() + run];
+        value.realtime_used = stat.realtime_used();
+        value.children_realtime_used = stat.children_realtime_used();
+        value.count = stat.count();
+        value.present = true;
+    }
+}
+
+void RunMerge::AddRun(unsigned run, uint64_t frame_realtime, unsigned frame_count,
+    const std::map<int, NodeView>& threadsFull, const std::map<int, NodeView>& threadsNoRecur,
+    const std::map<int, std::list<Stat> >& funcStatsFull, const std::map<int, std::list<Stat> >& funcStatsNoRecur)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _frame_realtime[run] = frame_realtime;
+    _frame_count[run] = frame_count;
+
+    const std::map<int, NodeView>* trees[] = { &threadsFull, &threadsNoRecur };
+    for (int i = 0; i < 2; i++) {
+        section_t& section = _sections[i == 0 ? SECTION_FULL : SECTION_NO_RECURSION];
+        for (const auto& thread : *trees[i]) {
+            const Node& root = thread.second.root();
+            auto it = section.roots.find(thread.first);
+            if (it == section.roots.end()) {
+                it = section.roots.emplace(thread.first, add_node(section, ~0u, intern(root.name()), root.stack_level(), 0)).first;
+            }
+            add_tree(section, run, thread.second, root, it->second);
+        }
+    }
+    const std::map<int, std::list<Stat> >* stats[] = { &funcStatsFull, &funcStatsNoRecur };
+    for (int i = 0; i < 2; i++) {
+        section_t& section = _sections[i == 0 ? SECTION_STATS_FULL : SECTION_STATS_NO_RECURSION];
+        for (const auto& thread : *stats[i]) {
+            auto it = section.roots.find(thread.first);
+            if (it == section.roots.end()) {
+                it = section.roots.emplace(thread.first, add_node(section, ~0u, intern(""), -1, 0)).first;
+            }
+            add_stats(section, run, thread.second, it->second);
+        }
+    }
+}
+
+// A missing node has no time and no calls in the run, its fps is left out.
+// The percents of a run without frames are left out too.
+void RunMerge::collect_metrics(const section_t& section, unsigned node, metrics_t& metrics) const
+{
+    size_t num_runs = _run_names.size();
+    double sum[NUM_METRICS] = {}, sum_sq[NUM_METRICS] = {};
+    for (int m = 0; m < NUM_METRICS; m++) {
+        metrics.n[m] = 0;
+        metrics.min[m] = INFINITY;
+        metrics.max[m] = -INFINITY;
+    }
+    auto add = [&](int m, double v) {
+        sum[m] += v;
+        sum_sq[m] += v * v;
+        metrics.n[m]++;
+        metrics.min[m] = std::min(metrics.min[m], v);
+        metrics.max[m] = std::max(metrics.max[m], v);
+    };
+    for (size_t run = 0; run < num_runs; run++) {
+        const value_t& value = section.values[node * num_runs + run];
+        uint64_t frame_realtime = _frame_realtime[run];
+        unsigned frame_count = _frame_count[run];
+        if (frame_realtime > 0) {
+            double incl = 100. * value.realtime_used / frame_realtime;
+            add(METRIC_INCL, incl);
+            add(METRIC_EXCL, incl - 100. * value.children_realtime_used / frame_realtime);
+            if (value.present && value.realtime_used) {
+                add(METRIC_FPS, 1e9 * frame_count / value.realtime_used);
+            }
+        }
+        if (frame_count > 0) {
+            add(METRIC_CALLS, (double)value.count / frame_count);
+        }
+    }
+    for (int m = 0; m < NUM_METRICS; m++) {
+        unsigned n = metrics.n[m];
+        metrics.mean[m] = n ? sum[m] / n : 0;
+        metrics.sd[m] = n > 1 ? sqrt(std::max(0., (sum_sq[m] - sum[m] * metrics.mean[m]) / (n - 1))) : 0;
+    }
+}
+
+static const int metric_width[NUM_METRICS] = { 6, 6, 10, 9 };
+static const int metric_prec[NUM_METRICS] = { 2, 2, 1, 2 };
+static const char* const metric_name[NUM_METRICS] = { "inc%", "exc%", "fps", "call/fr" };
+
+unsigned RunMerge::name_column_width() const
+{
+    unsigned width = 4; // "name"
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        bool indent = i == SECTION_FULL || i == SECTION_NO_RECURSION;
+        for (const auto& node : _sections[i].nodes) {
+            width = std::max(width, name_len(node, indent));
+        }
+    }
+    return width;
+}
+
+unsigned RunMerge::name_len(const node_t& node, bool indent) const
+{
+    unsigned len = (indent ? FILL_LEN(node.stack_level) : 0) + (unsigned)_names[node.name].size();
+    if (node.num_recursions) {
+        len += 3 + (unsigned)std::to_string(node.num_recursions).size();
+    }
+    return len;
+}
+
+// same as a single run report: indented by the stack level, "[+n]" for the recursive calls
+void RunMerge::write_name(BufferedWriter& w, const node_t& node, bool indent) const
+{
+    w.fill(' ', indent ? FILL_LEN(node.stack_level) : 0);
+    w.write(_names[node.name]);
+    if (node.num_recursions) {
+        w.printf("[+%u]", node.num_recursions);
+    }
+}
+
+void RunMerge::write_header(BufferedWriter& w, const std::string& name, const char* first_column) const
+{
+    unsigned name_width = name_column_width();
+    size_t line_width = 6 + name_width;
+    for (int m = 0; m < NUM_METRICS; m++) {
+        line_width += 4 * (1 + metric_width[m]);
+    }
+    w.fill('-', line_width);
+    w.put('\n');
+    w.write(name);
+    w.put('\n');
+    w.fill('-', line_width);
+    w.put('\n');
+    w.printf("%3s %1s %-*s", first_column, "L", name_width, "name");
+    for (int m = 0; m < NUM_METRICS; m++) {
+        w.printf(" %*s %*s %*s %*s", metric_width[m], metric_name[m], metric_width[m], "sd",
+            metric_width[m], "min", metric_width[m], "max");
+    }
+    w.put('\n');
+}
+
+void RunMerge::write_row(BufferedWriter& w, const section_t& section, unsigned node, const char* first_column, unsigned name_width, bool indent) const
+{
+    const node_t& n = section.nodes[node];
+    w.printf("%3s %s ", first_column, (indent ? n.children.empty() : n.child_free) ? "*" : " ");
+    write_name(w, n, indent);
+    w.fill(' ', name_width - std::min(name_width, name_len(n, indent)));
+    metrics_t metrics;
+    collect_metrics(section, node, metrics);
+    for (int m = 0; m < NUM_METRICS; m++) {
+        const double values[] = { metrics.mean[m], metrics.sd[m], metrics.min[m], metrics.max[m] };
+        for (double v : values) {
+            w.put(' ');
+            if (metrics.n[m]) {
+                w.put_fixed(v, metric_width[m], metric_prec[m]);
+            } else {
+                w.printf("%*s", metric_width[m], "-");
+            }
+        }
+    }
+    w.put('\n');
+}
+
+void RunMerge::write_tree(BufferedWriter& w, const section_t& section, unsigned node, unsigned name_width) const
+{
+    char st[16];
+    snprintf(st, sizeof(st), "%d", section.nodes[node].stack_level);
+    write_row(w, section, node, st, name_width, true);
+
+    std::vector<unsigned> children = section.nodes[node].children;
+    std::sort(children.begin(), children.end(), [&](unsigned a, unsigned b) {
+        return section.nodes[a].order < section.nodes[b].order;
+    });
+    for (unsigned child : children) {
+        write_tree(w, section, child, name_width);
+    }
+}
+
+void RunMerge::write_trees(BufferedWriter& w, const char* name, const section_t& section, bool heads_only) const
+{
+    write_header(w, std::string(name) + " [ " + std::to_string(section.roots.size()) + " thread(s), " +
+        std::to_string(_run_names.size()) + " run(s) ]", "st");
+    unsigned name_width = name_column_width();
+    for (const auto& root : section.roots) {
+        if (heads_only) {
+            char st[16];
+            snprintf(st, sizeof(st), "%d", section.nodes[root.second].stack_level);
+            write_row(w, section, root.second, st, name_width, true);
+        } else {
+            write_tree(w, section, root.second, name_width);
+        }
+    }
+    w.put('\n');
+}
+
+// same order as the statistics of a single run: the largest mean exclusive time first, the root last
+void RunMerge::write_stats(BufferedWriter& w, const char* name, const section_t& section) const
+{
+    write_header(w, std::string(name) + " [ " + std::to_string(section.roots.size()) + " thread(s), " +
+        std::to_string(_run_names.size()) + " run(s) ]", "idx");
+    unsigned name_width = name_column_width();
+    size_t num_runs = _run_names.size();
+    for (const auto& root : section.roots) {
+        std::vector<std::pair<int64_t, unsigned> > order;
+        for (unsigned idx : section.nodes[root.second].children) {
+            int64_t self = 0;
+            for (size_t run = 0; run < num_runs; run++) {
+                const value_t& value = section.values[idx * num_runs + run];
+                self += (int64_t)(value.realtime_used - value.children_realtime_used);
+            }
+            bool is_root = section.nodes[idx].stack_level == -1;
+            order.emplace_back(is_root ? INT64_MIN : self, idx);
+        }
+        std::stable_sort(order.begin(), order.end(), [](const std::pair<int64_t, unsigned>& a, const std::pair<int64_t, unsigned>& b) {
+            return a.first > b.first;
+        });
+        unsigned row = 1;
+        for (const auto& item : order) {
+            char idx[16];
+            snprintf(idx, sizeof(idx), "%u", row++);
+            write_row(w, section, item.second, idx, name_width, false);
+        }
+    }
+    w.put('\n');
+}
+
+void RunMerge::write_runs(BufferedWriter& w) const
+{
+    w.printf("Runs [ %zu ]\n", _run_names.size());
+    w.printf("%3s %9s %12s %10s  %s\n", "run", "frames", "ms/frame", "fps", "log");
+    double sum = 0, sum_sq = 0;
+    unsigned n = 0;
+    for (size_t run = 0; run < _run_names.size(); run++) {
+        unsigned frame_count = _frame_count[run];
+        double frame_ms = frame_count ? 1e-6 * _frame_realtime[run] / frame_count : 0;
+        w.printf("%3zu %9u %12.3f", run + 1, frame_count, frame_ms);
+        if (frame_ms > 0) {
+            double fps = 1e3 / frame_ms;
+            sum += fps;
+            sum_sq += fps * fps;
+            n++;
+            w.printf(" %10.1f", fps);
+        } else {
+            w.printf(" %10s", "-");
+        }
+        w.printf("  %s\n", _run_names[run].c_str());
+    }
+    if (n) {
+        double mean = sum / n;
+        double sd = n > 1 ? sqrt(std::max(0., (sum_sq - sum * mean) / (n - 1))) : 0;
+        w.printf("fps mean %.1f, sd %.1f (%.2f%%)\n", mean, sd, mean > 0 ? 100. * sd / mean : 0);
+    }
+    w.put('\n');
+}
+
+void RunMerge::Write(BufferedWriter& w) const
+{
+    write_runs(w);
+    write_trees(w, "Threads summary", _sections[SECTION_FULL], true);
+    write_trees(w, "Detailed report", _sections[SECTION_FULL], false);
+    write_trees(w, "Summary report (no recursion)", _sections[SECTION_NO_RECURSION], false);
+    write_stats(w, "Function statistics (Full)", _sections[SECTION_STATS_FULL]);
+    write_stats(w, "Function statistics (no recursion)", _sections[SECTION_STATS_NO_RECURSION]);
+}
+
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+
+namespace fpsprof {
+
+class Node;
+class NodeView;
+class Stat;
+class BufferedWriter;
+
+// Report sections of several runs of the same workload merged by call path and function name.
+// A run is folded in as soon as its report data is ready, then the run data can go, so the
+// memory is the size of the merged trees times the number of runs.
+class RunMerge {
+public:
+    explicit RunMerge(const std::vector<std::string>& run_names);
+
+    // thread-safe, the runs may come in any order
+    void AddRun(unsigned run, uint64_t frame_realtime, unsigned frame_count,
+        const std::map<int, NodeView>& threadsFull, const std::map<int, NodeView>& threadsNoRecur,
+        const std::map<int, std::list<Stat> >& funcStatsFull, const std::map<int, std::list<Stat> >& funcStatsNoRecur);
+
+    // mean, stddev, min and max of inc%, exc%, fps and call/fr over the runs
+    void Write(BufferedWriter& w) const;
+
+private:
+    enum { SECTION_FULL, SECTION_NO_RECURSION, SECTION_STATS_FULL, SECTION_STATS_NO_RECURSION, NUM_SECTIONS };
+
+    struct value_t {
+        uint64_t realtime_used = 0;
+        uint64_t children_realtime_used = 0;
+        unsigned count = 0;
+        bool present = false;
+    };
+    struct node_t {
+        unsigned name;
+        int stack_level;
+        uint64_t order; // run << 32 | position among the siblings of the first run it shows up in
+        bool child_free; // functions only, no calls from it in all runs
+        unsigned num_recursions; // the largest of the runs
+        std::vector<unsigned> children;
+    };
+    // the trees of all threads of a section, the function statistics are the children of the thread roots
+    struct section_t {
+        std::vector<node_t> nodes;
+        std::vector<value_t> values; // node * num_runs + run
+        std::map<int, unsigned> roots;
+        std::unordered_map<uint64_t, unsigned> children; // parent << 32 | name -> node
+    };
+
+    unsigned intern(const char* name);
+    unsigned add_node(section_t& section, unsigned parent, unsigned name, int stack_level, uint64_t order);
+    void add_tree(section_t& section, unsigned run, const NodeView& view, const Node& node, unsigned merged);
+    void add_stats(section_t& section, unsigned run, const std::list<Stat>& stats, unsigned root);
+
+    struct metrics_t;
+    void collect_metrics(const section_t& section, unsigned node, metrics_t& metrics) const;
+    void write_header(BufferedWriter& w, const std::string& name, const char* first_column) const;
+    void write_row(BufferedWriter& w, const section_t& section, unsigned node, const char* first_column, unsigned name_width, bool indent) const;
+    void write_tree(BufferedWriter& w, const section_t& section, unsigned node, unsigned name_width) const;
+    void write_trees(BufferedWriter& w, const char* name, const section_t& section, bool heads_only) const;
+    void write_stats(BufferedWriter& w, const char* name, const section_t& section) const;
+    void write_runs(BufferedWriter& w) const;
+    unsigned name_column_width() const;
+    unsigned name_len(const node_t& node, bool indent) const;
+    void write_name(BufferedWriter& w, const node_t& node, bool indent) const;
+
+    std::vector<std::string> _run_names;
+    std::vector<uint64_t> _frame_realtime;
+    std::vector<unsigned> _frame_count;
+    std::vector<std::string> _names;
+    std::unordered_map<std::string, unsigned> _name_ids;
+    section_t _sections[NUM_SECTIONS];
+    std::mutex _mutex;
+};
+
+}
@@ -7,58 +7,189 @@
 
 #include "node.h"
 #include "event.h"
+#include "varint.h"
 
 #include <assert.h>
 #include <string.h>
-#include <stack>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <algorithm>
 #include <stdexcept>
+#include <mutex>
 
 namespace fpsprof {
 
 static const char rootNodeName[] = "<root>";
 
+static const Node::index_t NO_NODE = 0xFFFFFFFF;
+static const Node::index_t ROOT_NODE = 0xFFFFFFFE; // the root is not stored in the arena
+
+struct Node::arena_t {
+    explicit arena_t(Node* root) : root(root) {}
+
+    Node& at(index_t idx) { return idx == ROOT_NODE ? *root : nodes[idx]; }
+    Node* parent_of(const Node& node) { return node._parent == NO_NODE ? NULL : &at(node._parent); }
+
+    void link(index_t parent_idx, index_t idx) {
+        Node& parent = at(parent_idx);
+        if (parent._last_child == NO_NODE) {
+            parent._first_child = idx;
+        } else {
+            at(parent._last_child)._next_sibling = idx;
+        }
+        parent._last_child = idx;
+    }
+
+    // child lookup: open addressing with linear probing, the key is (parent, name) of the node itself
+    size_t home_slot(index_t parent, const char* name) const {
+        uint64_t h = (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull ^ (uint64_t)parent * 0xC2B2AE3D27D4EB4Full;
+        return (size_t)(h ^ (h >> 29)) & (slots.size() - 1);
+    }
+    index_t find(index_t parent, const char* name) {
+        if (slots.empty()) {
+            return NO_NODE;
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = home_slot(parent, name); slots[i] != NO_NODE; i = (i + 1) & mask) {
+            const Node& node = at(slots[i]);
+            if (node._parent == parent && node._name == name) {
+                return slots[i];
+            }
+        }
+        return NO_NODE;
+    }
+    void insert(index_t idx) {
+        if (2 * (num_indexed + 1) > slots.size()) {
+            rehash(std::max<size_t>(64, 2 * slots.size()));
+        }
+        place(idx);
+        num_indexed++;
+    }
+    void place(index_t idx) {
+        const Node& node = at(idx);
+        size_t mask = slots.size() - 1;
+        size_t i = home_slot(node._parent, node._name);
+        while (slots[i] != NO_NODE) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = idx;
+    }
+    void rehash(size_t size) {
+        std::vector<index_t> old(size, NO_NODE);
+        old.swap(slots);
+        for (auto idx : old) {
+            if (idx != NO_NODE) {
+                place(idx);
+            }
+        }
+    }
+
+    Node* root;
+    std::vector<Node> nodes;
+    std::vector<index_t> slots;
+    size_t num_indexed = 0;
+
+    std::vector<index_t> cursor; // AddThreadEvents() path, kept to reuse the memory
+};
+
 Node::Node()
     : _name(rootNodeName)
-    , _stack_level(-1)
-    , _frame_flag(false)
-    , _measure_process_time(false)
+    , _arena(new arena_t(this))
     , _realtime_used(0)
     , _cpu_used(0)
-#ifndef NDEBUG
-    , _parent_path("")
-    , _self_path("")
-#endif
-    , _parent(NULL)
+    , _self(ROOT_NODE)
+    , _parent(NO_NODE)
+    , _first_child(NO_NODE)
+    , _last_child(NO_NODE)
+    , _next_sibling(NO_NODE)
+    , _stack_level(-1)
     , _count(0)
     , _num_recursions(0)
-    , _has_penalty(true)
     , _count_norec_removed(0)
     , _count_norec(0)
     , _count_rec(0)
+    , _frame_flag(false)
+    , _measure_process_time(false)
+#ifndef NDEBUG
+    , _parent_path("")
+    , _self_path("")
+#endif
 {
 }
-Node::Node(const Event& event, Node& parent)
+Node::Node(const Event& event, const Node& parent, index_t self)
     : _name(event.name())
+    , _arena(parent._arena)
+    , _realtime_used(event.stop_nsec() - event.start_nsec())
+    , _cpu_used(event.cpu_used())
+    , _self(self)
+    , _parent(parent._self)
+    , _first_child(NO_NODE)
+    , _last_child(NO_NODE)
+    , _next_sibling(NO_NODE)
     , _stack_level(event.stack_level())
+    , _count(1)
+    , _num_recursions(0)
+    , _count_norec_removed(0)
+    , _count_norec(1)
+    , _count_rec(0)
     , _frame_flag(event.frame_flag())
     , _measure_process_time(event.measure_process_time())
-    , _realtime_used(event.stop_nsec() - event.start_nsec())
-    , _cpu_used(event.cpu_used())
 #ifndef NDEBUG
     , _parent_path(parent.self_path())
     , _self_path("/" + make_hash() + _parent_path)
 #endif
-    , _parent(&parent)
-    , _count(1)
+{
+}
+Node::Node(const Node& node, const Node& parent, index_t self)
+    : _name(node._name)
+    , _arena(parent._arena)
+    , _realtime_used(node._realtime_used)
+    , _cpu_used(node._cpu_used)
+    , _self(self)
+    , _parent(parent._self)
+    , _first_child(NO_NODE)
+    , _last_child(NO_NODE)
+    , _next_sibling(NO_NODE)
+    , _stack_level(node._stack_level)
+    , _count(node._count)
+    , _num_recursions(node._num_recursions)
+    , _count_norec_removed(node._count_norec_removed)
+    , _count_norec(node._count_norec)
+    , _count_rec(node._count_rec)
+    , _frame_flag(node._frame_flag)
+    , _measure_process_time(node._measure_process_time)
+#ifndef NDEBUG
+    , _parent_path(node._parent_path)
+    , _self_path(node._self_path)
+#endif
+{
+}
+Node::Node(const char* name, const Node& parent, index_t self)
+    : _name(name)
+    , _arena(parent._arena)
+    , _realtime_used(0)
+    , _cpu_used(0)
+    , _self(self)
+    , _parent(parent._self)
+    , _first_child(NO_NODE)
+    , _last_child(NO_NODE)
+    , _next_sibling(NO_NODE)
+    , _stack_level(parent._stack_level + 1)
+    , _count(0)
     , _num_recursions(0)
-    , _has_penalty(true)
     , _count_norec_removed(0)
-    , _count_norec(1)
+    , _count_norec(0)
     , _count_rec(0)
+    , _frame_flag(false)
+    , _measure_process_time(false)
+{
+}
+Node::~Node()
 {
+    if (_self == ROOT_NODE) {
+        delete _arena;
+    }
 }
 
 #ifndef NDEBUG
@@ -66,6 +197,8 @@ std::string Node::make_hash() const {
     std::string name;
 
     static std::map<const char*, unsigned> _ptr_hash;
+    static std::mutex _ptr_hash_mutex;
+    std::lock_guard<std::mutex> lock(_ptr_hash_mutex);
     if (_ptr_hash.find(_name) == _ptr_hash.end()) {
         _ptr_hash[_name] = (unsigned)_ptr_hash.size();
     }
@@ -79,7 +212,37 @@ std::string Node::make_hash() const {
 }
 #endif
 
-Node& Node::add_child(const Event& event)
+const Node* Node::parent() const
+{
+    return _arena->parent_of(*this);
+}
+const Node* Node::first_child() const
+{
+    return _first_child == NO_NODE ? NULL : &_arena->at(_first_child);
+}
+const Node* Node::next_sibling() const
+{
+    return _next_sibling == NO_NODE ? NULL : &_arena->at(_next_sibling);
+}
+size_t Node::slot() const
+{
+    return _self == ROOT_NODE ? 0 : (size_t)_self + 1;
+}
+size_t Node::num_slots() const
+{
+    return _arena->nodes.size() + 1;
+}
+unsigned Node::num_children() const
+{
+    unsigned n = 0;
+    for (auto it = children().begin(); it != children().end(); ++it) {
+        n++;
+    }
+    return n;
+}
+
+// The arena may grow, 'this' must not be used after the child is stored
+Node::index_t Node::add_child(const Event& event)
 {
     if (event.stack_level() != _stack_level + 1) {
         assert(!"not a direct child");
@@ -88,229 +251,345 @@ Node& Node::add_child(const Event& event)
         assert(!"stack level increase resulted in counter change "
             "from thread time to process time");
     }
-    _children.emplace_back(event, *this);
+    arena_t& arena = *_arena;
+    index_t parent = _self;
+    index_t idx = (index_t)arena.nodes.size();
+    arena.nodes.push_back(Node(event, *this, idx));
+    arena.link(parent, idx);
 
-    return _children.back();
+    return idx;
 }
-void Node::merge_self(Node&& node, bool strict)
+void Node::add_event(const Event& event)
+{
+    assert(_name == event.name());
+    assert(_stack_level == event.stack_level());
+    assert(_frame_flag == event.frame_flag());
+
+    _realtime_used += event.stop_nsec() - event.start_nsec();
+    _cpu_used += event.cpu_used();
+    _count++;
+    _count_norec++;
+}
+// the counters of the node of the same path in another tree
+void Node::add_counters(const Node& node)
 {
     assert(_name == node.name());
     assert(_stack_level == node.stack_level());
     assert(_frame_flag == node.frame_flag());
-    assert(_has_penalty == node.has_penalty());
-    
-    if(strict) {
-        assert(1 == node.count());
-        assert(0 == node.num_recursions());
-    }
+
     _realtime_used += node.realtime_used();
     _cpu_used += node.cpu_used();
     _count += node.count();
     _num_recursions = std::max(_num_recursions, node.num_recursions());
-
-    if(strict) {
-#ifndef NDEBUG
-        assert(_parent_path == node.parent_path());
-        assert(_self_path == node.self_path());
-#endif
-    }
-    rebase_children(this, node);
-    _children.splice(_children.end(), std::move(node._children));
-
     _count_norec_removed += node._count_norec_removed;
     _count_norec += node._count_norec;
     _count_rec += node._count_rec;
 }
 
-void Node::merge_children(bool strict)
+// 'src' belongs to another tree: a child of the same name is found by the lookup hash and
+// merged in place, only the subtrees with no match are copied. New children go after the
+// existing ones in the 'src' order, same as the order of the first appearance.
+// The arena may grow, the nodes are referred to by index.
+void Node::merge_subtree(index_t dst, const Node& src)
 {
-    //assert(_has_penalty == true);
-
-    auto it = _children.begin();
-    while(it != _children.end()) {
-        const char* name = it->name();
-        auto cand = it; cand++;
-        while( cand != _children.end() ) {
-            if(name != cand->name()) {
-                cand++;
-            } else {
-                it->merge_self(std::move(*cand), strict);
-                cand = _children.erase(cand);
-            }
+    arena_t& arena = *_arena;
+    for (const auto& child : src.children()) {
+        index_t idx = arena.find(dst, child._name);
+        if (idx == NO_NODE) {
+            copy_subtree(dst, child);
+        } else {
+            arena.at(idx).add_counters(child);
+            merge_subtree(idx, child);
         }
-        it++;
-    } 
-    for(auto& child: _children) {
-        child.merge_children(strict);
     }
 }
 
-void Node::rebase_children(const Node* newHead, Node& oldHead)
+void Node::copy_subtree(index_t dst, const Node& src)
 {
-    for(auto& child: oldHead._children) {
-        child._parent = const_cast<Node*>(newHead);
+    arena_t& arena = *_arena;
+    index_t idx = (index_t)arena.nodes.size();
+    arena.nodes.push_back(Node(src, arena.at(dst), idx));
+    arena.link(dst, idx);
+    arena.insert(idx);
+    for (const auto& child : src.children()) {
+        copy_subtree(idx, child);
     }
 }
-Node* Node::deep_copy(Node* parent) const
-{
-    Node *node = new Node();
-
-    node->_name = _name;
-    node->_stack_level = _stack_level;
-    node->_frame_flag = _frame_flag;
-    node->_measure_process_time = _measure_process_time;
 
-    node->_realtime_used = _realtime_used;
-    node->_cpu_used = _cpu_used;
-#ifndef NDEBUG
-    node->_parent_path = _parent_path;
-    node->_self_path = _self_path;
-#endif
-    node->_parent = parent;
-    node->_count = _count;
-    node->_num_recursions = _num_recursions;
-    node->_has_penalty = _has_penalty;
-    node->_count_norec_removed = _count_norec_removed;
-    node->_count_norec = _count_norec;
-    node->_count_rec = _count_rec;
-
-    /*
-    std::list<Node> newChildren;
-    for(auto& child: _children) {
-        newChildren.splice(newChildren.end(), std::move(*child.deep_copy(node)));
-    }
-    for(auto& child: _children) {
-        rebase_children(&child, child);
-    }
-    */
-    for(auto& child: _children) {
-        {
-            auto *newChild = child.deep_copy(node);
-            node->_children.push_back(std::move(*newChild)); // change 'newChild' displacenment
+// Every event is merged into the aggregated tree right away: the cursor stack holds
+// the path to the last event and the child is found by the lookup hash, so the cost
+// does not depend on the size of the tree.
+void Node::AddThreadEvents(const Event* events, size_t count)
+{
+    assert(_self == ROOT_NODE);
+
+    arena_t& arena = *_arena;
+    std::vector<index_t>& cursor = arena.cursor;
+    cursor.assign(1, _self);
+    for (size_t i = 0; i < count; i++) {
+        const auto& event = events[i];
+        while (arena.at(cursor.back()).stack_level() >= event.stack_level()) {
+            cursor.pop_back();
+            if(cursor.empty()) {
+                throw std::runtime_error("broken event list");
+            }
         }
-        {
-            auto& newChild = node->_children.back();
-            rebase_children(&newChild, newChild);
+        index_t parent = cursor.back();
+        index_t idx = arena.find(parent, event.name());
+        if (idx == NO_NODE) {
+            idx = arena.at(parent).add_child(event);
+            arena.insert(idx);
+        } else {
+            arena.at(idx).add_event(event);
+        }
+        cursor.push_back(idx);
+
+        if (parent == ROOT_NODE) { // same as update_root()
+            _frame_flag |= event.frame_flag();
+            _realtime_used += event.stop_nsec() - event.start_nsec();
+            _cpu_used += event.cpu_used();
+            _count++;
+            if(_frame_flag && _first_child != _last_child) {
+                throw std::runtime_error("frame thread must have only one entry point");
+            }
         }
     }
-    return node;
 }
 
-void Node::update_stack_level()
+void Node::AddThreadTree(Node&& root)
 {
-    _stack_level = _parent ? _parent->_stack_level + 1 : -1;
-    for(auto& child: _children) {
-        child.update_stack_level();
-    }
+    assert(_self == ROOT_NODE && root._self == ROOT_NODE);
+
+    merge_subtree(_self, root);
+    update_root();
 }
 
-bool Node::collapse_recursion()
+void Node::update_root()
 {
-    for(auto it = _children.begin(); it != _children.end(); ) {
-        // child will modify us and add more items at the end of a '_children' list
-        if( it->collapse_recursion() ) {
-            it = _children.erase(it);
-        } else {
-            it++;
-        }
+    _realtime_used = 0;
+    _cpu_used = 0;
+    _count = 0;
+    unsigned num_children = 0;
+    for(const auto& child: children()) {
+        _frame_flag |= child.frame_flag();
+        _realtime_used += child.realtime_used();
+        _cpu_used += child.cpu_used();
+        _count += child.count();
+        num_children++;
     }
-#if 0
-    while(parent) {
-        if(parent->name() == _name) {
-            parent->_count += _count;
-            parent->_num_recursions += _num_recursions + 1;
-            rebase_children(parent, *this);
-            parent->_children.splice(parent->_children.end(), std::move(_children));
-            return true;
-        } else {
-            parent = parent->_parent;
-        }
+    if(_frame_flag && num_children > 1) {
+        throw std::runtime_error("frame thread must have only one entry point");
     }
-    return false;
-#else
-    Node *parent = _parent;
-    Node *parent_recur = NULL;
-    while(parent) {
-        if(parent->name() == _name) {
-            parent_recur = parent;
-            break;
-        } else {
-            parent = parent->_parent;
+}
+
+// A node with an ancestor of the same name is dropped: its children are lifted to its
+// parent, its counters and its own (exclusive) time go to the topmost ancestor of that name.
+// Siblings of the same name are merged. The view is built in one traversal of the source
+// tree, the children are visited in the order which keeps the first appearance order of
+// the collapse-then-merge procedure: kept children first, then the lifted ones.
+struct Node::norec_builder_t {
+    struct occurrence_t {
+        index_t idx;              // result node
+        unsigned num_recursions;  // merged by max(), must be counted per source node
+    };
+
+    explicit norec_builder_t(const Node& src) : root(new Node()) {
+        root->_name = src._name;
+        root->_frame_flag = src._frame_flag;
+        root->_measure_process_time = src._measure_process_time;
+        root->_count = src._count;
+        root->_num_recursions = src._num_recursions;
+        root->_count_norec_removed = src._count_norec_removed;
+        root->_count_norec = src._count_norec;
+        root->_count_rec = src._count_rec;
+        add_self_time(*root, src);
+    }
+
+    static void add_self_time(Node& dst, const Node& src) {
+        dst._realtime_used += src.realtime_used() - src.children_realtime_used();
+        dst._cpu_used += src.cpu_used() - src.children_cpu_used();
+    }
+
+    void set_credit(const Node& src, index_t idx) {
+        if (credit) {
+            (*credit)[src.slot()] = idx == ROOT_NODE ? 0 : (size_t)idx + 1;
         }
     }
-    if(!parent_recur) {
-        return false;
+
+    index_t add_node(index_t parent, const Node& src) {
+        arena_t& arena = *root->_arena;
+        index_t idx = arena.find(parent, src._name);
+        if (idx == NO_NODE) {
+            idx = (index_t)arena.nodes.size();
+            arena.nodes.push_back(Node(src, arena.at(parent), idx));
+            arena.link(parent, idx);
+            arena.insert(idx);
+
+            Node& node = arena.at(idx);
+            node._stack_level = arena.at(parent)._stack_level + 1;
+            node._realtime_used = 0;
+            node._cpu_used = 0;
+            node._num_recursions = 0;
+            node._count = 0;
+            node._count_norec_removed = 0;
+            node._count_norec = 0;
+            node._count_rec = 0;
+        }
+        Node& node = arena.at(idx);
+        assert(node._frame_flag == src._frame_flag);
+        add_self_time(node, src);
+        node._count += src._count;
+        node._count_norec_removed += src._count_norec_removed;
+        node._count_norec += src._count_norec;
+        node._count_rec += src._count_rec;
+        return idx;
     }
 
-    uint64_t self_realtime_used = realtime_used() - children_realtime_used();
-    uint64_t self_cpu_used = cpu_used() - children_cpu_used(); // TODO: might be negative (???)
-    parent = _parent;
-    rebase_children(parent, *this);
-    parent->_children.splice(parent->_children.end(), std::move(_children));
-    parent->_count_norec_removed += _count_norec_removed + _count_norec;
+    void visit(const Node& src, index_t dst) {
+        arena_t& arena = *root->_arena;
+        for (const auto& child : src.children()) {
+            if (on_path.count(child._name)) {
+                continue;
+            }
+            occurrence_t occurrence = { add_node(dst, child), child._num_recursions };
+            set_credit(child, occurrence.idx);
+            on_path[child._name] = &occurrence;
+            visit(child, occurrence.idx);
+            on_path.erase(child._name);
+            Node& node = arena.at(occurrence.idx);
+            node._num_recursions = std::max(node._num_recursions, occurrence.num_recursions);
+        }
+        for (const auto& child : src.children()) {
+            auto it = on_path.find(child._name);
+            if (it == on_path.end()) {
+                continue;
+            }
+            Node& recur = arena.at(it->second->idx);
+            add_self_time(recur, child);
+            set_credit(child, it->second->idx);
+            recur._count += child._count;
+            recur._count_rec += child._count_rec + child._count_norec;
+            it->second->num_recursions += child._num_recursions + 1;
+            arena.at(dst)._count_norec_removed += child._count_norec_removed + child._count_norec;
+            visit(child, dst);
+        }
+    }
 
-    while (parent != parent_recur) {
-        parent->_realtime_used -= self_realtime_used;
-        parent->_cpu_used -= self_cpu_used;
-        parent = parent->_parent;
+    // children are stored after the parent, a reverse pass turns the self time into the inclusive one
+    void accumulate_children_time() {
+        arena_t& arena = *root->_arena;
+        for (size_t idx = arena.nodes.size(); idx-- > 0; ) {
+            const Node& node = arena.nodes[idx];
+            Node& parent = arena.at(node._parent);
+            parent._realtime_used += node._realtime_used;
+            parent._cpu_used += node._cpu_used;
+        }
     }
-    parent_recur->_count += _count;
-    parent_recur->_count_rec += _count_rec + _count_norec;
-    parent_recur->_num_recursions += _num_recursions + 1;
 
-    return true;
-#endif
-}
+    Node* root;
+    std::vector<size_t>* credit = NULL;
+    std::unordered_map<const char*, occurrence_t*> on_path; // kept nodes on the current path, one per name
+};
 
-void Node::AddThreadEvents(std::list<Event>&& events)
+Node* Node::CreateNoRecur(const Node& node, std::vector<size_t>* credit)
 {
-    if(events.empty()) {
-        return;
+    norec_builder_t builder(node);
+    if (credit) {
+        credit->assign(node.num_slots(), 0);
+        builder.credit = credit;
     }
+    builder.visit(node, ROOT_NODE);
+    builder.accumulate_children_time();
+    return builder.root;
+}
 
-    std::stack<Node*> stack;
-    stack.push(this);
-    while (!events.empty()) {
-        auto& event = events.front();
-        while (stack.top()->stack_level() >= event.stack_level()) {
-            stack.pop();
-            if(stack.empty()) {
-                throw std::runtime_error("broken event list");
-            }
+/*
+    node:  [name_id] flags zigzag(stack_level) count num_recursions count_norec_removed
+           count_norec count_rec realtime cpu num_children { node }
+    flags: frame_flag | measure_process_time << 1, the root has no name
+*/
+void Node::save_subtree(varint_writer_t& wr, std::unordered_map<const char*, unsigned>& name_ids, std::vector<const char*>& names) const
+{
+    if (_self != ROOT_NODE) {
+        auto it = name_ids.emplace(_name, (unsigned)names.size());
+        if (it.second) {
+            names.push_back(_name);
         }
-        stack.push(&stack.top()->Node::add_child(event));
-        events.pop_front();
+        wr.put_varint(it.first->second);
+    }
+    wr.put_varint((_frame_flag ? 1 : 0) | (_measure_process_time ? 2 : 0));
+    wr.put_zigzag(_stack_level);
+    wr.put_varint(_count);
+    wr.put_varint(_num_recursions);
+    wr.put_varint(_count_norec_removed);
+    wr.put_varint(_count_norec);
+    wr.put_varint(_count_rec);
+    wr.put_varint(_realtime_used);
+    wr.put_varint(_cpu_used);
+    wr.put_varint(num_children());
+    for (const auto& child : children()) {
+        child.save_subtree(wr, name_ids, names);
     }
+}
 
-    merge_children(true);
-    _realtime_used = 0;
-    _cpu_used = 0;
-    _count = 0;
-    for(const auto& child: _children) {
-        _frame_flag |= child.frame_flag();
-        _realtime_used += child.realtime_used();
-        _cpu_used += child.cpu_used();
-        _count += child.count();
+// the name of a non-root node is read by the parent
+bool Node::load_subtree(varint_reader_t& rd, const std::vector<const char*>& names)
+{
+    unsigned flags = (unsigned)rd.get_varint();
+    _frame_flag = (flags & 1) != 0;
+    _measure_process_time = (flags & 2) != 0;
+    _stack_level = (int)rd.get_zigzag();
+    _count = (unsigned)rd.get_varint();
+    _num_recursions = (unsigned)rd.get_varint();
+    _count_norec_removed = (unsigned)rd.get_varint();
+    _count_norec = (unsigned)rd.get_varint();
+    _count_rec = (unsigned)rd.get_varint();
+    _realtime_used = rd.get_varint();
+    _cpu_used = rd.get_varint();
+#ifndef NDEBUG
+    if (_self != ROOT_NODE) {
+        _parent_path = parent()->self_path();
+        _self_path = "/" + make_hash() + _parent_path;
     }
-    if(_frame_flag && _children.size() > 1) {
-        throw std::runtime_error("frame thread must have only one entry point");
+#endif
+    arena_t& arena = *_arena;
+    index_t self = _self;
+    for (uint64_t num_children = rd.get_varint(); num_children-- && !rd.fail(); ) {
+        uint64_t name_id = rd.get_varint();
+        if (name_id >= names.size() || arena.nodes.size() >= ROOT_NODE) {
+            return false;
+        }
+        index_t idx = (index_t)arena.nodes.size();
+        arena.nodes.push_back(Node(names[name_id], arena.at(self), idx));
+        arena.link(self, idx);
+        if (!arena.at(idx).load_subtree(rd, names)) {
+            return false;
+        }
     }
+    return !rd.fail();
 }
 
-Node* Node::CreateNoRecur(const Node& node)
+void Node::Save(varint_writer_t& wr, std::unordered_map<const char*, unsigned>& name_ids, std::vector<const char*>& names) const
 {
-    Node *norec = node.deep_copy(NULL);
+    assert(_self == ROOT_NODE);
+    save_subtree(wr, name_ids, names);
+}
 
-    norec->collapse_recursion();
-    norec->update_stack_level();
-    norec->merge_children(false);
-    return norec;
+// the loaded tree is not indexed, it is not supposed to receive events
+Node* Node::Load(varint_reader_t& rd, const std::vector<const char*>& names)
+{
+    Node* root = new Node();
+    if (!root->load_subtree(rd, names) || root->_stack_level != -1) {
+        delete root;
+        return NULL;
+    }
+    return root;
 }
 
 unsigned Node::name_len_max() const
 {
     unsigned n = (unsigned)strlen(_name);
-    for (const auto& child : _children) {
+    for (const auto& child : children()) {
         n = std::max(n, child.name_len_max());
     }
     return n;
@@ -318,40 +597,67 @@ unsigned Node::name_len_max() const
 unsigned Node::stack_level_max() const
 {
     unsigned n = std::max(0, _stack_level);
-    for (const auto& child : _children) {
+    for (const auto& child : children()) {
         n = std::max(n, child.stack_level_max());
     }
     return n;
 }
 
-unsigned Node::mitigate_counter_penalty(unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec, uint64_t& decrement_tail_nsec)
+unsigned Node::mitigate_counter_penalty(std::vector<uint64_t>& realtime, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec, uint64_t& decrement_tail_nsec) const
 {
     unsigned numChildrenFull = 0;
-    for(auto& child: _children) {
-        numChildrenFull += child.mitigate_counter_penalty(penalty_denom, penalty_self_nsec, penalty_children_nsec, decrement_tail_nsec);
+    uint64_t children_realtime_used_ = 0;
+    for (const auto& child : children()) {
+        numChildrenFull += child.mitigate_counter_penalty(realtime, penalty_denom, penalty_self_nsec, penalty_children_nsec, decrement_tail_nsec);
+        children_realtime_used_ += realtime[child.slot()];
     }
     uint64_t decrement_realtime_used = penalty_children_nsec*(numChildrenFull + _count_norec_removed)/penalty_denom + penalty_self_nsec*(_count - _count_rec)/penalty_denom;
     decrement_realtime_used += decrement_tail_nsec;
 
-    uint64_t children_realtime_used_ = children_realtime_used();
-    if(_parent == NULL) { // root
-        _realtime_used = children_realtime_used_;
+    uint64_t& realtime_used = realtime[slot()];
+    if(_parent == NO_NODE) { // root
+        realtime_used = children_realtime_used_;
     } else {
-        uint64_t realtime_used_orig = _realtime_used;
-        _realtime_used = _realtime_used < decrement_realtime_used ? 0 : _realtime_used - decrement_realtime_used;
-        if(_realtime_used < children_realtime_used_) {
-            _realtime_used = children_realtime_used_;
+        realtime_used = _realtime_used < decrement_realtime_used ? 0 : _realtime_used - decrement_realtime_used;
+        if(realtime_used < children_realtime_used_) {
+            realtime_used = children_realtime_used_;
         }
-        uint64_t decrement_actual = realtime_used_orig - _realtime_used;
+        uint64_t decrement_actual = _realtime_used - realtime_used;
         decrement_tail_nsec = decrement_realtime_used - decrement_actual;
     }
-    _has_penalty = false;
 
     return numChildrenFull + _count_norec + _count_norec_removed;
 }
-void Node::MitigateCounterPenalty(Node& root, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec)
+NodeView Node::MitigateCounterPenalty(const Node& root, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec)
 {
+    NodeView view;
+    view._root = &root;
+    view._realtime.resize(root.num_slots());
     uint64_t decrement_tail_nsec = 0;
-    root.mitigate_counter_penalty(penalty_denom, penalty_self_nsec, penalty_children_nsec, decrement_tail_nsec);
+    root.mitigate_counter_penalty(view._realtime, penalty_denom, penalty_self_nsec, penalty_children_nsec, decrement_tail_nsec);
+    return view;
+}
+
+static void collect_self_time(const Node& node, const NodeView& src, const std::vector<size_t>& credit, std::vector<uint64_t>& realtime)
+{
+    realtime[credit[node.slot()]] += src.realtime_used(node) - src.children_realtime_used(node);
+    for (const auto& child : node.children()) {
+        collect_self_time(child, src, credit, realtime);
+    }
+}
+NodeView Node::NoRecurTime(const Node& norec, const NodeView& src, const std::vector<size_t>& credit)
+{
+    NodeView view;
+    view._root = &norec;
+    view._realtime.resize(norec.num_slots());
+    collect_self_time(src.root(), src, credit, view._realtime);
+
+    // children are stored after the parent
+    const arena_t& arena = *norec._arena;
+    for (size_t idx = arena.nodes.size(); idx-- > 0; ) {
+        const Node& node = arena.nodes[idx];
+        view._realtime[node._parent == ROOT_NODE ? 0 : node._parent + 1] += view._realtime[idx + 1];
+    }
+    return view;
 }
 }
@@ -6,92 +6,168 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include <list>
+#include <vector>
 #include <string>
+#include <unordered_map>
 
 namespace fpsprof {
 
 class Event;
+class NodeView;
+struct varint_writer_t;
+struct varint_reader_t;
 
+// All nodes of a tree live in one arena owned by the root and refer to each other by index.
+// Children are kept in the order of the first appearance, a hash over (parent, name) is used
+// to find a child by name.
 class Node {
 public:
-    void AddThreadEvents(std::list<Event>&& events);
-
-    static Node* CreateNoRecur(const Node& root);
-    static void MitigateCounterPenalty(Node& root, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec);
+    typedef uint32_t index_t;
+
+    class children_t {
+    public:
+        class iterator {
+        public:
+            explicit iterator(const Node* node) : _node(node) {}
+            const Node& operator*() const { return *_node; }
+            const Node* operator->() const { return _node; }
+            iterator& operator++() { _node = _node->next_sibling(); return *this; }
+            bool operator==(const iterator& other) const { return _node == other._node; }
+            bool operator!=(const iterator& other) const { return _node != other._node; }
+        private:
+            const Node* _node;
+        };
+        explicit children_t(const Node* first) : _first(first) {}
+        iterator begin() const { return iterator(_first); }
+        iterator end() const { return iterator(NULL); }
+        bool empty() const { return _first == NULL; }
+        const Node& front() const { return *_first; }
+    private:
+        const Node* _first;
+    };
+
+    // events of one or more subsequent frames in the log order
+    void AddThreadEvents(const Event* events, size_t count);
+    // merge a partial thread tree built from the subsequent frames
+    void AddThreadTree(Node&& root);
+
+    // 'credit' receives the view slot each source node gives its exclusive time to
+    static Node* CreateNoRecur(const Node& root, std::vector<size_t>* credit = NULL);
+    // the tree keeps the raw counters, the compensated time is computed into a view
+    static NodeView MitigateCounterPenalty(const Node& root, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec);
+    // no-recursion view time collected from the exclusive time of the source view nodes
+    static NodeView NoRecurTime(const Node& norec, const NodeView& src, const std::vector<size_t>& credit);
+
+    // pre-order dump of an aggregated tree, the names are stored as ids of the 'names' table
+    void Save(varint_writer_t& wr, std::unordered_map<const char*, unsigned>& name_ids, std::vector<const char*>& names) const;
+    static Node* Load(varint_reader_t& rd, const std::vector<const char*>& names);
 
     Node();
-    Node(const Event& rawEvent, Node& parent);
+    ~Node();
     Node(const Node&) = delete;
-    Node(Node&&) = default;
+    Node(Node&&) = default; // arena nodes only, a root is never moved
     Node& operator= (Node&) = delete;
-    Node& operator= (Node&&) = default;
+    Node& operator= (Node&&) = delete;
 
     const char* name() const { return _name; }
     int stack_level() const { return _stack_level; }
     bool frame_flag() const { return _frame_flag; }
     bool measure_process_time() const { return _measure_process_time; }
-    unsigned num_children() const { return (unsigned)_children.size(); }
-    
+    unsigned num_children() const;
+
     uint64_t realtime_used() const { return _realtime_used; }
     uint64_t cpu_used() const { return _cpu_used; }
 #ifndef NDEBUG
     const std::string& parent_path() const { return _parent_path; }
     const std::string& self_path() const { return _self_path; }
 #endif
-    const Node *parent() const { return _parent; }
+    const Node *parent() const;
     unsigned count() const { return _count; }
     unsigned num_recursions() const { return _num_recursions; }
-    const std::list<Node>& children() const { return _children; }
+    children_t children() const { return children_t(first_child()); }
 
     unsigned name_len_max() const;
     unsigned stack_level_max() const;
 
-    uint64_t children_realtime_used() const { uint64_t n = 0; for(auto& child : _children) { n += child.realtime_used(); } return n; }
-    uint64_t children_cpu_used() const { uint64_t n = 0; for(auto& child : _children) { n += child.cpu_used(); } return n; }
+    uint64_t children_realtime_used() const { uint64_t n = 0; for(auto& child : children()) { n += child.realtime_used(); } return n; }
+    uint64_t children_cpu_used() const { uint64_t n = 0; for(auto& child : children()) { n += child.cpu_used(); } return n; }
 
-    bool has_penalty() const { return _has_penalty; }
-
-    Node* deep_copy(Node* parent) const;
+    // per-node data kept aside of the tree is indexed by the slot, the root slot is 0
+    size_t slot() const;
+    size_t num_slots() const;
 
 protected:
-    Node& add_child(const Event& event);
-    void merge_children(bool strict);
-    void merge_self(Node&& node, bool strict);
+    struct arena_t;
+    struct norec_builder_t;
+
+    Node(const Event& rawEvent, const Node& parent, index_t self);
+    Node(const Node& node, const Node& parent, index_t self); // copy without the links
+    Node(const char* name, const Node& parent, index_t self); // counters are loaded
 
-    static void rebase_children(const Node* newHead, Node& oldHead);
+    const Node* first_child() const;
+    const Node* next_sibling() const;
 
-    bool collapse_recursion();
-    void update_stack_level();
+    index_t add_child(const Event& event);
+    void add_event(const Event& event);
+    void add_counters(const Node& node);
+    void merge_subtree(index_t dst, const Node& src);
+    void copy_subtree(index_t dst, const Node& src);
+
+    void update_root();
+
+    void save_subtree(varint_writer_t& wr, std::unordered_map<const char*, unsigned>& name_ids, std::vector<const char*>& names) const;
+    bool load_subtree(varint_reader_t& rd, const std::vector<const char*>& names);
 
 private:
 #ifndef NDEBUG
-    std::string Node::make_hash() const;
+    std::string make_hash() const;
 #endif
-    unsigned mitigate_counter_penalty(unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec, uint64_t& decrement_tail_nsec);
+    unsigned mitigate_counter_penalty(std::vector<uint64_t>& realtime, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec, uint64_t& decrement_tail_nsec) const;
 
     const char* _name;
-    int _stack_level;
-    bool _frame_flag;
-    bool _measure_process_time;
+    arena_t* _arena;
 
     uint64_t _realtime_used;
     uint64_t _cpu_used;
-#ifndef NDEBUG
-    std::string _parent_path;
-    std::string _self_path;
-#endif
 
-    Node *_parent;
+    index_t _self;
+    index_t _parent;
+    index_t _first_child;
+    index_t _last_child;
+    index_t _next_sibling;
+
+    int _stack_level;
     unsigned _count;
     unsigned _num_recursions;
-    std::list<Node> _children;
-
-    bool _has_penalty;
 
     unsigned _count_norec_removed;
     unsigned _count_norec;
     unsigned _count_rec;
+
+    bool _frame_flag;
+    bool _measure_process_time;
+#ifndef NDEBUG
+    std::string _parent_path;
+    std::string _self_path;
+#endif
+};
+
+// Wall-clock time of the nodes of a tree with the counter overhead compensated for one
+// penalty setting. Views of different settings share the same tree.
+class NodeView {
+public:
+    NodeView() = default;
+
+    const Node& root() const { return *_root; }
+    uint64_t realtime_used(const Node& node) const { return _realtime[node.slot()]; }
+    uint64_t children_realtime_used(const Node& node) const { uint64_t n = 0; for(auto& child : node.children()) { n += realtime_used(child); } return n; }
+
+private:
+    friend class Node;
+    const Node* _root = NULL;
+    std::vector<uint64_t> _realtime; // by Node::slot()
 };
 
 }
@@ -0,0 +1,71 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdlib.h>
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+
+namespace fpsprof {
+
+// FPSPROF_NUM_THREADS environment variable overrides the number of cores
+static inline unsigned num_workers()
+{
+    static const unsigned n = []() {
+        const char* env = getenv("FPSPROF_NUM_THREADS");
+        unsigned n = env ? (unsigned)atoi(env) : std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }();
+    return n;
+}
+
+// Run fn(i) for all i in [0, count), items are picked up by workers one by one.
+// The first exception thrown by fn() is rethrown to the caller once all workers are done.
+template<class fn_t>
+void parallel_for(unsigned count, fn_t fn)
+{
+    unsigned num_threads = std::min(num_workers(), count);
+    if (num_threads <= 1) {
+        for (unsigned i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+    std::atomic<unsigned> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+        for (unsigned i = next++; i < count; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}
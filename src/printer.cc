@@ -8,11 +8,15 @@
 #include "printer.h"
 #include "node.h"
 #include "stat.h"
+#include "parallel.h"
+#include "writer.h"
 
 #include <math.h>
+#include <cmath>
+#include <string.h>
+#include <stdio.h>
 #include <algorithm>
 #include <string>
-#include <iomanip>
 
 #define LOG10(x) (log(x)/log(10))
 #define TRIM_STACK_LEVEL(stack_level) std::max(0, int(stack_level))
@@ -22,10 +26,6 @@
 
 namespace fpsprof {
 
-unsigned Printer::_nameColumnWidth = 60;
-uint64_t Printer::_frameRealTimeUsed = 0;
-unsigned Printer::_frameCount = 0;
-
 void Printer::setNameColumnWidth(unsigned nameLen, unsigned stack_level, unsigned num_recursions)
 {
     _nameColumnWidth = FILL_LEN(stack_level) + nameLen  + (num_recursions ? 1 + (unsigned)LOG10(num_recursions) + 3 : 0);
@@ -36,20 +36,32 @@ void Printer::setFrameCounters(uint64_t realtime_used, unsigned count)
     _frameCount = count;
 }
 
-std::string Printer::formatName(const char *name, unsigned stack_level, unsigned num_recursions)
+static void format_fixed(BufferedWriter& w, double v, int width, int prec)
+{
+    w.put(' ');
+    w.put_fixed(v, width, prec);
+}
+
+void Printer::formatName(BufferedWriter& w, const char *name, unsigned stack_level, unsigned num_recursions) const
 {
-    std::string res(FILL_LEN(stack_level), ' ');
-    res += name;
+    size_t fill = FILL_LEN(stack_level);
+    size_t len = strlen(name);
+    char* row = w.reserve(std::max<size_t>(_nameColumnWidth, fill + len + 16));
+    memset(row, ' ', fill);
+    memcpy(row + fill, name, len);
+    len += fill;
     if (num_recursions) {
-        res += std::string("[+") + std::to_string(num_recursions) + "]";
+        len += sprintf(row + len, "[+%u]", num_recursions);
     }
-    if(_nameColumnWidth > res.length()) {
-        res.append(_nameColumnWidth - res.length(), ' ');
+    if(_nameColumnWidth > len) {
+        memset(row + len, ' ', _nameColumnWidth - len);
+        len = _nameColumnWidth;
     }
-    return res;
+    w.commit(len);
 }
 
-std::string Printer::formatData(
+void Printer::formatData(
+    BufferedWriter& w,
     const char *name,
     int stack_level,
     unsigned num_recursions,
@@ -57,50 +69,61 @@ std::string Printer::formatData(
     int64_t children_realtime_used,
     unsigned count,
     int64_t cpu_used
-)
+) const
 {
     const char* NA = "-";
 
-    char totInclP[32], totExclP[32], totInclFPS[32];
+    formatName(w, name, stack_level, num_recursions);
     if (_frameRealTimeUsed > 0) {
         double inclP = 100.f * realtime_used / _frameRealTimeUsed;
         double chldP = 100.f * children_realtime_used / _frameRealTimeUsed;
         double exclP = inclP - chldP;
         double inclFPS = realtime_used ? 1.f / (1e-9f * realtime_used / _frameCount) : 0;
-        sprintf(totInclP, "%6.2f", inclP);
-        sprintf(totExclP, "%6.2f", exclP);
-        sprintf(totInclFPS, "%10.1f", inclFPS);
+        format_fixed(w, inclP, 6, 2);
+        format_fixed(w, exclP, 6, 2);
+        format_fixed(w, inclFPS, 10, 1);
     } else {
-        sprintf(totInclP, "%6s", NA);
-        sprintf(totExclP, "%6s", NA);
-        sprintf(totInclFPS, "%10s", NA);
+        w.printf(" %6s %6s %10s", NA, NA, NA);
     }
 
-    char callsPerFrame[32];
     if(_frameCount > 0) {
         double n = ((double)count) / _frameCount;
-        sprintf(callsPerFrame, "%9.2f", n);
+        format_fixed(w, n, 9, 2);
     } else {
-        sprintf(callsPerFrame, "%9s", NA);
+        w.printf(" %9s", NA);
     }
-    char cpuP[32];
+#if PRINT_CPU_USAGE
     if (realtime_used > 0) {
         double inclP = 100.f* cpu_used / realtime_used;
-        sprintf(cpuP, "%6.1f", inclP);
+        w.printf(" %6.1f", inclP);
     } else {
-        sprintf(cpuP, "%6.1f", 0.);
+        w.printf(" %6.1f", 0.);
     }
-
-    std::string res = formatName(name, stack_level, num_recursions);
-    res.append(" ").append(totInclP);
-    res.append(" ").append(totExclP);
-    res.append(" ").append(totInclFPS);
-    res.append(" ").append(callsPerFrame);
-#if PRINT_CPU_USAGE
-    res.append(" ").append(cpuP);
+#else
+    (void)cpu_used;
 #endif
+}
 
-    return res;
+// Threads are formatted concurrently into their own buffers and written in order,
+// a single worker writes straight to the destination
+template<class fn_t>
+static void print_threads(BufferedWriter& w, unsigned count, const fn_t& fn)
+{
+    if (count <= 1 || num_workers() <= 1) {
+        for (unsigned i = 0; i < count; i++) {
+            fn(w, i);
+        }
+        return;
+    }
+    std::vector<std::string> text(count);
+    parallel_for(count, [&](unsigned i) {
+        BufferedWriter tw(text[i]);
+        fn(tw, i);
+    });
+    for(auto& s: text) {
+        w.write(s);
+        std::string().swap(s);
+    }
 }
 
 #if PRINT_CPU_USAGE
@@ -109,92 +132,153 @@ std::string Printer::formatData(
     #define DATA_WIDTH 41
 #endif
 
-void Printer::printHdr(std::ostream& os, const std::string& name, const char *firstColumnName)
+void Printer::printHdr(BufferedWriter& w, const std::string& name, const char *firstColumnName) const
 {
-    const std::string delim = std::string(Printer::_nameColumnWidth + DATA_WIDTH, '-');
-    os << delim << std::endl;
-    os << name << std::endl;
-    os << delim << std::endl;
+    w.fill('-', _nameColumnWidth + DATA_WIDTH);
+    w.put('\n');
+    w.write(name);
+    w.put('\n');
+    w.fill('-', _nameColumnWidth + DATA_WIDTH);
+    w.put('\n');
 
-    char s[2048];
-    sprintf(s, "%3s %1s %-*s %6s %6s %10s %9s\n", firstColumnName, "L", Printer::_nameColumnWidth, "name",
+    w.printf("%3s %1s %-*s %6s %6s %10s %9s", firstColumnName, "L", _nameColumnWidth, "name",
         "inc%", "exc%", "fps", "call/fr");
 #if PRINT_CPU_USAGE
-    sprintf(s + strlen() - 1, " %6s\n", "cpu%");
+    w.printf(" %6s", "cpu%");
 #endif
-    os << s;
+    w.put('\n');
 }
-void Printer::printTreeHdr(std::ostream& os, const std::string& name) { Printer::printHdr(os, name, "st"); }
-void Printer::printStatHdr(std::ostream& os, const std::string& name) { Printer::printHdr(os, name, "idx"); }
-void Printer::printNode(std::ostream& os, const Node& node)
+void Printer::printTreeHdr(BufferedWriter& w, const std::string& name) const { printHdr(w, name, "st"); }
+void Printer::printStatHdr(BufferedWriter& w, const std::string& name) const { printHdr(w, name, "idx"); }
+void Printer::printNode(BufferedWriter& w, const NodeView& view, const Node& node) const
 {
-    os  << std::setw(3) << node.stack_level() << " "
-        << (node.children().empty() ? "*" : " ") << " "
-        << formatData(node.name(), node.stack_level(), node.num_recursions(), 
-                node.realtime_used(), node.children_realtime_used(), node.count(), node.cpu_used())
-        << std::endl;
+    w.printf("%3d %s ", node.stack_level(), node.children().empty() ? "*" : " ");
+    formatData(w, node.name(), node.stack_level(), node.num_recursions(),
+        view.realtime_used(node), view.children_realtime_used(node), node.count(), node.cpu_used());
+    w.put('\n');
 }
-void Printer::printStat(std::ostream& os, const Stat& stat, unsigned idx)
+void Printer::printStat(BufferedWriter& w, const Stat& stat, unsigned idx) const
 {
-    os  << std::setw(3) << idx << " "
-        << (stat.child_free() ? "*" : " ") << " "
-        << formatData(stat.name(), 0, stat.num_recursions(), 
-                stat.realtime_used(), stat.children_realtime_used(), stat.count(), stat.cpu_used());
+    w.printf("%3u %s ", idx, stat.child_free() ? "*" : " ");
+    formatData(w, stat.name(), 0, stat.num_recursions(),
+        stat.realtime_used(), stat.children_realtime_used(), stat.count(), stat.cpu_used());
 
     bool print_tree = false;
     if(!print_tree) {
-        os << std::endl;
+        w.put('\n');
     } else {
         const auto& paths = stat.paths();
         if(paths.empty()) {
-            os << std::endl;
+            w.put('\n');
         } else {
-            const std::string delim = std::string(Printer::_nameColumnWidth + DATA_WIDTH, ' ');
             for(const auto& path: paths) {
                 if(path != paths.front()) {
-                    os << delim;
+                    w.fill(' ', _nameColumnWidth + DATA_WIDTH);
                 }
-                os << " " << path << std::endl;
+                w.put(' ');
+                w.write(path);
+                w.put('\n');
             }
         }
-    }    
+    }
 }
-void Printer::printTree(std::ostream& os, const Node& node)
+// The children are filtered by depth and time, the top-N of the rest are kept in the tree order
+void Printer::pruneTree(const NodeView& view, const Node& node, std::vector<uint8_t>& keep, std::vector<const Node*>& scratch) const
 {
-    printNode(os, node);
+    keep[node.slot()] = 1;
+    size_t first = scratch.size();
+    for(const auto& child: node.children()) {
+        if(_prune.max_depth >= 0 && child.stack_level() > _prune.max_depth) {
+            continue;
+        }
+        if(100. * view.realtime_used(child) < _prune.min_incl_percent * _frameRealTimeUsed) {
+            continue;
+        }
+        scratch.push_back(&child);
+    }
+    size_t last = scratch.size();
+    if(_prune.top_n_children && last - first > _prune.top_n_children) {
+        auto larger = [&](const Node* a, const Node* b) {
+            uint64_t ta = view.realtime_used(*a), tb = view.realtime_used(*b);
+            return ta != tb ? ta > tb : a->slot() < b->slot();
+        };
+        std::nth_element(scratch.begin() + first, scratch.begin() + first + _prune.top_n_children - 1, scratch.end(), larger);
+        last = first + _prune.top_n_children;
+    }
+    for(size_t i = first; i < last; i++) {
+        pruneTree(view, *scratch[i], keep, scratch); // appends past 'last' and truncates back
+    }
+    scratch.resize(first);
+}
+
+void Printer::printTree(BufferedWriter& w, const NodeView& view, const Node& node, const std::vector<uint8_t>* keep) const
+{
+    printNode(w, view, node);
+
+    uint64_t other_realtime = 0, other_self = 0, other_cpu = 0;
+    unsigned other_count = 0, num_other = 0;
+    bool other_leaf = true;
     for(auto& child: node.children()) {
-        printTree(os, child);
+        if(!keep || (*keep)[child.slot()]) {
+            printTree(w, view, child, keep);
+            continue;
+        }
+        uint64_t realtime = view.realtime_used(child);
+        other_realtime += realtime;
+        other_self += realtime - view.children_realtime_used(child);
+        other_cpu += child.cpu_used();
+        other_count += child.count();
+        other_leaf &= child.children().empty();
+        num_other++;
+    }
+    if(num_other) {
+        int stack_level = node.stack_level() + 1;
+        w.printf("%3d %s ", stack_level, other_leaf ? "*" : " ");
+        formatData(w, "<other>", stack_level, 0, other_realtime, other_realtime - other_self, other_count, other_cpu);
+        w.put('\n');
     }
 }
 
-void Printer::printTrees(std::ostream& os, const char *name, const std::map< int, Node* >& threads, bool heads_only)
+void Printer::printTrees(BufferedWriter& w, const char *name, const std::map< int, NodeView >& threads, bool heads_only) const
 {
     const std::string header = std::string(name) + " [ " + std::to_string(threads.size()) + " thread(s) ]";
 
-    printTreeHdr(os, header);
+    printTreeHdr(w, header);
+    std::vector<const NodeView*> views;
     for(const auto& thread: threads) {
-        const auto node = thread.second;
+        views.push_back(&thread.second);
+    }
+    print_threads(w, (unsigned)views.size(), [&](BufferedWriter& tw, unsigned i) {
+        const NodeView& view = *views[i];
         if(heads_only) {
-            printNode(os, *node);
+            printNode(tw, view, view.root());
+        } else if(!_prune.enabled()) {
+            printTree(tw, view, view.root(), NULL);
         } else {
-            printTree(os, *node);
+            std::vector<uint8_t> keep(view.root().num_slots(), 0);
+            std::vector<const Node*> scratch;
+            pruneTree(view, view.root(), keep, scratch);
+            printTree(tw, view, view.root(), &keep);
         }
-    }
-    os << std::endl;
+    });
+    w.put('\n');
 }
 
-void Printer::printStats(std::ostream& os, const char *name, const std::map< int, std::list< Stat* > >& threads)
+void Printer::printStats(BufferedWriter& w, const char *name, const std::map< int, std::list< Stat > >& threads) const
 {
     const std::string header = std::string(name) + " [ " + std::to_string(threads.size()) + " thread(s) ]";
 
-    printStatHdr(os, header);
+    printStatHdr(w, header);
+    std::vector<const std::list< Stat >*> stats;
     for(const auto& thread: threads) {
-        const auto& stats = thread.second;
+        stats.push_back(&thread.second);
+    }
+    print_threads(w, (unsigned)stats.size(), [&](BufferedWriter& tw, unsigned i) {
         unsigned idx = 1;
-        for(const auto stat: stats) {
-            printStat(os, *stat, idx++);
+        for(const auto& stat: *stats[i]) {
+            printStat(tw, stat, idx++);
         }
-    }
-    os << std::endl;
+    });
+    w.put('\n');
 }
 }
@@ -10,42 +10,59 @@
 #include <vector>
 #include <list>
 #include <map>
-#include <iostream>
 
 namespace fpsprof {
 
 class Node;
+class NodeView;
 class Stat;
+class BufferedWriter;
 
+// Rows left out of the tree sections, the dropped children of a node are folded into one "<other>" row
+struct prune_options_t {
+    double min_incl_percent = 0; // of the frame time
+    int max_depth = -1;          // max stack level, negative is unlimited
+    unsigned top_n_children = 0; // the largest children by inclusive time, 0 is unlimited
+
+    bool enabled() const { return min_incl_percent > 0 || max_depth >= 0 || top_n_children > 0; }
+};
+
+// Formatting state is per instance, the threads of a section are formatted concurrently
 class Printer {
 public:
-    static void setNameColumnWidth(unsigned nameLen, unsigned stack_level, unsigned num_recursions);
-    static void setFrameCounters(uint64_t realtime_used, unsigned count);
-    static void printTrees(std::ostream& os, const char *name, const std::map< int,  Node* >& threads, bool heads_only = false);
-    static void printStats(std::ostream& os, const char *name, const std::map< int, std::list< Stat* > >& threads);
+    void setNameColumnWidth(unsigned nameLen, unsigned stack_level, unsigned num_recursions);
+    void setFrameCounters(uint64_t realtime_used, unsigned count);
+    void setPruning(const prune_options_t& prune) { _prune = prune; }
+    void printTrees(BufferedWriter& w, const char *name, const std::map< int, NodeView >& threads, bool heads_only = false) const;
+    void printStats(BufferedWriter& w, const char *name, const std::map< int, std::list< Stat > >& threads) const;
 
 
 protected:
-    static void printTreeHdr(std::ostream& os, const std::string& name);
-    static void printStatHdr(std::ostream& os, const std::string& name);
-    static void printNode(std::ostream& os, const Node& node);
-    static void printTree(std::ostream& os, const Node& node);
-    static void printStat(std::ostream& os, const Stat& stat, unsigned idx);
+    void printTreeHdr(BufferedWriter& w, const std::string& name) const;
+    void printStatHdr(BufferedWriter& w, const std::string& name) const;
+    void printNode(BufferedWriter& w, const NodeView& view, const Node& node) const;
+    void printTree(BufferedWriter& w, const NodeView& view, const Node& node, const std::vector<uint8_t>* keep) const;
+    void printStat(BufferedWriter& w, const Stat& stat, unsigned idx) const;
 
 private:
-    static std::string formatData(const char *name, int stack_level, unsigned num_recursions,
+    // rows are formatted in place, nothing is allocated per row
+    void formatData(BufferedWriter& w, const char *name, int stack_level, unsigned num_recursions,
         int64_t realtime_used,
         int64_t children_realtime_used,
         unsigned count,
         int64_t cpu_used
-    );
-    static std::string formatName(const char *name, unsigned stack_level, unsigned num_recursions);
+    ) const;
+    void formatName(BufferedWriter& w, const char *name, unsigned stack_level, unsigned num_recursions) const;
+
+    // keep[slot] is set for the printed nodes
+    void pruneTree(const NodeView& view, const Node& node, std::vector<uint8_t>& keep, std::vector<const Node*>& scratch) const;
 
-    static void printHdr(std::ostream& os, const std::string& name, const char *firstColumnName);
+    void printHdr(BufferedWriter& w, const std::string& name, const char *firstColumnName) const;
 
-    static unsigned _nameColumnWidth;
-    static uint64_t _frameRealTimeUsed;
-    static unsigned _frameCount;
+    unsigned _nameColumnWidth = 60;
+    uint64_t _frameRealTimeUsed = 0;
+    unsigned _frameCount = 0;
+    prune_options_t _prune;
 };
 
 }
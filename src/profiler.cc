@@ -30,6 +30,14 @@ extern "C" void FPSPROF_serialize_file(const char* filename)
 {
     fpsprof::gThreadMgr.set_serialize_file(filename);
 }
+extern "C" void FPSPROF_serialize_format(unsigned fmt)
+{
+    fpsprof::gThreadMgr.set_serialize_format(fmt);
+}
+extern "C" void FPSPROF_serialize_compress(int compress)
+{
+    fpsprof::gThreadMgr.set_serialize_compress(compress != 0);
+}
 extern "C" void FPSPROF_report_stream(FILE* fp)
 {
     fpsprof::gThreadMgr.set_report_stream(fp);
@@ -8,6 +8,7 @@
 #include "profthread.h"
 
 #include <algorithm>
+#include <string.h>
 
 namespace fpsprof {
 
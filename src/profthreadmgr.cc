@@ -8,8 +8,16 @@
 #include "profthreadmgr.h"
 #include "profthread.h"
 #include "reporter.h"
+#include "blockcomp.h"
+#include "writer.h"
+#include "kernels.h"
+
+#include <string.h>
+#include <math.h>
 
 #include <fstream>
+#include <vector>
+#include <algorithm>
 
 namespace fpsprof {
 
@@ -31,7 +39,7 @@ extern "C" _noinline void FPSPROF_stop_dummy(void* handle)
     fpsprof::gDummyProfThread->pop((fpsprof::ProfPoint*)handle);
 }
 
-static std::list<uint64_t> collect_counters(unsigned n)
+static std::vector<uint64_t> collect_counters(unsigned n)
 {
     struct DummyProfThreadMgr : public IProfThreadMgr {
         void onProfThreadExit(std::list<ProfPoint>&& marks) override { storage = std::move(marks); }
@@ -52,36 +60,29 @@ static std::list<uint64_t> collect_counters(unsigned n)
     delete gDummyProfThread; // dump events
     const std::list<ProfPoint>& storage = gDummyProfThreadMgr.storage;
 
-    std::list<uint64_t> data;
+    std::vector<uint64_t> data;
+    data.reserve(storage.size());
     for(const auto& pp: storage) {
         data.push_back(pp.realtime_stop() - pp.realtime_start());
     }
     return data;
 }
 
-static void refine_counter_lo(const std::list<uint64_t>& data, uint64_t& refined_sum, unsigned& refined_cnt)
+static void refine_counter_lo(const uint64_t* data, size_t n, uint64_t& refined_sum, unsigned& refined_cnt)
 {
-    if(data.empty()) {
+    if(n == 0) {
         refined_sum = 0;
         refined_cnt = 0;
         return;
     }
-    unsigned hist_sz = 1024;
-    unsigned *hist = new unsigned[hist_sz];
-    memset(hist, 0, sizeof(*hist)*hist_sz);
-
-    uint64_t min = 0, max = data.front();
-    for(auto d: data) {
-        min = std::min(min, d);
-        max = std::max(max, d);
-    }
-    uint64_t bin_width = (max - min + hist_sz - 1)/hist_sz;
-    bin_width = std::max(bin_width, (uint64_t)1);
-    for(auto d: data) {
-        unsigned idx = (unsigned)( (d - min)/bin_width );
-        assert(idx < hist_sz);
-        hist[idx] += 1;
-    }
+    const unsigned hist_sz = 1024;
+    std::vector<uint32_t> hist(hist_sz);
+
+    // bins start from zero, not from the minimum
+    uint64_t min, max;
+    minmax_u64(data, n, min, max);
+    uint64_t bin_width = max/hist_sz + 1;
+    histogram_u64(data, n, bin_width, hist.data(), hist_sz);
 
     // first (nonzero) max bin
     unsigned hist_max = 0, bin_max = 0;
@@ -92,58 +93,24 @@ static void refine_counter_lo(const std::list<uint64_t>& data, uint64_t& refined
         }
     }
 
-    int idx_end = bin_max;
-    for(; idx_end < (int)hist_sz; idx_end++) {
-        if(hist[idx_end] < (unsigned)(hist[bin_max]*.95)) {
-            break;
-        }
-    }
     unsigned fac = 5;
-    idx_end = (bin_max+1)*fac; // only consider values x times greater than max_at_bin_max
-
-    unsigned cnt = 0;
-    uint64_t sum = 0, sum2 = 0;
-    for(auto d: data) {
-        int idx = (int)( (d - min)/bin_width );
-        if(idx < idx_end) {
-            sum += d;
-            cnt += 1;
-        } else {
-            sum2 += d;
-        }
-    }
+    uint64_t idx_end = (bin_max+1)*fac; // only consider values x times greater than max_at_bin_max
 
-    refined_sum = sum;
-    refined_cnt = cnt;
-
-    delete [] hist;
+    size_t cnt;
+    refined_sum = sum_below_u64(data, n, idx_end*bin_width, cnt);
+    refined_cnt = (unsigned)cnt;
 }
 
-static double refine_counter_hi(const std::list< double >& data)
+static double refine_counter_hi(const std::vector<double>& data)
 {
-    double sum = 0;
-    for(const auto d: data) {
-        sum += d;
-    }
-    double avg = sum / data.size(), sigma = 0;
-    for(const auto d: data) {
-        sigma += (d - avg)*(d - avg);
-    }
-    sigma = sqrtl(sigma / data.size());
-
-    unsigned n = 0;
-    sum = 0;
-    for(const auto d: data) { // sigma ~ 68%, 2*sigma ~ 95%
-        if( avg - sigma < d && d < avg + sigma) {
-            sum += d;
-            n += 1;
-        }
-    }
+    double avg = sum_f64(data.data(), data.size()) / data.size();
+    double sigma = sqrt(sum_sq_dev_f64(data.data(), data.size(), avg) / data.size());
+
+    size_t n; // sigma ~ 68%, 2*sigma ~ 95%
+    double sum = sum_in_range_f64(data.data(), data.size(), avg - sigma, avg + sigma, n);
     if(n == 0) { // maybe
-        for(const auto d: data) {
-            sum += d;
-        }
-        n = (unsigned)data.size();
+        sum = sum_f64(data.data(), data.size());
+        n = data.size();
     }
     return sum / n;
 }
@@ -151,28 +118,22 @@ static double refine_counter_hi(const std::list< double >& data)
 ProfThreadMgr::ProfThreadMgr()
     : _reporter(new Reporter)
 {
-    std::list< double > stat_s, stat_c;
+    std::vector<double> stat_s, stat_c;
     unsigned num_outer = 100, num_inner = 10000;
     while(num_outer--) {
         auto data = collect_counters(num_inner);
 
-        uint64_t children_nsec = data.front();
-        data.pop_front();
+        uint64_t children_nsec = data.front(); // outer call, the rest are the empty inner calls
 
         uint64_t self_nsec;
         unsigned refined_cnt;
-        refine_counter_lo(data, self_nsec, refined_cnt);
+        refine_counter_lo(data.data() + 1, data.size() - 1, self_nsec, refined_cnt);
         
         stat_s.push_back((double)self_nsec / refined_cnt);
-        stat_c.push_back((double)children_nsec / data.size());
+        stat_c.push_back((double)children_nsec / (data.size() - 1));
     }
 
-    double sum_s = 0;
-    for(const auto d: stat_s) {
-        sum_s += d;
-    }
-
-    double self_nsec = sum_s / stat_s.size();
+    double self_nsec = sum_f64(stat_s.data(), stat_s.size()) / stat_s.size();
     //double children_nsec = sum_c / stat_c.size();
     double children_nsec = refine_counter_hi(stat_c);
 
@@ -185,16 +146,33 @@ ProfThreadMgr::ProfThreadMgr()
 }
 
 ProfThreadMgr::~ProfThreadMgr() {
+    auto serialize = [&](std::ostream& os) {
+        if (_serialize_compress) {
+            BlockCompressOStream zos(os);
+            _reporter->Serialize(zos, _serialize_fmt);
+            zos.finish();
+        } else {
+            _reporter->Serialize(os, _serialize_fmt);
+        }
+    };
     if (!_serialize_filename.empty()) {
         std::ofstream ofs(_serialize_filename, std::ios::out | std::ios::binary | std::ios::trunc);
         if (ofs.is_open()) {
-            _reporter->Serialize(ofs);
+            serialize(ofs);
             ofs.close();
         }
+    } else if (_serialize) {
+        FileOStream os(_serialize);
+        serialize(os);
+        os.flush();
     }
     FILE *fp = !_report_filename.empty() ? fopen(_report_filename.c_str(), "wb") : _report;
     if (fp) {
-        fprintf(fp, "%s\n", _reporter->Report().c_str());
+        {
+            BufferedWriter out(fp);
+            _reporter->Report(out);
+            out.put('\n');
+        }
         if (!_report_filename.empty()) {
             fclose(fp);
         }
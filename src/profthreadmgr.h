@@ -36,12 +36,16 @@ public:
 
     void set_serialize_stream(FILE* stream) { _serialize = stream; }
     void set_serialize_file(const char* filename) { _serialize_filename = filename ? filename : ""; }
+    void set_serialize_format(unsigned fmt) { _serialize_fmt = fmt; }
+    void set_serialize_compress(bool compress) { _serialize_compress = compress; }
     void set_report_stream(FILE* stream) { _report = stream; }
     void set_report_file(const char* filename) { _report_filename = filename ? filename : ""; }
 
 private:
     FILE* _serialize = NULL;
     std::string _serialize_filename;
+    unsigned _serialize_fmt = 2;
+    bool _serialize_compress = false;
     FILE* _report = NULL;
     std::string _report_filename;
 
@@ -9,20 +9,30 @@
 #include "node.h"
 #include "stat.h"
 #include "printer.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "timers.h"
+#include "writer.h"
+#include "timeline.h"
+#include "flamegraph.h"
+#include "merge.h"
+#include "scaling.h"
+#include "slowframes.h"
+#include "critpath.h"
+#include "concurrency.h"
 
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
 
-#include <sstream>
-#include <iostream>
-#include <iomanip>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <exception>
+#include <stdexcept>
+#include <memory>
 
 namespace fpsprof {
 
@@ -31,113 +41,460 @@ void Reporter::AddRawThread(std::list<ProfPoint>&& marks)
     _threadMap.AddRawThread(std::move(marks));
 }
 
-bool Reporter::Deserialize(const char* filename)
+bool Reporter::Deserialize(const char* filename, bool use_cache)
 {
     fprintf(stderr, "Reading '%s'\n", filename);
 
-    std::ifstream ifs;
-    ifs.open(filename, std::ifstream::in | std::ifstream::binary);
-    if (!ifs.is_open()) {
+    MappedFile file;
+    if (!file.Open(filename)) {
         return false;
     }
-    
-    return _threadMap.Deserialize(ifs);
+
+    timer::wallclock_t start = timer::wallclock::timestamp();
+    use_cache &= !_range.enabled();
+    std::string cache_name = std::string(filename) + ".cache";
+    uint64_t hash = use_cache ? content_hash(file.data(), file.size()) : 0;
+    if (use_cache && load_cache(cache_name.c_str(), file.size(), hash)) {
+        double sec = 1e-9 * timer::wallclock::diff(timer::wallclock::timestamp(), start);
+        fprintf(stderr, "Loaded '%s' in %.2f sec\n", cache_name.c_str(), sec);
+        return true;
+    }
+    if (!_threadMap.Deserialize(file.data(), file.size(), _range)) {
+        return false;
+    }
+    double sec = 1e-9 * timer::wallclock::diff(timer::wallclock::timestamp(), start);
+    double mb = file.size() / (1024. * 1024.);
+    fprintf(stderr, "Read %.1f MB in %.2f sec (%.1f MB/s)\n", mb, sec, sec > 0 ? mb / sec : 0);
+
+    if (use_cache) {
+        save_cache(cache_name.c_str(), file.size(), hash);
+    }
+    return true;
 }
 
-void Reporter::Serialize(std::ostream& os) const
+bool Reporter::load_cache(const char* filename, uint64_t log_size, uint64_t log_hash)
 {
-    _threadMap.Serialize(os);
+    MappedFile file;
+    if (!file.Open(filename)) {
+        return false;
+    }
+    if (!_threadMap.LoadCache(file.data(), file.size(), log_size, log_hash)) {
+        fprintf(stderr, "Ignoring outdated or damaged '%s'\n", filename);
+        return false;
+    }
+    return true;
 }
 
-void generate_reports(
-    ThreadMap& threadMap,
-    std::map< int, Node* >& threadsFull,
-    std::map< int, Node* >& threadsNoRecur,
-    std::map< int, std::list< Stat* > >& funcStatsFull,
-    std::map< int, std::list< Stat* > >& funcStatsNoRecur
-)
+// written under a temporary name, so an interrupted run never leaves a partial cache
+void Reporter::save_cache(const char* filename, uint64_t log_size, uint64_t log_hash) const
 {
-    const std::map<int, Node* >& threads = threadMap.threads();
-    unsigned penalty_denom = threadMap.reported_penalty_denom();
-    uint64_t penalty_self_nsec = threadMap.reported_penalty_self_nsec();
-    uint64_t penalty_children_nsec = threadMap.reported_penalty_children_nsec();
+    std::string tmp_name = std::string(filename) + ".tmp";
+    {
+        std::ofstream ofs(tmp_name, std::ios::binary);
+        if (ofs) {
+            _threadMap.SaveCache(ofs, log_size, log_hash);
+        }
+        if (!ofs) {
+            fprintf(stderr, "warning: failed to write '%s'\n", tmp_name.c_str());
+            remove(tmp_name.c_str());
+            return;
+        }
+    }
+    remove(filename);
+    if (rename(tmp_name.c_str(), filename) != 0) {
+        fprintf(stderr, "warning: failed to write '%s'\n", filename);
+        remove(tmp_name.c_str());
+    }
+}
 
+void Reporter::Serialize(std::ostream& os, unsigned fmt) const
+{
+    _threadMap.Serialize(os, fmt);
+}
+
+bool Reporter::ExportChromeTrace(const char* filename, BufferedWriter& out, const frame_range_t& range)
+{
+    fprintf(stderr, "Reading '%s'\n", filename);
+
+    MappedFile file;
+    EventStream events;
+    if (!file.Open(filename) || !events.Open(file.data(), file.size(), range)) {
+        return false;
+    }
+    const char* basename = std::max(strrchr(filename, '/'), strrchr(filename, '\\'));
+    bool ok = WriteChromeTrace(out, events, basename ? basename + 1 : filename);
+    return out.flush() && ok;
+}
+
+bool Reporter::ReportSlowestFrames(const char* filename, unsigned max_frames, BufferedWriter& out, const frame_range_t& range)
+{
+    fprintf(stderr, "Searching the slowest frames\n");
+
+    SlowFrames frames(max_frames);
+    if (!frames.Collect(filename, range)) {
+        return false;
+    }
+    frames.Write(out);
+    return out.flush();
+}
+
+bool Reporter::ReportCriticalPath(const char* filename, unsigned max_sites, BufferedWriter& out, const frame_range_t& range)
+{
+    fprintf(stderr, "Walking the critical path of the frames\n");
+
+    CriticalPath path(max_sites);
+    if (!path.Collect(filename, range)) {
+        return false;
+    }
+    path.Write(out);
+    return out.flush();
+}
+
+bool Reporter::ReportConcurrency(const char* filename, BufferedWriter& out, const frame_range_t& range)
+{
+    fprintf(stderr, "Sweeping the busy threads\n");
+
+    ConcurrencyProfile profile;
+    if (!profile.Collect(filename, range)) {
+        return false;
+    }
+    profile.Write(out);
+    return out.flush();
+}
+
+Reporter::Reporter()
+{
+}
+
+Reporter::~Reporter()
+{
+}
+
+// The no-recursion trees depend on the counters only, they are built once and shared by
+// the reports of all penalty settings
+void Reporter::prepare()
+{
+    if (!_threadsNoRecur.empty()) {
+        return;
+    }
+    const std::map<int, Node* >& threads = _threadMap.threads();
+    std::vector<int> thread_ids;
     for (auto& thread : threads) {
-        int thread_id = thread.first;
-        const auto rootFull = thread.second;
+        thread_ids.push_back(thread.first);
+        _threadsNoRecur[thread.first];
+        _noRecurCredit[thread.first];
+    }
+    parallel_for((unsigned)thread_ids.size(), [&](unsigned i) {
+        int thread_id = thread_ids[i];
+        _threadsNoRecur[thread_id].reset(Node::CreateNoRecur(*threads.at(thread_id), &_noRecurCredit[thread_id]));
+    });
+}
 
-        auto rootNoRecur = Node::CreateNoRecur(*rootFull); fflush(stderr);
-        Node::MitigateCounterPenalty(*rootFull, penalty_denom, penalty_self_nsec, penalty_children_nsec);
+// Everything built by one report run, released when the run is over
+struct report_data_t {
+    std::map< int, NodeView > threadsFull, threadsNoRecur;
+    std::map< int, std::list<Stat> > funcStatsFull, funcStatsNoRecur;
+};
 
-        auto rootNoRecur2 = Node::CreateNoRecur(*rootFull);
-        Node::MitigateCounterPenalty(*rootNoRecur, penalty_denom, penalty_self_nsec, penalty_children_nsec);
+void Reporter::generate_reports(report_data_t& data, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec) const
+{
+    const std::map<int, Node* >& threads = _threadMap.threads();
 
-        threadsFull[thread_id] = rootFull;
-        threadsNoRecur[thread_id] = rootNoRecur;
-        funcStatsFull[thread_id] = Stat::CollectStatistics(*rootNoRecur2);
-        funcStatsNoRecur[thread_id] = Stat::CollectStatistics(*rootNoRecur);
+    // threads are independent, the result slots are created upfront and filled by one task each
+    std::vector<int> thread_ids;
+    for (auto& thread : threads) {
+        int thread_id = thread.first;
+        thread_ids.push_back(thread_id);
+        data.threadsFull[thread_id];
+        data.threadsNoRecur[thread_id];
+        data.funcStatsFull[thread_id];
+        data.funcStatsNoRecur[thread_id];
     }
+
+    parallel_for((unsigned)thread_ids.size(), [&](unsigned i) {
+        int thread_id = thread_ids[i];
+        const Node& rootFull = *threads.at(thread_id);
+        const Node& rootNoRecur = *_threadsNoRecur.at(thread_id);
+
+        // the full-tree statistics are collected over the no-recursion tree with the time of the compensated full tree
+        NodeView viewFull = Node::MitigateCounterPenalty(rootFull, penalty_denom, penalty_self_nsec, penalty_children_nsec);
+        NodeView viewNoRecur = Node::MitigateCounterPenalty(rootNoRecur, penalty_denom, penalty_self_nsec, penalty_children_nsec);
+        NodeView viewNoRecurFull = Node::NoRecurTime(rootNoRecur, viewFull, _noRecurCredit.at(thread_id));
+
+        data.funcStatsFull[thread_id] = Stat::CollectStatistics(viewNoRecurFull);
+        data.funcStatsNoRecur[thread_id] = Stat::CollectStatistics(viewNoRecur);
+        data.threadsFull[thread_id] = std::move(viewFull);
+        data.threadsNoRecur[thread_id] = std::move(viewNoRecur);
+    });
 }
 
-std::string Reporter::report(double self_nsec, double childer_nsec)
+// false if there is nothing to report
+bool Reporter::resolve_penalty(double self_nsec, double childer_nsec, unsigned& penalty_denom, uint64_t& penalty_self_nsec, uint64_t& penalty_children_nsec)
 {
+    _threadMap.BuildTrees();
     if(_threadMap.threads().empty()) {
-        return "";
+        return false;
+    }
+    penalty_denom = _threadMap.reported_penalty_denom();
+    if(penalty_denom == 0) {
+        throw std::runtime_error("penalty resolution not set");
+    }
+    penalty_self_nsec = self_nsec >= 0 ? uint64_t(penalty_denom * self_nsec) : _threadMap.reported_penalty_self_nsec();
+    penalty_children_nsec = childer_nsec >= 0 ? uint64_t(penalty_denom * childer_nsec) : _threadMap.reported_penalty_children_nsec();
+    return true;
+}
+
+// the compensated trees and statistics of one penalty setting, false if there is nothing to report
+bool Reporter::collect(report_data_t& data, double self_nsec, double childer_nsec)
+{
+    unsigned penalty_denom;
+    uint64_t penalty_self_nsec, penalty_children_nsec;
+    if (!resolve_penalty(self_nsec, childer_nsec, penalty_denom, penalty_self_nsec, penalty_children_nsec)) {
+        return false;
     }
-    _threadMap.set_penalty(self_nsec, childer_nsec);
 
     fprintf(stderr, "Generating reports\n");
 
-    std::map< int, Node* > threadsFull, threadsNoRecur;
-    std::map< int, std::list<Stat*> > funcStatsFull, funcStatsNoRecur;
-    generate_reports(_threadMap, threadsFull, threadsNoRecur, funcStatsFull, funcStatsNoRecur);
+    prepare();
+    generate_reports(data, penalty_denom, penalty_self_nsec, penalty_children_nsec);
+    return true;
+}
 
-    //const auto frameThread = threadsFull[0];
-    const auto frameThread = threadsNoRecur[0];
-    if(frameThread->children().empty()) { // root only
-        return "";
+// the first top-level node of the frame thread, false if there is none
+bool Reporter::frame_counters(const report_data_t& data, uint64_t& realtime_used, unsigned& count) const
+{
+    //const auto& frameThread = data.threadsFull.at(0);
+    const auto& frameThread = data.threadsNoRecur.at(0);
+    if(frameThread.root().children().empty()) { // root only
+        return false;
     }
-    {
-        const auto& frameNode = frameThread->children().front();
-        Printer::setFrameCounters(frameNode.realtime_used(), frameNode.count());
+    const auto& frameNode = frameThread.root().children().front();
+    realtime_used = frameThread.realtime_used(frameNode);
+    count = frameNode.count();
+    return true;
+}
+
+void Reporter::report(BufferedWriter& out, double self_nsec, double childer_nsec)
+{
+    report_data_t data;
+    if (!collect(data, self_nsec, childer_nsec)) {
+        return;
     }
+    const auto& threadsFull = data.threadsFull;
+    const auto& threadsNoRecur = data.threadsNoRecur;
+
+    uint64_t frameRealTimeUsed;
+    unsigned frameCount;
+    if (!frame_counters(data, frameRealTimeUsed, frameCount)) {
+        return;
+    }
+    Printer printer;
+    printer.setFrameCounters(frameRealTimeUsed, frameCount);
     {
         unsigned stackLevelMax = 0, nameLengthMax = 0;
         for (const auto& thread : threadsFull) {
-            auto *node = thread.second;
-            stackLevelMax = std::max(stackLevelMax, node->stack_level_max());
-            nameLengthMax = std::max(nameLengthMax, node->name_len_max());
+            const auto& node = thread.second.root();
+            stackLevelMax = std::max(stackLevelMax, node.stack_level_max());
+            nameLengthMax = std::max(nameLengthMax, node.name_len_max());
+        }
+        if (_prune.enabled()) { // deeper rows are folded into "<other>" one level below the cut
+            if (_prune.max_depth >= 0) {
+                stackLevelMax = std::min(stackLevelMax, (unsigned)_prune.max_depth + 1);
+            }
+            nameLengthMax = std::max(nameLengthMax, (unsigned)strlen("<other>"));
         }
-        Printer::setNameColumnWidth(nameLengthMax, stackLevelMax, 0);
+        printer.setNameColumnWidth(nameLengthMax, stackLevelMax, 0);
+        printer.setPruning(_prune);
     }
 
-#define DEBUG_REPORT 0
-#if DEBUG_REPORT
-    std::ostream& ss = std::cout;
-#else
-    std::stringstream ss;
-#endif
     fprintf(stderr, "Print\n");
-    Printer::printTrees(ss, "Threads summary", threadsFull, true);
-    Printer::printTrees(ss, "Detailed report", threadsFull);
-    Printer::printTrees(ss, "Summary report (no recursion)", threadsNoRecur);
-    Printer::printStats(ss, "Function statistics (Full)", funcStatsFull);
-    Printer::printStats(ss, "Function statistics (no recursion)", funcStatsNoRecur);
+    printer.printTrees(out, "Threads summary", threadsFull, true);
+    printer.printTrees(out, "Detailed report", threadsFull);
+    printer.printTrees(out, "Summary report (no recursion)", threadsNoRecur);
+    printer.printStats(out, "Function statistics (Full)", data.funcStatsFull);
+    printer.printStats(out, "Function statistics (no recursion)", data.funcStatsNoRecur);
+}
+
+bool Reporter::Report(BufferedWriter& out, double self_nsec, double childer_nsec)
+{
+    try {
+        this->report(out, self_nsec, childer_nsec);
+    } catch (std::exception& e) {
+        fprintf(stderr, "exception: %s\n", e.what());
+        return false;
+    }
+    return out.flush();
+}
 
-#if DEBUG_REPORT
-    return "We're maintaining. Keep calm and don't panic.";
-#else
-    return ss.str();
-#endif
+std::map<int, NodeView> Reporter::tree_views(tree_t tree, double self_nsec, double childer_nsec)
+{
+    std::map<int, NodeView> views;
+    unsigned penalty_denom;
+    uint64_t penalty_self_nsec, penalty_children_nsec;
+    if (!resolve_penalty(self_nsec, childer_nsec, penalty_denom, penalty_self_nsec, penalty_children_nsec)) {
+        return views;
+    }
+    if (tree == TREE_NO_RECURSION) {
+        prepare();
+    }
+    const std::map<int, Node* >& threads = _threadMap.threads();
+    std::vector<int> thread_ids;
+    for (auto& thread : threads) {
+        thread_ids.push_back(thread.first);
+        views[thread.first];
+    }
+    parallel_for((unsigned)thread_ids.size(), [&](unsigned i) {
+        int thread_id = thread_ids[i];
+        const Node& root = tree == TREE_FULL ? *threads.at(thread_id) : *_threadsNoRecur.at(thread_id);
+        views[thread_id] = Node::MitigateCounterPenalty(root, penalty_denom, penalty_self_nsec, penalty_children_nsec);
+    });
+    return views;
 }
 
-std::string Reporter::Report(double self_nsec, double childer_nsec)
+bool Reporter::ExportFolded(BufferedWriter& out, tree_t tree, double self_nsec, double childer_nsec)
+{
+    try {
+        WriteFolded(out, tree_views(tree, self_nsec, childer_nsec));
+    } catch (std::exception& e) {
+        fprintf(stderr, "exception: %s\n", e.what());
+        return false;
+    }
+    return out.flush();
+}
+
+bool Reporter::ExportFlameGraph(BufferedWriter& out, tree_t tree, const char* title, double self_nsec, double childer_nsec)
 {
     try {
-        return this->report(self_nsec, childer_nsec);
+        WriteFlameGraphSvg(out, tree_views(tree, self_nsec, childer_nsec), title);
     } catch (std::exception& e) {
         fprintf(stderr, "exception: %s\n", e.what());
+        return false;
+    }
+    return out.flush();
+}
+
+bool Reporter::Diff(const char* base, const char* cur, BufferedWriter& out, const diff_options_t& options, diff_result_t& result,
+    bool use_cache, double self_nsec, double childer_nsec, const frame_range_t& range)
+{
+    const char* filenames[2] = { base, cur };
+    Reporter reporters[2];
+    report_data_t data[2];
+    FrameSamples samples[2];
+    diff_side_t sides[2];
+    bool ok[4] = { false, false, false, false };
+    try {
+        // the trees and the frame samples of both logs are read independently
+        parallel_for(4, [&](unsigned i) {
+            unsigned k = i / 2;
+            if (i % 2) {
+                ok[i] = samples[k].Collect(filenames[k], range);
+                return;
+            }
+            sides[k].frame_realtime = 0;
+            sides[k].frame_count = 0;
+            reporters[k].SetFrameRange(range);
+            ok[i] = reporters[k].Deserialize(filenames[k], use_cache);
+            if (ok[i] && reporters[k].collect(data[k], self_nsec, childer_nsec)) {
+                reporters[k].frame_counters(data[k], sides[k].frame_realtime, sides[k].frame_count);
+            }
+        });
+        for (unsigned i = 0; i < 4; i++) {
+            if (!ok[i]) {
+                fprintf(stderr, "failed to read '%s'\n", filenames[i / 2]);
+                return false;
+            }
+        }
+        for (int k = 0; k < 2; k++) {
+            sides[k].name = filenames[k];
+            sides[k].threads = &data[k].threadsFull;
+            sides[k].stats = &data[k].funcStatsFull;
+            sides[k].samples = &samples[k];
+        }
+        WriteDiff(out, sides[0], sides[1], options, result);
+    } catch (std::exception& e) {
+        fprintf(stderr, "exception: %s\n", e.what());
+        return false;
+    }
+    return out.flush();
+}
+
+bool Reporter::Merge(const std::vector<const char*>& filenames, BufferedWriter& out,
+    bool use_cache, double self_nsec, double childer_nsec, const frame_range_t& range)
+{
+    RunMerge merge(std::vector<std::string>(filenames.begin(), filenames.end()));
+    std::vector<char> ok(filenames.size(), 0);
+    try {
+        parallel_for((unsigned)filenames.size(), [&](unsigned run) {
+            Reporter reporter;
+            reporter.SetFrameRange(range);
+            if (!reporter.Deserialize(filenames[run], use_cache)) {
+                return;
+            }
+            report_data_t data;
+            uint64_t frame_realtime = 0;
+            unsigned frame_count = 0;
+            if (reporter.collect(data, self_nsec, childer_nsec)) {
+                reporter.frame_counters(data, frame_realtime, frame_count);
+            }
+            merge.AddRun(run, frame_realtime, frame_count, data.threadsFull, data.threadsNoRecur, data.funcStatsFull, data.funcStatsNoRecur);
+            ok[run] = 1;
+        });
+        for (size_t run = 0; run < filenames.size(); run++) {
+            if (!ok[run]) {
+                fprintf(stderr, "failed to read '%s'\n", filenames[run]);
+                return false;
+            }
+        }
+        merge.Write(out);
+    } catch (std::exception& e) {
+        fprintf(stderr, "exception: %s\n", e.what());
+        return false;
+    }
+    return out.flush();
+}
+
+bool Reporter::Scaling(const std::vector<unsigned>& num_threads, const std::vector<const char*>& filenames, BufferedWriter& out,
+    bool use_cache, double self_nsec, double childer_nsec, const frame_range_t& range)
+{
+    ScalingStudy study(num_threads, std::vector<std::string>(filenames.begin(), filenames.end()));
+    std::vector<char> ok(filenames.size(), 0);
+    try {
+        parallel_for((unsigned)filenames.size(), [&](unsigned run) {
+            Reporter reporter;
+            reporter.SetFrameRange(range);
+            if (!reporter.Deserialize(filenames[run], use_cache)) {
+                return;
+            }
+            report_data_t data;
+            uint64_t frame_realtime = 0;
+            unsigned frame_count = 0;
+            if (reporter.collect(data, self_nsec, childer_nsec)) {
+                reporter.frame_counters(data, frame_realtime, frame_count);
+            }
+            study.AddRun(run, frame_realtime, frame_count, data.threadsNoRecur);
+            ok[run] = 1;
+        });
+        for (size_t run = 0; run < filenames.size(); run++) {
+            if (!ok[run]) {
+                fprintf(stderr, "failed to read '%s'\n", filenames[run]);
+                return false;
+            }
+        }
+        study.Write(out);
+    } catch (std::exception& e) {
+        fprintf(stderr, "exception: %s\n", e.what());
+        return false;
+    }
+    return out.flush();
+}
+
+std::string Reporter::Report(double self_nsec, double childer_nsec)
+{
+    std::string text;
+    BufferedWriter out(text);
+    if (!Report(out, self_nsec, childer_nsec)) {
         return "";
     }
+    return text;
 }
 }
@@ -7,27 +7,89 @@
 
 #include "profpoint.h"
 #include "thread.h"
+#include "printer.h"
+#include "diff.h"
 
 #include <string>
 #include <list>
 #include <vector>
 #include <map>
+#include <memory>
 
 namespace fpsprof {
 
+class Node;
+class BufferedWriter;
+struct report_data_t;
+
 class Reporter {
 public:
+    Reporter();
+    ~Reporter();
+
     void AddRawThread(std::list<ProfPoint>&& marks);
-    bool Deserialize(const char* filename);
+    // the frames read by the next Deserialize(), the cache holds the whole log and is not used then
+    void SetFrameRange(const frame_range_t& range) { _range = range; }
+    // the aggregated trees are kept in '<filename>.cache' if 'use_cache' is set
+    bool Deserialize(const char* filename, bool use_cache = false);
+
+    void Serialize(std::ostream& os, unsigned fmt = 2) const;
+
+    // streams the events of a log as a timeline, no trees are built
+    static bool ExportChromeTrace(const char* filename, BufferedWriter& out, const frame_range_t& range = frame_range_t());
+
+    // the event trees of the slowest frames and the activity of the other threads in them,
+    // streamed from the log, see slowframes.h
+    static bool ReportSlowestFrames(const char* filename, unsigned max_frames, BufferedWriter& out, const frame_range_t& range = frame_range_t());
+    // the sites on the cross-thread critical path of the frames, see critpath.h
+    static bool ReportCriticalPath(const char* filename, unsigned max_sites, BufferedWriter& out, const frame_range_t& range = frame_range_t());
+    // the busy threads over time by a sweep over the top-level scopes, see concurrency.h
+    static bool ReportConcurrency(const char* filename, BufferedWriter& out, const frame_range_t& range = frame_range_t());
 
-    void Serialize(std::ostream& os) const;
+    // applies to the tree sections of the next reports
+    void SetPruning(const prune_options_t& prune) { _prune = prune; }
 
-    // one-shot (destroy data on return)
+    // negative penalty stands for the value stored in the log;
+    // may be called repeatedly with different settings, the trees are built once
+    bool Report(BufferedWriter& out, double self_nsec = -1, double childer_nsec = -1);
     std::string Report(double self_nsec = -1, double childer_nsec = -1);
 
+    // the stacks of the compensated trees weighted by the exclusive time, see flamegraph.h
+    enum tree_t { TREE_FULL, TREE_NO_RECURSION };
+    bool ExportFolded(BufferedWriter& out, tree_t tree, double self_nsec = -1, double childer_nsec = -1);
+    bool ExportFlameGraph(BufferedWriter& out, tree_t tree, const char* title, double self_nsec = -1, double childer_nsec = -1);
+
+    // the full trees of two logs aligned by call path, the per-frame time of both logs
+    // tells the significant changes
+    static bool Diff(const char* base, const char* cur, BufferedWriter& out, const diff_options_t& options, diff_result_t& result,
+        bool use_cache = false, double self_nsec = -1, double childer_nsec = -1, const frame_range_t& range = frame_range_t());
+
+    // the report sections of several runs with mean, stddev, min and max of every value;
+    // the logs are read in parallel and folded in one by one
+    static bool Merge(const std::vector<const char*>& filenames, BufferedWriter& out,
+        bool use_cache = false, double self_nsec = -1, double childer_nsec = -1, const frame_range_t& range = frame_range_t());
+
+    // the runs of the same workload with different thread counts, one per log:
+    // speedup, parallel efficiency and serial fraction of every thread role and call path
+    static bool Scaling(const std::vector<unsigned>& num_threads, const std::vector<const char*>& filenames, BufferedWriter& out,
+        bool use_cache = false, double self_nsec = -1, double childer_nsec = -1, const frame_range_t& range = frame_range_t());
+
 private:
-    std::string report(double self_nsec, double childer_nsec);
+    bool load_cache(const char* filename, uint64_t log_size, uint64_t log_hash);
+    void save_cache(const char* filename, uint64_t log_size, uint64_t log_hash) const;
+    void report(BufferedWriter& out, double self_nsec, double childer_nsec);
+    bool resolve_penalty(double self_nsec, double childer_nsec, unsigned& penalty_denom, uint64_t& penalty_self_nsec, uint64_t& penalty_children_nsec);
+    std::map<int, NodeView> tree_views(tree_t tree, double self_nsec, double childer_nsec);
+    void prepare();
+    bool collect(report_data_t& data, double self_nsec, double childer_nsec);
+    bool frame_counters(const report_data_t& data, uint64_t& realtime_used, unsigned& count) const;
+    void generate_reports(report_data_t& data, unsigned penalty_denom, uint64_t penalty_self_nsec, uint64_t penalty_children_nsec) const;
+
     ThreadMap _threadMap;
+    frame_range_t _range;
+    prune_options_t _prune;
+    std::map<int, std::unique_ptr<Node> > _threadsNoRecur;
+    std::map<int, std::vector<size_t> > _noRecurCredit; // full tree slot -> no-recursion tree slot
 };
 
 }
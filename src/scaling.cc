@@ -0,0 +1,442 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "scaling.h"
+#include "node.h"
+#include "writer.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define FILL_LEN(stack_level) std::min(128, 2 * std::max(0, int(stack_level)))
+
+namespace fpsprof {
+
+// a node stops scaling when a step gains less than this part of the ideal speedup
+static const double min_step_gain = 0.5;
+// the nodes below this percent of the base frame time are too noisy to rank
+static const double min_rank_percent = 1;
+
+// the points of a node in the thread count order, NAN where the node is not in the run
+struct ScalingStudy::curve_t {
+    std::vector<double> time; // nsec per frame per thread
+    std::vector<double> speedup, efficiency, serial;
+    double serial_fit = NAN; // least squares over the runs
+    unsigned stop = 0; // the thread count the node stops scaling at, 0 if it does not
+};
+
+ScalingStudy::ScalingStudy(const std::vector<unsigned>& num_threads, const std::vector<std::string>& run_names)
+    : _num_threads(num_threads)
+    , _run_names(run_names)
+    , _frame_realtime(run_names.size(), 0)
+    , _frame_count(run_names.size(), 0)
+{
+    for (unsigned run = 0; run < (unsigned)run_names.size(); run++) {
+        _order.push_back(run);
+    }
+    std::stable_sort(_order.begin(), _order.end(), [&](unsigned a, unsigned b) {
+        return _num_threads[a] < _num_threads[b];
+    });
+}
+
+unsigned ScalingStudy::intern(const char* name)
+{
+    auto res = _name_ids.emplace(name, (unsigned)_names.size());
+    if (res.second) {
+        _names.push_back(name);
+    }
+    return res.first->second;
+}
+
+unsigned ScalingStudy::add_node(unsigned parent, unsigned name, int stack_level, uint64_t order)
+{
+    auto res = _children.emplace((uint64_t)parent << 32 | name, (unsigned)_nodes.size());
+    unsigned idx = res.first->second;
+    if (!res.second) {
+        _nodes[idx].order = std::min(_nodes[idx].order, order);
+        return idx;
+    }
+    _nodes.push_back(node_t{ name, stack_level, order, 0, {} });
+    _values.resize(_nodes.size() * _run_names.size());
+    _parents.push_back(parent);
+    if (parent != ~0u) {
+        _nodes[parent].children.push_back(idx);
+    }
+    return idx;
+}
+
+void ScalingStudy::add_tree(unsigned run, const NodeView& view, const Node& node, unsigned merged)
+{
+    value_t& value = _values[merged * _run_names.size() + run];
+    value.realtime_used += view.realtime_used(node);
+    value.count += node.count();
+    value.threads++;
+
+    uint64_t pos = 0;
+    for (const auto& child : node.children()) {
+        unsigned idx = add_node(merged, intern(child.name()), child.stack_level(), (uint64_t)run << 32 | pos++);
+        _nodes[idx].num_recursions = std::max(_nodes[idx].num_recursions, child.num_recursions());
+        add_tree(run, view, child, idx);
+    }
+}
+
+void ScalingStudy::AddRun(unsigned run, uint64_t frame_realtime, unsigned frame_count, const std::map<int, NodeView>& threadsNoRecur)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _frame_realtime[run] = frame_realtime;
+    _frame_count[run] = frame_count;
+
+    for (const auto& thread : threadsNoRecur) {
+        const NodeView& view = thread.second;
+        const Node* head = NULL;
+        for (const auto& child : view.root().children()) {
+            if (!head || view.realtime_used(child) > view.realtime_used(*head)) {
+                head = &child;
+            }
+        }
+        if (!head) { // no events
+            continue;
+        }
+        std::string role = head->name();
+        auto it = _roles.find(role);
+        if (it == _roles.end()) {
+            unsigned root = add_node(~0u, intern(("<" + role + ">").c_str()), -1, 0);
+            it = _roles.emplace(role, role_t{ root, thread.first }).first;
+        }
+        it->second.first_thread_id = std::min(it->second.first_thread_id, thread.first);
+        add_tree(run, view, view.root(), it->second.root);
+    }
+}
+
+double ScalingStudy::frame_time(unsigned run) const
+{
+    return _frame_count[run] ? (double)_frame_realtime[run] / _frame_count[run] : NAN;
+}
+
+// Speedup against the base run, the efficiency is the speedup per thread count ratio and
+// the serial fraction is the Karp-Flatt metric, the one Amdahl's law would give for the point
+static void fit_curve(const std::vector<double>& num_threads, std::vector<double>& time,
+    std::vector<double>& speedup, std::vector<double>& efficiency, std::vector<double>& serial,
+    double& serial_fit, unsigned& stop)
+{
+    size_t n = time.size();
+    speedup.assign(n, NAN);
+    efficiency.assign(n, NAN);
+    serial.assign(n, NAN);
+    serial_fit = NAN;
+    stop = 0;
+    if (n == 0 || !(time[0] > 0)) {
+        return;
+    }
+    double num = 0, den = 0;
+    size_t prev = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (!(time[k] > 0)) {
+            continue;
+        }
+        double p = num_threads[k] / num_threads[0];
+        speedup[k] = time[0] / time[k];
+        efficiency[k] = speedup[k] / p;
+        if (p > 1) {
+            serial[k] = (1 / speedup[k] - 1 / p) / (1 - 1 / p);
+            num += (1 / speedup[k] - 1 / p) * (1 - 1 / p);
+            den += (1 - 1 / p) * (1 - 1 / p);
+        }
+        if (k > prev && !stop) {
+            double ideal = num_threads[k] / num_threads[prev];
+            if (ideal > 1 && speedup[k] / speedup[prev] - 1 < min_step_gain * (ideal - 1)) {
+                stop = (unsigned)num_threads[k];
+            }
+        }
+        prev = k;
+    }
+    if (den > 0) {
+        serial_fit = num / den;
+    }
+}
+
+void ScalingStudy::node_curve(unsigned node, curve_t& curve) const
+{
+    size_t num_runs = _run_names.size();
+    std::vector<double> num_threads;
+    curve.time.clear();
+    for (unsigned run : _order) {
+        const value_t& value = _values[node * num_runs + run];
+        num_threads.push_back(_num_threads[run]);
+        curve.time.push_back(_frame_count[run] && value.threads ?
+            (double)value.realtime_used / _frame_count[run] / value.threads : NAN);
+    }
+    fit_curve(num_threads, curve.time, curve.speedup, curve.efficiency, curve.serial, curve.serial_fit, curve.stop);
+}
+
+// "a > b > c" below the role root
+std::string ScalingStudy::path(unsigned node) const
+{
+    std::string text;
+    for (; _parents[node] != ~0u; node = _parents[node]) {
+        text = text.empty() ? _names[_nodes[node].name] : _names[_nodes[node].name] + " > " + text;
+    }
+    return text;
+}
+
+unsigned ScalingStudy::name_len(unsigned node) const
+{
+    const node_t& n = _nodes[node];
+    unsigned len = FILL_LEN(n.stack_level) + (unsigned)_names[n.name].size();
+    if (n.num_recursions) {
+        len += 3 + (unsigned)std::to_string(n.num_recursions).size();
+    }
+    return len;
+}
+
+void ScalingStudy::write_name(BufferedWriter& w, unsigned node) const
+{
+    const node_t& n = _nodes[node];
+    w.fill(' ', FILL_LEN(n.stack_level));
+    w.write(_names[n.name]);
+    if (n.num_recursions) {
+        w.printf("[+%u]", n.num_recursions);
+    }
+}
+
+static void put_value(BufferedWriter& w, double v, int width, int prec)
+{
+    w.put(' ');
+    if (isfinite(v)) {
+        w.put_fixed(v, width, prec);
+    } else {
+        w.printf("%*s", width, "-");
+    }
+}
+
+// the lowest thread count a ranked node stops scaling at, 0 if all of them scale
+unsigned ScalingStudy::first_stop() const
+{
+    double base_frame = frame_time(_order[0]);
+    unsigned first = 0;
+    curve_t curve;
+    for (unsigned node = 0; node < (unsigned)_nodes.size(); node++) {
+        if (_parents[node] == ~0u) {
+            continue;
+        }
+        node_curve(node, curve);
+        if (curve.stop && 100 * curve.time[0] / base_frame >= min_rank_percent && (!first || curve.stop < first)) {
+            first = curve.stop;
+        }
+    }
+    return first;
+}
+
+void ScalingStudy::write_runs(BufferedWriter& w) const
+{
+    std::vector<double> num_threads, time, speedup, efficiency, serial;
+    for (unsigned run : _order) {
+        num_threads.push_back(_num_threads[run]);
+        time.push_back(frame_time(run));
+    }
+    double serial_fit;
+    unsigned stop;
+    fit_curve(num_threads, time, speedup, efficiency, serial, serial_fit, stop);
+
+    w.printf("Scaling study [ %zu run(s) ]\n", _run_names.size());
+    w.printf("%7s %9s %12s %10s %8s %6s %8s  %s\n", "threads", "frames", "ms/frame", "fps", "speedup", "eff%", "serial%", "log");
+    for (size_t k = 0; k < _order.size(); k++) {
+        unsigned run = _order[k];
+        w.printf("%7u %9u", _num_threads[run], _frame_count[run]);
+        put_value(w, 1e-6 * time[k], 12, 3);
+        put_value(w, 1e9 / time[k], 10, 1);
+        put_value(w, speedup[k], 8, 2);
+        put_value(w, 100 * efficiency[k], 6, 1);
+        put_value(w, 100 * serial[k], 8, 1);
+        w.printf("  %s\n", _run_names[run].c_str());
+    }
+    if (isfinite(serial_fit)) {
+        w.printf("Amdahl's serial fraction of the frame %.1f%%", 100 * serial_fit);
+        if (serial_fit > 0) {
+            w.printf(", speedup limit %.2f", 1 / serial_fit);
+        }
+        if (stop) {
+            w.printf(", stops scaling at %u threads", stop);
+        }
+        w.put('\n');
+    }
+    w.put('\n');
+}
+
+// by the first thread id, the frame thread first; the map is ordered by name
+std::vector<const std::pair<const std::string, ScalingStudy::role_t>*> ScalingStudy::roles() const
+{
+    std::vector<const std::pair<const std::string, role_t>*> roles;
+    for (const auto& role : _roles) {
+        roles.push_back(&role);
+    }
+    std::stable_sort(roles.begin(), roles.end(), [](const std::pair<const std::string, role_t>* a, const std::pair<const std::string, role_t>* b) {
+        return a->second.first_thread_id < b->second.first_thread_id;
+    });
+    return roles;
+}
+
+// the thread summary rows of every role: the number of threads and their mean busy time
+void ScalingStudy::write_roles(BufferedWriter& w) const
+{
+    size_t num_runs = _run_names.size();
+    unsigned name_width = 4; // "role"
+    for (const auto& role : _roles) {
+        name_width = std::max(name_width, (unsigned)role.first.size());
+    }
+    w.printf("Thread roles [ %zu role(s) ]\n", _roles.size());
+    w.printf("%-*s", name_width, "role");
+    for (unsigned run : _order) {
+        char hdr[32];
+        snprintf(hdr, sizeof(hdr), "n@%u", _num_threads[run]);
+        w.printf(" %6s %6s", hdr, "busy%");
+    }
+    w.put('\n');
+
+    for (const auto* role : roles()) {
+        unsigned root = role->second.root;
+        w.printf("%-*s", name_width, role->first.c_str());
+        for (unsigned run : _order) {
+            const value_t& value = _values[root * num_runs + run];
+            w.printf(" %6u", value.threads);
+            put_value(w, value.threads && _frame_realtime[run] ?
+                100. * value.realtime_used / value.threads / _frame_realtime[run] : NAN, 6, 1);
+        }
+        w.put('\n');
+    }
+    w.put('\n');
+}
+
+void ScalingStudy::write_tree(BufferedWriter& w, unsigned node, unsigned name_width, unsigned first_stop) const
+{
+    const node_t& n = _nodes[node];
+    curve_t curve;
+    node_curve(node, curve);
+    bool first = first_stop && curve.stop == first_stop && n.stack_level >= 0 &&
+        100 * curve.time[0] / frame_time(_order[0]) >= min_rank_percent;
+
+    w.printf("%3d %s ", n.stack_level, first ? "<" : " ");
+    write_name(w, node);
+    w.fill(' ', name_width - std::min(name_width, name_len(node)));
+    put_value(w, 1e-6 * curve.time[0], 9, 3);
+    for (size_t k = 1; k < _order.size(); k++) {
+        put_value(w, curve.speedup[k], 6, 2);
+        put_value(w, 100 * curve.efficiency[k], 6, 1);
+    }
+    put_value(w, 100 * curve.serial_fit, 8, 1);
+    if (curve.stop) {
+        w.printf(" %5u\n", curve.stop);
+    } else {
+        w.printf(" %5s\n", "-");
+    }
+
+    std::vector<unsigned> children = n.children;
+    std::sort(children.begin(), children.end(), [&](unsigned a, unsigned b) {
+        return _nodes[a].order < _nodes[b].order;
+    });
+    for (unsigned child : children) {
+        write_tree(w, child, name_width, first_stop);
+    }
+}
+
+void ScalingStudy::write_trees(BufferedWriter& w) const
+{
+    unsigned name_width = 4; // "name"
+    for (unsigned node = 0; node < (unsigned)_nodes.size(); node++) {
+        name_width = std::max(name_width, name_len(node));
+    }
+    size_t line_width = 6 + name_width + 10 + 14 * (_order.size() - 1) + 9 + 6;
+    std::string name = "Scaling by call path (no recursion) [ " + std::to_string(_roles.size()) + " role(s), " +
+        std::to_string(_run_names.size()) + " run(s) ]";
+    w.fill('-', line_width);
+    w.put('\n');
+    w.write(name);
+    w.put('\n');
+    w.fill('-', line_width);
+    w.put('\n');
+
+    char hdr[32];
+    snprintf(hdr, sizeof(hdr), "ms@%u", _num_threads[_order[0]]);
+    w.printf("%3s %1s %-*s %9s", "st", "L", name_width, "name", hdr);
+    for (size_t k = 1; k < _order.size(); k++) {
+        char s[32], e[32];
+        snprintf(s, sizeof(s), "S@%u", _num_threads[_order[k]]);
+        snprintf(e, sizeof(e), "E%%@%u", _num_threads[_order[k]]);
+        w.printf(" %6s %6s", s, e);
+    }
+    w.printf(" %8s %5s\n", "serial%", "stop");
+
+    unsigned first = first_stop();
+    for (const auto* role : roles()) {
+        write_tree(w, role->second.root, name_width, first);
+    }
+    w.put('\n');
+}
+
+// the nodes by the thread count they stop scaling at, the larger share of the frame first
+void ScalingStudy::write_first_stops(BufferedWriter& w) const
+{
+    double base_frame = frame_time(_order[0]);
+    struct row_t {
+        unsigned stop;
+        double share;
+        unsigned node;
+    };
+    std::vector<row_t> rows;
+    curve_t curve;
+    for (unsigned node = 0; node < (unsigned)_nodes.size(); node++) {
+        if (_parents[node] == ~0u) {
+            continue;
+        }
+        node_curve(node, curve);
+        double share = 100 * curve.time[0] / base_frame;
+        if (curve.stop && share >= min_rank_percent) {
+            rows.push_back(row_t{ curve.stop, share, node });
+        }
+    }
+    std::stable_sort(rows.begin(), rows.end(), [](const row_t& a, const row_t& b) {
+        return a.stop != b.stop ? a.stop < b.stop : a.share > b.share;
+    });
+
+    w.printf("Stops scaling first [ %zu node(s) ]\n", rows.size());
+    w.printf("%5s %7s %8s %8s  %s\n", "stop", "share%", "S-before", "S-at", "role: path");
+    for (const auto& row : rows) {
+        node_curve(row.node, curve);
+        size_t k = 0;
+        while (_num_threads[_order[k]] != row.stop) {
+            k++;
+        }
+        size_t prev = k - 1;
+        while (prev > 0 && !isfinite(curve.speedup[prev])) {
+            prev--;
+        }
+        unsigned root = row.node;
+        while (_parents[root] != ~0u) {
+            root = _parents[root];
+        }
+        const std::string& role = _names[_nodes[root].name]; // "<role>"
+        w.printf("%5u", row.stop);
+        put_value(w, row.share, 7, 2);
+        put_value(w, curve.speedup[prev], 8, 2);
+        put_value(w, curve.speedup[k], 8, 2);
+        w.printf("  %.*s: %s\n", int(role.size() - 2), role.c_str() + 1, path(row.node).c_str());
+    }
+    w.put('\n');
+}
+
+void ScalingStudy::Write(BufferedWriter& w) const
+{
+    if (_order.empty()) {
+        return;
+    }
+    write_runs(w);
+    write_roles(w);
+    write_trees(w);
+    write_first_stops(w);
+}
+
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+
+namespace fpsprof {
+
+class Node;
+class NodeView;
+class BufferedWriter;
+
+// Runs of the same workload with different thread counts merged by thread role and call path.
+// The role of a thread is its heaviest top-level scope, the threads of a pool run the same jobs
+// and the frame thread runs the frames. The time of a node is its time per frame per thread
+// that runs it, the smallest thread count is the base of the speedup.
+class ScalingStudy {
+public:
+    ScalingStudy(const std::vector<unsigned>& num_threads, const std::vector<std::string>& run_names);
+
+    // thread-safe, the runs may come in any order
+    void AddRun(unsigned run, uint64_t frame_realtime, unsigned frame_count, const std::map<int, NodeView>& threadsNoRecur);
+
+    // speedup, parallel efficiency and Amdahl's serial fraction of the frame, the thread roles
+    // and every call path, the nodes that stop scaling at the lowest thread count first
+    void Write(BufferedWriter& w) const;
+
+private:
+    struct value_t {
+        uint64_t realtime_used = 0;
+        unsigned count = 0;
+        unsigned threads = 0; // threads of the role the node shows up in
+    };
+    struct node_t {
+        unsigned name;
+        int stack_level;
+        uint64_t order; // run << 32 | position among the siblings of the first run it shows up in
+        unsigned num_recursions; // the largest of the runs
+        std::vector<unsigned> children;
+    };
+    struct role_t {
+        unsigned root;
+        int first_thread_id; // the smallest over the runs, roles are listed in this order
+    };
+    struct curve_t;
+
+    unsigned intern(const char* name);
+    unsigned add_node(unsigned parent, unsigned name, int stack_level, uint64_t order);
+    void add_tree(unsigned run, const NodeView& view, const Node& node, unsigned merged);
+
+    double frame_time(unsigned run) const;
+    void node_curve(unsigned node, curve_t& curve) const;
+    std::string path(unsigned node) const;
+
+    void write_runs(BufferedWriter& w) const;
+    void write_roles(BufferedWriter& w) const;
+    void write_tree(BufferedWriter& w, unsigned node, unsigned name_width, unsigned first_stop) const;
+    void write_trees(BufferedWriter& w) const;
+    void write_first_stops(BufferedWriter& w) const;
+    unsigned name_len(unsigned node) const;
+    void write_name(BufferedWriter& w, unsigned node) const;
+    unsigned first_stop() const;
+    std::vector<const std::pair<const std::string, role_t>*> roles() const;
+
+    std::vector<unsigned> _num_threads;
+    std::vector<std::string> _run_names;
+    std::vector<unsigned> _order; // runs by the thread count, the base first
+    std::vector<uint64_t> _frame_realtime;
+    std::vector<unsigned> _frame_count;
+    std::vector<std::string> _names;
+    std::unordered_map<std::string, unsigned> _name_ids;
+    std::vector<node_t> _nodes;
+    std::vector<value_t> _values; // node * num_runs + run
+    std::vector<unsigned> _parents;
+    std::unordered_map<uint64_t, unsigned> _children; // parent << 32 | name -> node
+    std::map<std::string, role_t> _roles;
+    std::mutex _mutex;
+};
+
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "slowframes.h"
+#include "thread.h"
+#include "event.h"
+#include "mapped_file.h"
+#include "writer.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+#define FILL_LEN(stack_level) std::min(128, 2 * std::max(0, int(stack_level)))
+
+namespace fpsprof {
+
+// the most active scopes of a thread listed in a frame
+static const unsigned max_thread_scopes = 3;
+
+SlowFrames::SlowFrames(unsigned max_frames)
+    : _max_frames(max_frames)
+{
+}
+
+// heap order, the later of two equal frames goes first
+bool SlowFrames::faster(const frame_t& a, const frame_t& b)
+{
+    uint64_t da = a.duration(), db = b.duration();
+    return da != db ? da < db : a.index > b.index;
+}
+
+// A frame is known to be slow enough at its start event, the stream has the stop time of an event
+// with the start. Then the frame collects the events that start before its stop, frames do not
+// overlap so there is one frame at most to fill.
+bool SlowFrames::Collect(const char* filename, const frame_range_t& range)
+{
+    MappedFile file;
+    EventStream events;
+    if (!file.Open(filename) || !events.Open(file.data(), file.size(), range)) {
+        return false;
+    }
+    _num_threads = (unsigned)events.thread_ids().size();
+    _time_base = events.log_start_nsec();
+
+    auto cmp = [](const frame_t& a, const frame_t& b) { return faster(b, a); };
+    std::unordered_map<const char*, unsigned> interned; // the stream names are interned
+    std::map<int, event_t> last_scope; // the latest top-level scope of every other thread
+    frame_t cur;
+    bool filling = false;
+    int thread_id;
+    Event event;
+    while (events.Next(thread_id, event)) {
+        if (filling && event.start_nsec() > cur.events.front().stop_nsec) {
+            _heap.push_back(std::move(cur));
+            std::push_heap(_heap.begin(), _heap.end(), cmp);
+            if (_heap.size() > _max_frames) {
+                std::pop_heap(_heap.begin(), _heap.end(), cmp);
+                _heap.pop_back();
+            }
+            filling = false;
+        }
+
+        auto it = interned.find(event.name());
+        if (it == interned.end()) {
+            it = interned.emplace(event.name(), (unsigned)_names.size()).first;
+            _names.push_back(event.name());
+        }
+        event_t e{ it->second, event.stack_level(), event.start_nsec(), event.stop_nsec() };
+        bool top = event.stack_level() <= 0;
+
+        if (thread_id == 0 && top && event.frame_flag() && events.frame_thread_found()) {
+            uint64_t duration = e.stop_nsec - e.start_nsec;
+            _frames_nsec += duration;
+            unsigned index = range.first + _num_frames++;
+            if (_heap.size() < _max_frames || duration > _heap.front().duration()) {
+                cur.index = index;
+                cur.events.assign(1, e);
+                cur.others.clear();
+                for (const auto& scope : last_scope) { // already running
+                    if (scope.second.stop_nsec > e.start_nsec) {
+                        cur.others.emplace_back(scope.first, scope.second);
+                    }
+                }
+                filling = true;
+            }
+            continue;
+        }
+        if (thread_id != 0 && top) {
+            last_scope[thread_id] = e;
+        }
+        if (filling && e.start_nsec < cur.events.front().stop_nsec) {
+            if (thread_id == 0) {
+                cur.events.push_back(e);
+            } else if (top) {
+                cur.others.emplace_back(thread_id, e);
+            }
+        }
+    }
+    if (filling) {
+        _heap.push_back(std::move(cur));
+        std::push_heap(_heap.begin(), _heap.end(), cmp);
+        if (_heap.size() > _max_frames) {
+            std::pop_heap(_heap.begin(), _heap.end(), cmp);
+            _heap.pop_back();
+        }
+    }
+    return !events.failed();
+}
+
+static void put_msec(BufferedWriter& w, uint64_t nsec, int width)
+{
+    w.put(' ');
+    w.put_fixed(1e-6 * (double)nsec, width, 3);
+}
+
+void SlowFrames::write_frame(BufferedWriter& w, const frame_t& frame) const
+{
+    const event_t& head = frame.events.front();
+    uint64_t duration = frame.duration();
+
+    // the exclusive time, a child takes its time from the parent
+    std::vector<uint64_t> self(frame.events.size());
+    std::vector<size_t> stack; // event by the stack level below the frame
+    for (size_t i = 0; i < frame.events.size(); i++) {
+        const event_t& e = frame.events[i];
+        self[i] = e.stop_nsec - e.start_nsec;
+        size_t depth = std::min(stack.size(), (size_t)std::max(0, e.stack_level - head.stack_level));
+        stack.resize(depth);
+        if (!stack.empty()) {
+            self[stack.back()] -= std::min(self[stack.back()], e.stop_nsec - e.start_nsec);
+        }
+        stack.push_back(i);
+    }
+
+    w.printf("%12s %12s %10s %10s %7s  %s\n", "start ms", "stop ms", "time ms", "self ms", "frame%", "name");
+    for (size_t i = 0; i < frame.events.size(); i++) {
+        const event_t& e = frame.events[i];
+        put_msec(w, e.start_nsec - _time_base, 11);
+        put_msec(w, e.stop_nsec - _time_base, 12);
+        put_msec(w, e.stop_nsec - e.start_nsec, 10);
+        put_msec(w, self[i], 10);
+        w.put(' ');
+        w.put_fixed(duration ? 100. * (e.stop_nsec - e.start_nsec) / duration : 0, 7, 2);
+        w.write("  ", 2);
+        w.fill(' ', FILL_LEN(e.stack_level - head.stack_level));
+        w.write(_names[e.name]);
+        w.put('\n');
+    }
+}
+
+// busy time of the top-level scopes cut to the frame, the largest scopes by name
+void SlowFrames::write_threads(BufferedWriter& w, const frame_t& frame) const
+{
+    uint64_t start = frame.events.front().start_nsec, stop = frame.events.front().stop_nsec;
+    struct scope_t {
+        uint64_t nsec = 0;
+        unsigned count = 0;
+    };
+    struct thread_t {
+        uint64_t busy_nsec = 0;
+        unsigned count = 0;
+        std::map<unsigned, scope_t> scopes;
+    };
+    std::map<int, thread_t> threads;
+    for (const auto& item : frame.others) {
+        const event_t& e = item.second;
+        uint64_t nsec = std::min(e.stop_nsec, stop) - std::max(e.start_nsec, start);
+        thread_t& th = threads[item.first];
+        th.busy_nsec += nsec;
+        th.count++;
+        th.scopes[e.name].nsec += nsec;
+        th.scopes[e.name].count++;
+    }
+
+    w.printf("Other threads [ %zu of %u active ]\n", threads.size(), _num_threads ? _num_threads - 1 : 0);
+    if (threads.empty()) {
+        return;
+    }
+    w.printf("%7s %7s %10s %7s  %s\n", "thread", "busy%", "busy ms", "scopes", "largest scopes: ms (count)");
+    uint64_t duration = frame.duration();
+    for (const auto& item : threads) {
+        const thread_t& th = item.second;
+        w.printf("%7d ", item.first);
+        w.put_fixed(duration ? 100. * th.busy_nsec / duration : 0, 7, 2);
+        put_msec(w, th.busy_nsec, 10);
+        w.printf(" %7u ", th.count);
+
+        std::vector<std::pair<uint64_t, unsigned> > order;
+        for (const auto& scope : th.scopes) {
+            order.emplace_back(scope.second.nsec, scope.first);
+        }
+        std::stable_sort(order.begin(), order.end(), [](const std::pair<uint64_t, unsigned>& a, const std::pair<uint64_t, unsigned>& b) {
+            return a.first > b.first;
+        });
+        for (size_t i = 0; i < order.size() && i < max_thread_scopes; i++) {
+            const scope_t& scope = th.scopes.at(order[i].second);
+            w.printf("%s %s %.3f (%u)", i ? "," : "", _names[order[i].second].c_str(), 1e-6 * scope.nsec, scope.count);
+        }
+        if (order.size() > max_thread_scopes) {
+            w.printf(", +%zu more", order.size() - max_thread_scopes);
+        }
+        w.put('\n');
+    }
+}
+
+void SlowFrames::Write(BufferedWriter& w) const
+{
+    std::vector<const frame_t*> frames;
+    for (const auto& frame : _heap) {
+        frames.push_back(&frame);
+    }
+    std::sort(frames.begin(), frames.end(), [](const frame_t* a, const frame_t* b) {
+        return faster(*b, *a);
+    });
+
+    double mean = _num_frames ? (double)_frames_nsec / _num_frames : 0;
+    w.printf("Slowest frames [ %zu of %u frame(s), mean %.3f ms ]\n", frames.size(), _num_frames, 1e-6 * mean);
+    w.put('\n');
+    for (const frame_t* frame : frames) {
+        uint64_t duration = frame->duration();
+        w.printf("Frame %u: %.3f ms", frame->index, 1e-6 * duration);
+        if (mean > 0) {
+            w.printf(" (x%.2f the mean)", duration / mean);
+        }
+        w.printf(", %.3f ms since the log start\n", 1e-6 * (frame->events.front().start_nsec - _time_base));
+        write_frame(w, *frame);
+        write_threads(w, *frame);
+        w.put('\n');
+    }
+}
+
+}
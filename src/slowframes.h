@@ -0,0 +1,61 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace fpsprof {
+
+class BufferedWriter;
+struct frame_range_t;
+
+// The slowest top-level frames of the frame thread, kept in a bounded heap while the log is
+// streamed. A frame keeps the events of the frame thread inside it and the top-level scopes
+// of the other threads that overlap it. The times are the logged ones, no penalty compensation.
+class SlowFrames {
+public:
+    explicit SlowFrames(unsigned max_frames);
+
+    // the frames keep their numbers in the log
+    bool Collect(const char* filename, const frame_range_t& range);
+
+    unsigned num_frames() const { return _num_frames; }
+
+    // the slowest first: the event tree of the frame with the times since the first event of
+    // the log, same as the chrome-trace timestamps, then the activity of the other threads
+    void Write(BufferedWriter& w) const;
+
+private:
+    struct event_t {
+        unsigned name;
+        int stack_level;
+        uint64_t start_nsec;
+        uint64_t stop_nsec;
+    };
+    struct frame_t {
+        unsigned index;
+        std::vector<event_t> events; // the frame first, then the nested events in the call order
+        std::vector<std::pair<int, event_t> > others; // top-level scopes of the other threads
+
+        uint64_t duration() const { return events.front().stop_nsec - events.front().start_nsec; }
+    };
+    static bool faster(const frame_t& a, const frame_t& b);
+
+    void write_frame(BufferedWriter& w, const frame_t& frame) const;
+    void write_threads(BufferedWriter& w, const frame_t& frame) const;
+
+    unsigned _max_frames;
+    std::vector<frame_t> _heap; // the fastest kept frame on top
+    std::vector<std::string> _names;
+    unsigned _num_frames = 0;
+    unsigned _num_threads = 0;
+    uint64_t _frames_nsec = 0;
+    uint64_t _time_base = 0;
+};
+
+}
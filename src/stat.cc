@@ -11,104 +11,120 @@
 #include <assert.h>
 #include <stdexcept>
 #include <algorithm>
+#include <unordered_map>
 
 namespace fpsprof {
 
-static void check_recursion(const Node& node)
-{
-    auto *name = node.name();
-    auto *parent = node.parent();
-    while(parent) {
-        if(parent->name() == name) {
-            throw std::runtime_error("recursion detected on statistics collection stage");
-        }
-        parent = parent->parent();
-    }
-}
-
-Stat::Stat(const Node& node, const std::string& path)
+Stat::Stat(const NodeView& view, const Node& node, const std::shared_ptr<const path_table_t>& path_table, unsigned path)
     : _name(node.name())
     , _stack_level_min(node.stack_level())
     , _measure_process_time(node.measure_process_time())
-    , _realtime_used(node.realtime_used())
+    , _realtime_used(view.realtime_used(node))
     , _cpu_used(node.cpu_used())
     , _count(node.count())
     , _num_recursions(node.num_recursions())
-    , _children_realtime_used(node.children_realtime_used())
+    , _children_realtime_used(view.children_realtime_used(node))
     , _child_free(node.children().empty())
+    , _path_table(path_table)
 {
     _paths.push_back(path);
-    check_recursion(node);
 }
 
-void Stat::add_node(const Node& node, const std::string& path)
+void Stat::add_node(const NodeView& view, const Node& node, unsigned path)
 {
-    check_recursion(node);
-
     assert(_name == node.name());
     assert(_measure_process_time == node.measure_process_time());
 
     _stack_level_min = std::min(_stack_level_min, node.stack_level());
-    _realtime_used += node.realtime_used();
+    _realtime_used += view.realtime_used(node);
     _cpu_used += node.cpu_used();
     _count += node.count();
     _num_recursions += node.num_recursions();
-    _children_realtime_used += node.children_realtime_used();
+    _children_realtime_used += view.children_realtime_used(node);
     _child_free &= node.children().empty();
     _paths.push_back(path);
 }
 
-static void collect_statistics(std::list<Stat*>& stats, const Node& node, const std::string& path = "")
+// nearest parent first: "parent::grandparent::..."
+std::string Stat::path_table_t::str(unsigned id) const
 {
-    bool found = false;
-    for(auto stat: stats) {
-        if(stat->name() == node.name()) {
-            stat->add_node(node, path);
-            found = true;
-            break;
+    std::string res;
+    for (; id != 0; id = paths[id].parent) {
+        if (!res.empty()) {
+            res += "::";
         }
+        res += paths[id].name;
     }
-    if(!found) {
-        stats.push_back(new Stat(node, path));
+    return res;
+}
+
+std::list<std::string> Stat::paths() const
+{
+    std::list<std::string> res;
+    for (auto id : _paths) {
+        res.push_back(_path_table->str(id));
     }
+    res.sort();
+    return res;
+}
+
+namespace {
+struct collector_t {
+    explicit collector_t(const NodeView& view) : view(view) {}
 
-    for(auto& child: node.children()) {
-        std::string pathNext;
-        if(node.stack_level() >= 0) {
-            pathNext = std::string(node.name()) + (path.empty() ? "" : "::") + path;
+    const NodeView& view;
+    std::shared_ptr<Stat::path_table_t> path_table = std::make_shared<Stat::path_table_t>();
+    std::unordered_map<const char*, unsigned> name_ids;
+    std::list<Stat> stats; // in the order of the first appearance
+    std::vector<Stat*> index; // by the name id
+    std::vector<bool> on_path; // recursion check, indexed by the name id
+
+    void collect(const Node& node, unsigned path) {
+        auto ins = name_ids.emplace(node.name(), (unsigned)stats.size());
+        unsigned id = ins.first->second;
+        if (ins.second) {
+            stats.emplace_back(view, node, path_table, path);
+            index.push_back(&stats.back());
+            on_path.push_back(false);
+        } else {
+            if (on_path[id]) {
+                throw std::runtime_error("recursion detected on statistics collection stage");
+            }
+            index[id]->add_node(view, node, path);
+        }
+        if (node.children().empty()) {
+            return;
         }
-        collect_statistics(stats, child, pathNext);
+        unsigned pathNext = node.stack_level() >= 0 ? path_table->add(path, node.name()) : 0;
+        on_path[id] = true;
+        for (auto& child : node.children()) {
+            collect(child, pathNext);
+        }
+        on_path[id] = false;
     }
+};
 }
 
-std::list<Stat*> Stat::CollectStatistics(const Node& node)
+std::list<Stat> Stat::CollectStatistics(const NodeView& view)
 {
-    std::list<Stat*> stats;
-    
-    collect_statistics(stats, node);
-
-    for(auto stat: stats) {
-        stat->_paths.unique();
-        stat->_paths.sort( [](const std::string& a, const std::string& b) {
-            return a < b;
-        });
-    }
+    collector_t collector(view);
+    collector.collect(view.root(), 0);
+    std::list<Stat> stats;
+    stats.splice(stats.end(), collector.stats);
 
-    stats.sort( [](const Stat* a, const Stat* b) {
-        int64_t a_incl = a->realtime_used();
-        int64_t b_incl = b->realtime_used();
-        int64_t a_self = a_incl - a->children_realtime_used();
-        int64_t b_self = b_incl - b->children_realtime_used();
+    stats.sort( [](const Stat& a, const Stat& b) {
+        int64_t a_incl = a.realtime_used();
+        int64_t b_incl = b.realtime_used();
+        int64_t a_self = a_incl - a.children_realtime_used();
+        int64_t b_self = b_incl - b.children_realtime_used();
         return  a_self != b_self ? a_self > b_self : a_incl < b_incl; 
     });
     // if there is a 'root' node we place it at the end of list
-    auto it = std::find_if(stats.begin(), stats.end(), [](const Stat* stat) { 
-        return stat->stack_level_min() == -1;
+    auto it = std::find_if(stats.begin(), stats.end(), [](const Stat& stat) { 
+        return stat.stack_level_min() == -1;
     });
     if(it != stats.end()) {
-        Stat *root = *it;
-        stats.erase(it);
-        stats.push_back(root);
+        stats.splice(stats.end(), stats, it);
     }
     
     return stats;
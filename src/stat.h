@@ -7,17 +7,33 @@
 
 #include <stdint.h>
 #include <list>
+#include <vector>
 #include <string>
+#include <memory>
 
 namespace fpsprof {
 
 class Node;
+class NodeView;
 
 class Stat {
 public:
-    static std::list<Stat*> CollectStatistics(const Node& node);
+    static std::list<Stat> CollectStatistics(const NodeView& view);
 
-    Stat(const Node& node, const std::string& path);
+    // call paths of all nodes, shared by the statistics of a tree
+    struct path_table_t {
+        struct path_t {
+            unsigned parent; // 0 is an empty path
+            const char* name;
+        };
+        std::vector<path_t> paths;
+
+        path_table_t() : paths(1, path_t{ 0, NULL }) {}
+        unsigned add(unsigned parent, const char* name) { paths.push_back({ parent, name }); return (unsigned)paths.size() - 1; }
+        std::string str(unsigned id) const;
+    };
+
+    Stat(const NodeView& view, const Node& node, const std::shared_ptr<const path_table_t>& path_table, unsigned path);
 
 #if _MSC_VER // Microsofts STL library can't move list< Stat > using only rvalue reference, i.e. there is no 'operator= (std::list<T&&> &&)' available
     Stat(const Stat&) = default;
@@ -40,9 +56,9 @@ public:
     uint64_t children_realtime_used() const { return _children_realtime_used; }
     bool child_free() const { return _child_free; }
 
-    const std::list<std::string>& paths() const { return _paths; }
+    std::list<std::string> paths() const; // sorted
 
-    void add_node(const Node& node, const std::string& path);
+    void add_node(const NodeView& view, const Node& node, unsigned path);
 
 private:
     const char* _name;
@@ -57,7 +73,8 @@ private:
     uint64_t _children_realtime_used;
     bool _child_free;
 
-    std::list<std::string> _paths;
+    std::shared_ptr<const path_table_t> _path_table;
+    std::vector<unsigned> _paths;
 };
 
 }
@@ -1,12 +1,25 @@
 #include "thread.h"
 #include "node.h"
+#include "varint.h"
+#include "blockcomp.h"
+#include "parallel.h"
+#include "workpool.h"
+#include "mapped_file.h"
 
 #include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
 
 #include <ostream>
 #include <iomanip>
-#include <fstream>
 #include <stdexcept>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <limits>
 
 namespace fpsprof {
 
@@ -16,6 +29,8 @@ namespace fpsprof {
 #define THREAD_PREFIX "T:"
 #define EVENT_PREFIX "E:"
 
+#define BINARY_HEADER FMT_PREFIX " 2\n"
+
 extern void GetPenalty(unsigned& penalty_denom, uint64_t& penalty_self_nsec, uint64_t& penalty_children_nsec);
 
 typedef std::map<int, std::list<Event> > map;
@@ -25,32 +40,132 @@ void ThreadMap::AddRawThread(std::list<ProfPoint>&& marks)
     if(_penalty_denom == 0) {
         GetPenalty(_penalty_denom, _penalty_self_nsec, _penalty_children_nsec);
     }
+    if(marks.empty()) {
+        return;
+    }
 
-    std::list<Event> events;
+    event_columns_t events;
+    events.site.reserve(marks.size());
+    events.start_nsec.reserve(marks.size());
+    events.duration_nsec.reserve(marks.size());
+    events.cpu_used.reserve(marks.size());
     while (!marks.empty()) {
         const auto& pp = marks.front();
         assert(pp.complete());
-        events.push_back((Event)pp);
+        uint32_t id = site_id({ pp.name(), pp.stack_level(), pp.frame_flag(), pp.measure_process_time() });
+        events.site.push_back(id);
+        events.start_nsec.push_back(pp.realtime_start());
+        events.duration_nsec.push_back(pp.realtime_stop() - pp.realtime_start());
+        events.cpu_used.push_back(pp.cputime_delta());
         marks.pop_front();
     }
-    if(events.empty()) {
-        return;
+
+    int thread_id = (int)_threadEvents.size();
+    _threadEvents[thread_id] = std::move(events);
+}
+
+// a name has only a few sites, they are compared one by one
+uint32_t ThreadMap::site_id(const event_site_t& site)
+{
+    auto& ids = _site_ids[site.name];
+    for (auto id : ids) {
+        const auto& other = _sites[id];
+        if (other.stack_level == site.stack_level && other.frame_flag == site.frame_flag
+                && other.measure_process_time == site.measure_process_time) {
+            return id;
+        }
+    }
+    ids.push_back((uint32_t)_sites.size());
+    _sites.push_back(site);
+    return ids.back();
+}
+
+Event ThreadMap::make_event(const event_columns_t& events, size_t i) const
+{
+    const auto& site = _sites[events.site[i]];
+    Event event;
+    event._name = site.name;
+    event._stack_level = site.stack_level;
+    event._frame_flag = site.frame_flag;
+    event._measure_process_time = site.measure_process_time;
+    event._start_nsec = events.start_nsec[i];
+    event._stop_nsec = events.start_nsec[i] + events.duration_nsec[i];
+    event._cpu_used = events.cpu_used[i];
+    return event;
+}
+
+// In-place tokenizer over the mapped log, no line length limit
+struct text_tokenizer_t {
+    text_tokenizer_t(const char* begin, const char* end) : _p(begin), _end(end) {}
+
+    bool next(const char*& s, size_t& len) {
+        while (_p < _end && is_space(*_p)) {
+            _p++;
+        }
+        if (_p == _end) {
+            return false;
+        }
+        s = _p;
+        while (_p < _end && !is_space(*_p)) {
+            _p++;
+        }
+        len = _p - s;
+        return true;
     }
 
-    int thread_id = (int)_threadEventsMap.size();
-    _threadEventsMap[thread_id] = std::move(events);
+private:
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    const char* _p;
+    const char* _end;
+};
+
+template<class T>
+static bool parse_int(const char* s, size_t len, T& val)
+{
+    const char* end = s + len;
+    bool neg = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) {
+        s++;
+    }
+    if (s == end) {
+        return false;
+    }
+    if (end - s > 19) { // no uint64_t overflow below
+        return false;
+    }
+    uint64_t v = 0;
+    for (; s < end; s++) {
+        unsigned d = (unsigned)(*s - '0');
+        if (d > 9) {
+            return false;
+        }
+        v = 10 * v + d;
+    }
+    if (neg) {
+        if (v > (uint64_t)std::numeric_limits<T>::max() + (std::numeric_limits<T>::is_signed ? 1 : 0)) {
+            return false;
+        }
+        val = (T)(0 - v);
+    } else {
+        if (v > (uint64_t)std::numeric_limits<T>::max()) {
+            return false;
+        }
+        val = (T)v;
+    }
+    return true;
 }
 
-#define READ_NEXT_TOKEN(s, err_action) s = strtok(NULL, " "); if (!s) { err_action; };
-#define READ_NUMERIC(s, val, err_action, strtoNum) \
-    READ_NEXT_TOKEN(s, err_action) \
-    { char* end; val = strtoNum(s, &end, 10); if (*end != '\0') { err_action; } }
-#define READ_LONG(s, val, err_action) READ_NUMERIC(s, val, err_action, strtol)
-#define READ_LONGLONG(s, val, err_action) READ_NUMERIC(s, val, err_action, strtoll)
+#define READ_NEXT_TOKEN(tok, s, len, err_action) if (!tok.next(s, len)) { err_action; };
+#define READ_NUMERIC(tok, val, err_action) \
+    { const char* s_; size_t len_; READ_NEXT_TOKEN(tok, s_, len_, err_action) if (!parse_int(s_, len_, val)) { err_action; } }
+#define READ_LONG(tok, val, err_action) READ_NUMERIC(tok, val, err_action)
+#define READ_LONGLONG(tok, val, err_action) READ_NUMERIC(tok, val, err_action)
 
 static const char* hash_event_name(const std::string& name_str)
 {
     static std::map<std::string, const char*> cache;
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
     auto it = cache.find(name_str);
     const char* name;
     if (it != cache.end()) {
@@ -67,126 +182,224 @@ static const char* hash_event_name(const std::string& name_str)
     return name;
 }
 
-bool ThreadMap::Deserialize(std::ifstream& ifs)
+static bool starts_with_binary_header(const uint8_t* data, size_t size)
 {
-    assert(_penalty_denom == 0);
+    return size >= strlen(BINARY_HEADER) && 0 == memcmp(data, BINARY_HEADER, strlen(BINARY_HEADER));
+}
+
+ThreadMap::~ThreadMap()
+{
+    for (auto& thread : _threads) {
+        delete thread.second;
+    }
+}
+
+bool ThreadMap::finalize()
+{
+    assert(_penalty_denom);
+
+    int mainThreadId = -1;
+    for (auto& thread : _threads) {
+        int thread_id = thread.first;
+        const auto node = thread.second;
+        if (node->frame_flag()) {
+            mainThreadId = thread_id;
+            break;
+        }
+    }
+    if (mainThreadId == -1) {
+        throw std::runtime_error("no main thread found");
+    }
+    if (mainThreadId != 0) { // set to mt_id = 0
+        std::swap(_threads[0], _threads[mainThreadId]);
+        if (!_threads[mainThreadId]) {
+            _threads.erase(mainThreadId);
+        }
+    }
+    return true;
+}
+
+struct ThreadMap::log_format_t {
+    struct site_t { const char* name; int stack_level; bool frame_flag; };
 
     unsigned fmt = 0;
+    unsigned penalty_denom = 0;
+    uint64_t penalty_self_nsec = 0;
+    uint64_t penalty_children_nsec = 0;
     bool time_resolution_nsec = false;
     bool measure_process_time = false;
-    int thread_id = 0;
-    int64_t thread_time = 0;
-    std::map<unsigned, std::string> ids;
+    std::vector<const char*> names; // fmt 1: name ids
+    std::vector<site_t> sites;      // fmt 2
+};
 
-    auto onFrameRead = [this] (int thread_id) {
-        auto thread = _threads.find(thread_id);
-        if(thread == _threads.end()) {
-            _threads[thread_id] = new Node();
-        }
-        Node *root = _threads[thread_id];
-        root->AddThreadEvents(std::move(_threadEventsMap[thread_id]));
-    };
+struct ThreadMap::log_t {
+    log_format_t format;
+    bool binary = false;
+    const char* begin = NULL;
+    const char* end = NULL;
+    std::string raw; // decompressed content
+    std::vector<chunk_t> chunks;
+    std::map<int, std::vector<frame_ref_t> > frame_index; // fmt 2, referred by the chunks
+};
+
+static unsigned line_number(const char* begin, const char* pos)
+{
+    return 1 + (unsigned)std::count(begin, pos, '\n');
+}
 
-    char line[2048];
-    unsigned count = 0;
-    while (!ifs.getline(line, sizeof(line)).eof()) {
-        if (ifs.fail()) {
+bool ThreadMap::read_log(const uint8_t* data, size_t size, log_t& log)
+{
+    if (blockcomp_detect(data, size)) {
+        if (!blockcomp_decompress(data, size, log.raw)) {
+            fprintf(stderr, "failed to decompress the log\n");
             return false;
         }
-        count++;
+        data = (const uint8_t*)log.raw.data();
+        size = log.raw.size();
+    }
+    log.begin = (const char*)data;
+    log.end = log.begin + size;
+    log.binary = starts_with_binary_header(data, size);
+    return log.binary ? read_binary_log(log) : read_text_log(log);
+}
 
-        char* s = strtok(line, " ");
-        if (!s) {
+void ThreadMap::print_parse_error(const log_t& log, const char* pos)
+{
+    if (log.binary) {
+        fprintf(stderr, "parse fail at offset %zu\n", (size_t)(pos - log.begin));
+    } else {
+        fprintf(stderr, "parse fail at line %u\n", line_number(log.begin, pos));
+    }
+}
+
+bool ThreadMap::Deserialize(const uint8_t* data, size_t size, const frame_range_t& range)
+{
+    assert(_penalty_denom == 0);
+
+    log_t log;
+    frame_window_t window;
+    if (!read_log(data, size, log) || !resolve_frame_window(log, range, window)) {
+        return false;
+    }
+    _penalty_denom = log.format.penalty_denom;
+    _penalty_self_nsec = log.format.penalty_self_nsec;
+    _penalty_children_nsec = log.format.penalty_children_nsec;
+
+    const char* error_pos = parse_chunks(log.chunks, log.format, log.binary, window);
+    if (error_pos) {
+        print_parse_error(log, error_pos);
+        return false;
+    }
+    if (window.enabled()) { // the threads idle within the range
+        for (auto it = _threads.begin(); it != _threads.end(); ) {
+            if (it->second->children().empty()) {
+                delete it->second;
+                it = _threads.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return finalize();
+}
+
+bool ThreadMap::read_text_log(log_t& log)
+{
+    const char* begin = log.begin;
+    const char* end = log.end;
+    log_format_t& format = log.format;
+    std::vector<chunk_t>& chunks = log.chunks;
+
+    // header: everything before the first thread or event record
+    const char* line = begin;
+    while (line < end) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+        text_tokenizer_t tok(line, eol);
+
+        const char* s;
+        size_t len;
+        if (!tok.next(s, len)) {
+            line = eol + 1;
             continue;
         }
-        
-        if (0 == strncmp(s, FMT_PREFIX, strlen(FMT_PREFIX))) {
-            READ_LONG(s, fmt, goto error_exit)
-            if(fmt != 0 && fmt != 1) {
+#define PREFIX_IS(prefix) (len == strlen(prefix) && 0 == memcmp(s, prefix, len))
+        if (PREFIX_IS(THREAD_PREFIX) || PREFIX_IS(EVENT_PREFIX)) {
+            break;
+        }
+        if (PREFIX_IS(FMT_PREFIX)) {
+            READ_LONG(tok, format.fmt, goto error_exit)
+            if(format.fmt != 0 && format.fmt != 1) {
                 goto error_exit;
             }
-        } else if (0 == strncmp(s, PROP_PREFIX, strlen(PROP_PREFIX))) {
-            READ_LONG(s, _penalty_denom, goto error_exit)
-            READ_LONGLONG(s, _penalty_self_nsec, goto error_exit)
-            READ_LONGLONG(s, _penalty_children_nsec, goto error_exit)
-            READ_LONG(s, time_resolution_nsec, goto error_exit)
-            READ_LONG(s, measure_process_time, goto error_exit)    
-        } else if (0 == strncmp(s, NAME_PREFIX, strlen(NAME_PREFIX))) {
-            assert(fmt == 1);
+        } else if (PREFIX_IS(PROP_PREFIX)) {
+            READ_LONG(tok, format.penalty_denom, goto error_exit)
+            READ_LONGLONG(tok, format.penalty_self_nsec, goto error_exit)
+            READ_LONGLONG(tok, format.penalty_children_nsec, goto error_exit)
+            READ_LONG(tok, format.time_resolution_nsec, goto error_exit)
+            READ_LONG(tok, format.measure_process_time, goto error_exit)
+        } else if (PREFIX_IS(NAME_PREFIX)) {
+            assert(format.fmt == 1);
 
             unsigned id;
-            READ_LONG(s, id, goto error_exit)
-            READ_NEXT_TOKEN(s, goto error_exit);
-            ids[id] = s;
-        } else if (0 == strncmp(s, THREAD_PREFIX, strlen(THREAD_PREFIX))) {
-            READ_LONG(s, thread_id, goto error_exit)
-            READ_LONGLONG(s, thread_time, goto error_exit)
-        } else if (0 == strncmp(s, EVENT_PREFIX, strlen(EVENT_PREFIX))) {
-            Event event;
-            READ_LONG(s, event._frame_flag, goto error_exit)
-            READ_LONG(s, event._stack_level, goto error_exit)
-            if( fmt == 0) {
-                std::string name_str;
-                READ_NEXT_TOKEN(s, goto error_exit) name_str = s;
-                event._name = hash_event_name(name_str);
-            } else if (fmt == 1) {
-                unsigned id;
-                READ_LONG(s, id, goto error_exit)
-                auto it = ids.find(id);
-                if(it == ids.end()) {
-                    goto error_exit;
-                }
-                event._name = hash_event_name(it->second);
+            READ_LONG(tok, id, goto error_exit)
+            READ_NEXT_TOKEN(tok, s, len, goto error_exit);
+            if (id >= (size_t)(end - begin)) { // the ids are dense, a name takes a line
+                goto error_exit;
             }
-            int64_t delta_time;
-            uint64_t duration_time;
-            READ_LONGLONG(s, delta_time, goto error_exit)   
-            READ_LONGLONG(s, duration_time, goto error_exit)
-            int64_t start_time = thread_time + delta_time;
-            int64_t stop_time = start_time + duration_time;
-
-            event._start_nsec = start_time*(time_resolution_nsec ? 100 : 1);
-            event._stop_nsec = stop_time*(time_resolution_nsec ? 100 : 1);
-            event._measure_process_time = measure_process_time;
-            event._cpu_used = 0; //READ_LONGLONG(s, event._cpu_used, goto error_exit)
-
-            if(event.stack_level() == 0) {
-                onFrameRead(thread_id);
+            if (id >= format.names.size()) {
+                format.names.resize(id + 1, NULL);
             }
-
-            _threadEventsMap[thread_id].push_back(event);
-
-            thread_time += start_time;
+            format.names[id] = hash_event_name(std::string(s, len));
         } else {
             goto error_exit;
         }
+#undef PREFIX_IS
+        line = eol + 1;
     }
 
-    onFrameRead(thread_id);
-
-    assert(_penalty_denom);
-
+    // split at 'T:' records, events before the first one belong to thread 0
     {
-        int mainThreadId = -1;
-        for (auto& thread : _threads) {
-            int thread_id = thread.first;
-            const auto node = thread.second;
-            if (node->frame_flag()) {
-                mainThreadId = thread_id;
+        chunk_t chunk = { 0, 0, 0, NULL, line, line };
+        const char* p = line;
+        while (p < end) {
+            const char* t = (const char*)memchr(p, THREAD_PREFIX[0], end - p);
+            if (!t) {
                 break;
             }
+            p = t + 1;
+            if ((t != begin && t[-1] != '\n') || p == end || *p != THREAD_PREFIX[1]) {
+                continue;
+            }
+            chunk.end = t;
+            if (chunk.begin != chunk.end) {
+                chunks.push_back(chunk);
+            }
+            const char* eol = (const char*)memchr(t, '\n', end - t);
+            if (!eol) {
+                eol = end;
+            }
+            text_tokenizer_t tok(t, eol);
+            const char* s;
+            size_t len;
+            line = t;
+            READ_NEXT_TOKEN(tok, s, len, goto error_exit)
+            READ_LONG(tok, chunk.thread_id, goto error_exit)
+            READ_LONGLONG(tok, chunk.thread_time, goto error_exit)
+            chunk.begin = eol < end ? eol + 1 : end;
+            p = chunk.begin;
         }
-        if (mainThreadId == -1) {
-            throw std::runtime_error("no main thread found");
-        }
-        if (mainThreadId != 0) { // set to mt_id = 0
-            std::swap(_threads[0], _threads[mainThreadId]);
+        chunk.end = end;
+        if (chunk.begin != chunk.end) {
+            chunks.push_back(chunk);
         }
     }
     return true;
 
 error_exit:
-    fprintf(stderr, "parse fail at line %d\n", count);
+    print_parse_error(log, line);
 
     return false;
 }
@@ -197,21 +410,29 @@ error_exit:
 #define TIME_RESOLUTION_NSEC 0 // Linux, 100nsec resolution
 #endif
 
-void ThreadMap::Serialize(std::ostream& os) const
+void ThreadMap::Serialize(std::ostream& os, unsigned fmt) const
 {
     assert(_penalty_denom);
 
-    unsigned fmt = 1;
+    if (fmt == 2) {
+        serialize_binary(os);
+    } else {
+        serialize_text(os, fmt);
+    }
+}
+
+void ThreadMap::serialize_text(std::ostream& os, unsigned fmt) const
+{
     bool measure_process_time = false;
 
     os  << FMT_PREFIX << " "
         << fmt
         << std::endl;
 
-    for (const auto& threadEvents : _threadEventsMap) {
+    for (const auto& threadEvents : _threadEvents) {
         const auto& events = threadEvents.second;
-        for (const auto& event : events) {
-            measure_process_time = event.measure_process_time();
+        if (events.size()) {
+            measure_process_time = _sites[events.site.back()].measure_process_time;
         }
     }
     os  << PROP_PREFIX << " "
@@ -224,42 +445,47 @@ void ThreadMap::Serialize(std::ostream& os) const
 
     std::map<const char*, unsigned> ids;
     if(fmt == 1) {
-        for (const auto& threadEvents : _threadEventsMap) {
-            const auto& events = threadEvents.second;
-            for (const auto& event : events) {
-                if(ids.find(event.name()) == ids.end()) {
+        std::vector<bool> site_seen(_sites.size(), false);
+        for (const auto& threadEvents : _threadEvents) {
+            for (auto site : threadEvents.second.site) {
+                if (site_seen[site]) {
+                    continue;
+                }
+                site_seen[site] = true;
+                const char* name = _sites[site].name;
+                if(ids.find(name) == ids.end()) {
                     unsigned id = (unsigned)ids.size();
-                    ids[ event.name() ] = id;
+                    ids[ name ] = id;
                     os  << NAME_PREFIX << " "
                         << std::setw(3) << id << " "
-                        << event.name()
+                        << name
                         << std::endl;
                 }
             }
         }
     }
 
-    for (const auto& threadEvents : _threadEventsMap) {
+    for (const auto& threadEvents : _threadEvents) {
         int thread_id = threadEvents.first;
         const auto& events = threadEvents.second;
-        if(events.empty()) {
+        if(events.size() == 0) {
             continue;
         }
-        const auto& firstEvent = events.front();
-        int64_t thread_time = firstEvent.start_nsec() / ( TIME_RESOLUTION_NSEC ? 100 : 1 );
+        int64_t thread_time = events.start_nsec.front() / ( TIME_RESOLUTION_NSEC ? 100 : 1 );
         os  << THREAD_PREFIX << " "
             << std::setw(3) << thread_id << " "
             << thread_time << " "
             << std::endl;
 
-        for (const auto& event : events) {
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event event = make_event(events, i);
             char buf[1024];
             int64_t start_time = event.start_nsec() / ( TIME_RESOLUTION_NSEC ? 100 : 1 );
             int64_t stop_time = event.stop_nsec() / ( TIME_RESOLUTION_NSEC ? 100 : 1 );
             int64_t delta_time = start_time - thread_time;
             uint64_t duration_time = stop_time - start_time;
             if(fmt == 0) {
-                sprintf(buf, EVENT_PREFIX " %d %u %s %" PRIu64" %" PRIu64"\n"//" %" PRIu64"\n"
+                sprintf(buf, EVENT_PREFIX " %d %u %s %" PRId64" %" PRIu64"\n"//" %" PRIu64"\n"
                     , event.frame_flag()
                     , event.stack_level()
                     , event.name()
@@ -268,7 +494,7 @@ void ThreadMap::Serialize(std::ostream& os) const
                     //, event.cpu_used()
                     );
             } else if (fmt == 1) {
-                sprintf(buf, EVENT_PREFIX " %d %u %u %" PRIu64" %" PRIu64"\n" //" %" PRIu64"\n"
+                sprintf(buf, EVENT_PREFIX " %d %u %u %" PRId64" %" PRIu64"\n" //" %" PRIu64"\n"
                     , event.frame_flag()
                     , event.stack_level()
                     , ids[ event.name() ]
@@ -284,18 +510,974 @@ void ThreadMap::Serialize(std::ostream& os) const
     }
 }
 
+/*
+    fmt 2 layout (all integers are LEB128 varints unless noted):
+
+    "F: 2\n"
+    props:   penalty_denom penalty_self_nsec penalty_children_nsec time_resolution measure_process_time
+    names:   count { len bytes }
+    sites:   count { name_id (stack_level << 1 | frame_flag) }
+    threads: count { thread_id thread_time num_events payload_size payload }
+             payload: num_events x { site_id zigzag(start - base) duration }
+             base: parent start for the first child, previous sibling stop otherwise
+    index:   count { thread_id num_frames { event_idx_delta payload_offset_delta start_delta } }
+    footer:  u64le(index offset) "FIDX"
+*/
+#define INDEX_MAGIC "FIDX"
+
+// Events are stored in the call order, so the start time is well predicted
+// by the parent start (first child) or by the previous sibling stop
+struct time_predictor_t {
+    explicit time_predictor_t(int64_t thread_time) : _prev_start(thread_time) {}
+
+    int64_t base(int stack_level) const {
+        if (stack_level > _prev_stack_level || (size_t)stack_level >= _last_stop.size()) {
+            return _prev_start;
+        }
+        return _last_stop[stack_level];
+    }
+    void update(int stack_level, int64_t start_time, int64_t stop_time) {
+        if ((size_t)stack_level >= _last_stop.size()) {
+            _last_stop.resize(stack_level + 1, start_time);
+        }
+        _last_stop[stack_level] = stop_time;
+        _prev_start = start_time;
+        _prev_stack_level = stack_level;
+    }
+
+private:
+    int64_t _prev_start;
+    int _prev_stack_level = -1;
+    std::vector<int64_t> _last_stop;
+};
+
+struct site_key_t {
+    const char* name;
+    int stack_level;
+    bool frame_flag;
+
+    bool operator== (const site_key_t& other) const {
+        return name == other.name && stack_level == other.stack_level && frame_flag == other.frame_flag;
+    }
+    struct hash {
+        size_t operator() (const site_key_t& key) const {
+            return std::hash<const void*>()(key.name) ^ ((size_t)key.stack_level << 1) ^ key.frame_flag;
+        }
+    };
+};
 
-void ThreadMap::set_penalty(double self_nsec, double childer_nsec)
+void ThreadMap::serialize_binary(std::ostream& os) const
 {
-    if(_penalty_denom == 0) {
-        throw std::runtime_error("penalty resolution not set");
+    bool measure_process_time = false;
+    std::unordered_map<const char*, unsigned> name_ids;
+    std::unordered_map<site_key_t, unsigned, site_key_t::hash> site_ids;
+    std::vector<const char*> names;
+    std::vector<site_key_t> sites;
+    std::vector<uint64_t> site_count;
+    // the stored sites also differ by the counter type, the log sites do not
+    std::vector<unsigned> log_site(_sites.size(), ~0u);
+    for (const auto& threadEvents : _threadEvents) {
+        const auto& events = threadEvents.second;
+        for (size_t i = 0; i < events.size(); i++) {
+            unsigned& id = log_site[events.site[i]];
+            if (id == ~0u) {
+                const auto& event_site = _sites[events.site[i]];
+                site_key_t key = { event_site.name, event_site.stack_level, event_site.frame_flag };
+                auto site = site_ids.emplace(key, (unsigned)sites.size());
+                if (site.second) {
+                    sites.push_back(key);
+                    site_count.push_back(0);
+                    if (name_ids.emplace(key.name, (unsigned)names.size()).second) {
+                        names.push_back(key.name);
+                    }
+                }
+                id = site.first->second;
+            }
+            site_count[id]++;
+        }
+        if (events.size()) {
+            measure_process_time = _sites[events.site.back()].measure_process_time;
+        }
+    }
+    // most frequent sites get the shortest codes
+    std::vector<unsigned> order(sites.size()), site_code(sites.size());
+    for (unsigned i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&site_count](unsigned a, unsigned b) {
+        return site_count[a] > site_count[b];
+    });
+    for (unsigned i = 0; i < order.size(); i++) {
+        site_code[order[i]] = i;
+    }
+
+    varint_writer_t wr;
+    wr.put_bytes(BINARY_HEADER, strlen(BINARY_HEADER));
+    wr.put_varint(_penalty_denom);
+    wr.put_varint(_penalty_self_nsec);
+    wr.put_varint(_penalty_children_nsec);
+    wr.put_varint(TIME_RESOLUTION_NSEC);
+    wr.put_varint(measure_process_time);
+    wr.put_varint(names.size());
+    for (auto name : names) {
+        size_t len = strlen(name);
+        wr.put_varint(len);
+        wr.put_bytes(name, len);
+    }
+    wr.put_varint(sites.size());
+    for (auto idx : order) {
+        const auto& site = sites[idx];
+        wr.put_varint(name_ids[site.name]);
+        wr.put_varint(((uint64_t)site.stack_level << 1) | (site.frame_flag ? 1 : 0));
+    }
+
+    unsigned num_threads = 0;
+    for (const auto& threadEvents : _threadEvents) {
+        num_threads += threadEvents.second.size() ? 1 : 0;
+    }
+    wr.put_varint(num_threads);
+
+    struct frame_idx_t { uint64_t event_idx, payload_offset; int64_t start_time; };
+    std::map<int, std::vector<frame_idx_t> > index;
+
+    uint64_t offset = 0;
+    varint_writer_t payload;
+    for (const auto& threadEvents : _threadEvents) {
+        int thread_id = threadEvents.first;
+        const auto& events = threadEvents.second;
+        if(events.size() == 0) {
+            continue;
+        }
+        auto& frames = index[thread_id];
+        int64_t thread_time = events.start_nsec.front() / ( TIME_RESOLUTION_NSEC ? 100 : 1 );
+        time_predictor_t predictor(thread_time);
+        payload.clear();
+        for (size_t i = 0; i < events.size(); i++) {
+            int stack_level = _sites[events.site[i]].stack_level;
+            int64_t start_time = events.start_nsec[i] / ( TIME_RESOLUTION_NSEC ? 100 : 1 );
+            int64_t stop_time = (events.start_nsec[i] + events.duration_nsec[i]) / ( TIME_RESOLUTION_NSEC ? 100 : 1 );
+            if (stack_level == 0) {
+                frames.push_back({ i, payload.size(), start_time });
+            }
+            payload.put_varint(site_code[log_site[events.site[i]]]);
+            payload.put_zigzag(start_time - predictor.base(stack_level));
+            payload.put_varint(stop_time - start_time);
+            predictor.update(stack_level, start_time, stop_time);
+        }
+        wr.put_varint((unsigned)thread_id);
+        wr.put_varint(thread_time);
+        wr.put_varint(events.size());
+        wr.put_varint(payload.size());
+        os.write(wr.data(), wr.size());
+        os.write(payload.data(), payload.size());
+        offset += wr.size() + payload.size();
+        wr.clear();
+    }
+
+    wr.put_varint(index.size());
+    for (const auto& thread : index) {
+        wr.put_varint((unsigned)thread.first);
+        wr.put_varint(thread.second.size());
+        frame_idx_t prev = { 0, 0, 0 };
+        for (const auto& frame : thread.second) {
+            wr.put_varint(frame.event_idx - prev.event_idx);
+            wr.put_varint(frame.payload_offset - prev.payload_offset);
+            wr.put_zigzag(frame.start_time - prev.start_time);
+            prev = frame;
+        }
+    }
+    wr.put_u64le(offset);
+    wr.put_bytes(INDEX_MAGIC, strlen(INDEX_MAGIC));
+    os.write(wr.data(), wr.size());
+}
+
+// The index is optional: a missing or inconsistent one only disables the frame split
+void ThreadMap::read_frame_index(const uint8_t* begin, const uint8_t* end, std::vector<chunk_t>& chunks,
+    std::map<int, std::vector<frame_ref_t> >& index)
+{
+    size_t trailer_size = 8 + strlen(INDEX_MAGIC);
+    if ((size_t)(end - begin) < trailer_size || 0 != memcmp(end - strlen(INDEX_MAGIC), INDEX_MAGIC, strlen(INDEX_MAGIC))) {
+        return;
+    }
+    varint_reader_t rd(begin, end - strlen(INDEX_MAGIC));
+    rd.seek(rd.size() - 8);
+    rd.seek((size_t)rd.get_u64le());
+
+    for (uint64_t num_threads = rd.get_varint(); num_threads-- && !rd.fail(); ) {
+        auto& frames = index[(int)rd.get_varint()];
+        frames.resize((size_t)std::min<uint64_t>(rd.get_varint(), rd.size()));
+        frame_ref_t prev = { 0, 0, 0 };
+        for (auto& frame : frames) {
+            frame.event_idx = prev.event_idx + rd.get_varint();
+            frame.payload_offset = prev.payload_offset + rd.get_varint();
+            frame.start_time = prev.start_time + rd.get_zigzag();
+            prev = frame;
+        }
+    }
+    if (rd.fail()) {
+        index.clear();
+        return;
+    }
+    std::map<int, unsigned> num_chunks;
+    for (const auto& chunk : chunks) {
+        num_chunks[chunk.thread_id]++;
+    }
+    for (auto& chunk : chunks) {
+        auto it = index.find(chunk.thread_id);
+        if (it == index.end() || num_chunks[chunk.thread_id] != 1) {
+            continue;
+        }
+        bool valid = true;
+        for (const auto& frame : it->second) {
+            valid &= frame.event_idx < chunk.num_events && frame.payload_offset < (uint64_t)(chunk.end - chunk.begin);
+        }
+        if (valid) {
+            chunk.frames = &it->second;
+        }
+    }
+}
+
+bool ThreadMap::read_binary_log(log_t& log)
+{
+    const uint8_t* begin = (const uint8_t*)log.begin;
+    const uint8_t* end = (const uint8_t*)log.end;
+    varint_reader_t rd(begin, end);
+    rd.get_bytes(strlen(BINARY_HEADER));
+
+    log_format_t& format = log.format;
+    std::vector<chunk_t>& chunks = log.chunks;
+    format.fmt = 2;
+    format.penalty_denom = (unsigned)rd.get_varint();
+    format.penalty_self_nsec = rd.get_varint();
+    format.penalty_children_nsec = rd.get_varint();
+    format.time_resolution_nsec = rd.get_varint() != 0;
+    format.measure_process_time = rd.get_varint() != 0;
+
+
+    // the counts are bound by the bytes left: a name takes one byte at least, a site two
+    uint64_t num_names, num_sites;
+    num_names = rd.get_varint();
+    if (rd.fail() || num_names > rd.size() - rd.pos()) {
+        goto error_exit;
+    }
+    format.names.resize((size_t)num_names);
+    for (auto& name : format.names) {
+        size_t len = (size_t)rd.get_varint();
+        const char* s = (const char*)rd.get_bytes(len);
+        if (!s) {
+            goto error_exit;
+        }
+        name = hash_event_name(std::string(s, len));
+    }
+
+    num_sites = rd.get_varint();
+    if (rd.fail() || num_sites > (rd.size() - rd.pos()) / 2) {
+        goto error_exit;
+    }
+    format.sites.resize((size_t)num_sites);
+    for (auto& site : format.sites) {
+        uint64_t name_id = rd.get_varint();
+        uint64_t level_flag = rd.get_varint();
+        // a site of level n has the sites of the levels below, the level sizes the time predictor
+        if (name_id >= format.names.size() || (level_flag >> 1) >= num_sites) {
+            goto error_exit;
+        }
+        site = { format.names[name_id], (int)(level_flag >> 1), (level_flag & 1) != 0 };
+    }
+
+    // thread blocks are sized, so they are located without decoding
+    for (unsigned num_threads = (unsigned)rd.get_varint(); num_threads-- && !rd.fail(); ) {
+        chunk_t chunk;
+        chunk.frames = NULL;
+        chunk.thread_id = (int)rd.get_varint();
+        chunk.thread_time = (int64_t)rd.get_varint();
+        chunk.num_events = rd.get_varint();
+        size_t payload_size = (size_t)rd.get_varint();
+        chunk.begin = (const char*)rd.get_bytes(payload_size);
+        if (!chunk.begin) {
+            goto error_exit;
+        }
+        chunk.end = chunk.begin + payload_size;
+        chunks.push_back(chunk);
+    }
+    if (rd.fail()) {
+        goto error_exit;
+    }
+    read_frame_index(begin, end, chunks, log.frame_index);
+    return true;
+
+error_exit:
+    print_parse_error(log, log.begin + rd.pos());
+
+    return false;
+}
+
+// A chunk may be entered at a frame index entry or a scanned one, the start time of the first
+// event is the one of the entry then: the coded delta or the text delta is replaced
+struct ThreadMap::event_cursor_t {
+    event_cursor_t(const chunk_t& chunk, const log_format_t& format, bool binary, size_t pos = 0, const frame_ref_t* entry = NULL)
+        : _chunk(chunk), _format(format), _binary(binary)
+        , _rd((const uint8_t*)chunk.begin, (const uint8_t*)chunk.end)
+        , _predictor(chunk.thread_time), _entry(entry)
+        , _num_events(binary ? chunk.num_events - (entry ? entry->event_idx : 0) : 0)
+        , _line(chunk.begin + (binary ? 0 : pos)), _thread_time(chunk.thread_time) {
+        _rd.seek(pos);
+    }
+
+    // false at the end of the chunk or on a parse error, error_pos is set then
+    bool next(Event& event) { return _binary ? next_binary(event) : next_text(event); }
+    // the offset of the next event in the chunk
+    size_t pos() const { return _binary ? _rd.pos() : (size_t)(_line - _chunk.begin); }
+
+    const char* error_pos = NULL;
+
+private:
+    bool next_binary(Event& event) {
+        if (_num_events == 0) {
+            return false;
+        }
+        _num_events--;
+        uint64_t site_id = _rd.get_varint();
+        if (_rd.fail() || site_id >= _format.sites.size()) {
+            error_pos = _chunk.begin + _rd.pos();
+            return false;
+        }
+        const auto& site = _format.sites[site_id];
+        int64_t start_time = _predictor.base(site.stack_level) + _rd.get_zigzag();
+        if (_entry) {
+            start_time = _entry->start_time;
+            _entry = NULL;
+        }
+        int64_t stop_time = start_time + (int64_t)_rd.get_varint();
+        if (_rd.fail()) {
+            error_pos = _chunk.begin + _rd.pos();
+            return false;
+        }
+        _predictor.update(site.stack_level, start_time, stop_time);
+
+        event._name = site.name;
+        event._stack_level = site.stack_level;
+        event._frame_flag = site.frame_flag;
+        event._start_nsec = start_time*(_format.time_resolution_nsec ? 100 : 1);
+        event._stop_nsec = stop_time*(_format.time_resolution_nsec ? 100 : 1);
+        event._measure_process_time = _format.measure_process_time;
+        event._cpu_used = 0;
+        return true;
+    }
+
+    bool next_text(Event& event) {
+        const char* line = _line;
+        while (line < _chunk.end) {
+            const char* eol = (const char*)memchr(line, '\n', _chunk.end - line);
+            if (!eol) {
+                eol = _chunk.end;
+            }
+            text_tokenizer_t tok(line, eol);
+
+            const char* s;
+            size_t len;
+            if (!tok.next(s, len)) {
+                line = eol + 1;
+                continue;
+            }
+            if (len != strlen(EVENT_PREFIX) || 0 != memcmp(s, EVENT_PREFIX, len)) {
+                goto error_exit;
+            }
+            READ_LONG(tok, event._frame_flag, goto error_exit)
+            READ_LONG(tok, event._stack_level, goto error_exit)
+            if(_format.fmt == 0) {
+                READ_NEXT_TOKEN(tok, s, len, goto error_exit)
+                event._name = hash_event_name(std::string(s, len));
+            } else {
+                unsigned id;
+                READ_LONG(tok, id, goto error_exit)
+                if(id >= _format.names.size() || !_format.names[id]) {
+                    goto error_exit;
+                }
+                event._name = _format.names[id];
+            }
+            int64_t delta_time;
+            uint64_t duration_time;
+            READ_LONGLONG(tok, delta_time, goto error_exit)
+            READ_LONGLONG(tok, duration_time, goto error_exit)
+            int64_t start_time = _thread_time + delta_time;
+            if (_entry) {
+                start_time = _entry->start_time;
+                _entry = NULL;
+            }
+            int64_t stop_time = start_time + duration_time;
+
+            event._start_nsec = start_time*(_format.time_resolution_nsec ? 100 : 1);
+            event._stop_nsec = stop_time*(_format.time_resolution_nsec ? 100 : 1);
+            event._measure_process_time = _format.measure_process_time;
+            event._cpu_used = 0; //READ_LONGLONG(s, event._cpu_used, goto error_exit)
+
+            _thread_time = start_time;
+            _line = eol + 1;
+            return true;
+        }
+        _line = line;
+        return false;
+
+    error_exit:
+        error_pos = line;
+        return false;
+    }
+
+    const chunk_t& _chunk;
+    const log_format_t& _format;
+    bool _binary;
+    // fmt 2
+    varint_reader_t _rd;
+    time_predictor_t _predictor;
+    const frame_ref_t* _entry;
+    uint64_t _num_events;
+    // text
+    const char* _line;
+    int64_t _thread_time;
+};
+
+// the first index entry that starts at 'nsec' or later, the index is in the call order
+size_t ThreadMap::first_frame_entry(const chunk_t& chunk, const log_format_t& format, uint64_t nsec)
+{
+    const auto& index = *chunk.frames;
+    unsigned scale = format.time_resolution_nsec ? 100 : 1;
+    return std::lower_bound(index.begin(), index.end(), nsec, [scale](const frame_ref_t& frame, uint64_t t) {
+        return (uint64_t)(frame.start_time * scale) < t;
+    }) - index.begin();
+}
+
+// The frames are the top-level scopes of the frame thread, the first thread that starts with
+// a frame, same as EventStream. The frame starts are read from the index entries, the site of
+// an entry is the first varint of its event; a thread with no index is decoded.
+bool ThreadMap::resolve_frame_window(const log_t& log, const frame_range_t& range, frame_window_t& window)
+{
+    window = frame_window_t();
+    if (!range.enabled()) {
+        return true;
+    }
+    std::map<int, std::vector<const chunk_t*> > threadChunks;
+    for (const auto& chunk : log.chunks) {
+        threadChunks[chunk.thread_id].push_back(&chunk);
+    }
+    const std::vector<const chunk_t*>* frameChunks = NULL;
+    for (const auto& thread : threadChunks) {
+        Event event;
+        bool found = false;
+        for (const auto chunk : thread.second) {
+            event_cursor_t cursor(*chunk, log.format, log.binary);
+            if (cursor.next(event)) {
+                found = true;
+                break;
+            }
+            if (cursor.error_pos) {
+                print_parse_error(log, cursor.error_pos);
+                return false;
+            }
+        }
+        if (found && event.frame_flag()) {
+            frameChunks = &thread.second;
+            break;
+        }
+    }
+    if (!frameChunks) {
+        fprintf(stderr, "no frame thread found for the frame range\n");
+        return false;
+    }
+
+    std::vector<uint64_t> starts;
+    const chunk_t& head = *frameChunks->front();
+    if (log.binary && frameChunks->size() == 1 && head.frames) {
+        unsigned scale = log.format.time_resolution_nsec ? 100 : 1;
+        for (const auto& frame : *head.frames) {
+            varint_reader_t rd((const uint8_t*)head.begin + frame.payload_offset, (const uint8_t*)head.end);
+            uint64_t site_id = rd.get_varint();
+            if (rd.fail() || site_id >= log.format.sites.size()) {
+                print_parse_error(log, head.begin + frame.payload_offset);
+                return false;
+            }
+            if (log.format.sites[site_id].frame_flag) {
+                starts.push_back((uint64_t)(frame.start_time * scale));
+            }
+        }
+    } else {
+        for (const auto chunk : *frameChunks) {
+            event_cursor_t cursor(*chunk, log.format, log.binary);
+            Event event;
+            while (cursor.next(event)) {
+                if (event.stack_level() <= 0 && event.frame_flag()) {
+                    starts.push_back(event.start_nsec());
+                }
+            }
+            if (cursor.error_pos) {
+                print_parse_error(log, cursor.error_pos);
+                return false;
+            }
+        }
+    }
+    if (range.first >= starts.size()) {
+        fprintf(stderr, "the frame range starts after the last frame, %zu frame(s) in the log\n", starts.size());
+        return false;
+    }
+    window.start_nsec = starts[range.first];
+    window.stop_nsec = range.last < starts.size() ? starts[range.last] : UINT64_MAX;
+    return true;
+}
+
+// Decodes 'num_events' starting at 'pos'
+bool ThreadMap::decode_events(const chunk_t& chunk, const log_format_t& format, bool binary,
+    size_t pos, uint64_t num_events, const frame_ref_t* entry, std::vector<Event>& events, const char*& error_pos)
+{
+    event_cursor_t cursor(chunk, format, binary, pos, entry);
+    events.reserve(events.size() + (size_t)std::min<uint64_t>(num_events, (chunk.end - chunk.begin - pos) / 3)); // 3 bytes per event at least
+    Event event;
+    for (uint64_t n = 0; n < num_events; n++) {
+        if (!cursor.next(event)) {
+            error_pos = cursor.error_pos ? cursor.error_pos : chunk.end;
+            return false;
+        }
+        events.push_back(event);
+    }
+    return true;
+}
+
+#define FRAME_BATCH_EVENTS (64*1024) // smaller batches are not worth a task
+
+// A chunk with no frame index is read once to make the entries of the batches: the first
+// top-level scope in the window, then a top-level scope every FRAME_BATCH_EVENTS events.
+// The events are not kept, the top-level scopes are in the time order so the window ends
+// the scan. 'num_events' is the index of the first event past the window.
+bool ThreadMap::scan_chunk(const chunk_t& chunk, const log_format_t& format, bool binary, const frame_window_t& window,
+    std::vector<frame_ref_t>& entries, uint64_t& num_events, const char*& error_pos)
+{
+    int64_t scale = format.time_resolution_nsec ? 100 : 1;
+    event_cursor_t cursor(chunk, format, binary);
+    Event event;
+    bool keep = false;
+    uint64_t i = 0;
+    for (;; i++) {
+        size_t pos = cursor.pos();
+        if (!cursor.next(event)) {
+            break;
+        }
+        if (i != 0 && event.stack_level() != 0) {
+            continue;
+        }
+        bool in = window.contains(event.start_nsec());
+        if (keep && !in) {
+            break;
+        }
+        if (in && (!keep || i - entries.back().event_idx >= FRAME_BATCH_EVENTS)) {
+            entries.push_back({ i, pos, (int64_t)event.start_nsec() / scale });
+        }
+        keep = in;
+    }
+    if (cursor.error_pos) {
+        error_pos = cursor.error_pos;
+        return false;
+    }
+    num_events = i;
+    return true;
+}
+
+// Frames [first, last) are split in halves until a batch is small enough, the partial
+// trees are built by the pool workers and merged back pairwise in the frame order.
+// bounds[i] is the index of the first event of the frame 'i', bounds[num_frames] = num_events.
+template<class leaf_t>
+static std::unique_ptr<Node> build_frames(WorkStealingPool& pool, const std::vector<uint64_t>& bounds,
+    unsigned first, unsigned last, const leaf_t& leaf)
+{
+    if (last - first <= 1 || bounds[last] - bounds[first] <= FRAME_BATCH_EVENTS) {
+        std::unique_ptr<Node> root(new Node());
+        leaf(first, last, *root);
+        return root;
+    }
+    unsigned mid = first + (last - first) / 2;
+    std::unique_ptr<Node> left, right;
+    pool.invoke([&]() { left = build_frames(pool, bounds, first, mid, leaf); },
+                [&]() { right = build_frames(pool, bounds, mid, last, leaf); });
+    left->AddThreadTree(std::move(*right));
+    return left;
+}
+
+// The batches of whole frames are decoded from their entries by the pool workers, straight
+// into the partial trees. A frame range of an indexed chunk starts at its first entry, a chunk
+// with no index is scanned for the entries first.
+std::unique_ptr<Node> ThreadMap::build_chunk_tree(WorkStealingPool& pool, const chunk_t& chunk, const log_format_t& format,
+    bool binary, const frame_window_t& window, const char*& error_pos)
+{
+    std::vector<frame_ref_t> scanned;
+    const frame_ref_t* entries = NULL;
+    size_t num_entries = 0;
+    uint64_t num_events = 0; // the end of the last batch
+    const auto* index = chunk.frames;
+    if (binary && index && !index->empty() && index->front().event_idx == 0) {
+        size_t begin = 0, end = index->size();
+        if (window.enabled()) {
+            begin = first_frame_entry(chunk, format, window.start_nsec);
+            end = window.stop_nsec == UINT64_MAX ? end : first_frame_entry(chunk, format, window.stop_nsec);
+        }
+        entries = index->data() + begin;
+        num_entries = begin < end ? end - begin : 0;
+        num_events = end < index->size() ? (*index)[end].event_idx : chunk.num_events;
+    } else {
+        if (!scan_chunk(chunk, format, binary, window, scanned, num_events, error_pos)) {
+            return NULL;
+        }
+        entries = scanned.data();
+        num_entries = scanned.size();
+    }
+    if (num_entries == 0) {
+        return std::unique_ptr<Node>(new Node());
     }
-    if(self_nsec >= 0) {
-        _penalty_self_nsec = uint64_t(_penalty_denom * self_nsec);
+
+    std::vector<uint64_t> bounds;
+    for (size_t i = 0; i < num_entries; i++) {
+        bounds.push_back(entries[i].event_idx);
     }
-    if(childer_nsec >= 0) {
-        _penalty_children_nsec = uint64_t(_penalty_denom * childer_nsec);
-    }        
+    bounds.push_back(num_events);
+
+    std::atomic<const char*> error(NULL);
+    auto tree = build_frames(pool, bounds, 0, (unsigned)num_entries, [&](unsigned first, unsigned last, Node& root) {
+        std::vector<Event> events;
+        const char* error_pos = NULL;
+        const frame_ref_t& entry = entries[first];
+        if (!decode_events(chunk, format, binary, (size_t)entry.payload_offset,
+                bounds[last] - bounds[first], &entry, events, error_pos)) {
+            error = error_pos;
+            return;
+        }
+        root.AddThreadEvents(events.data(), events.size());
+    });
+    error_pos = error;
+    return tree;
+}
+
+// In-process events are converted to Event batches of whole frames right before they are
+// merged, the trees of the threads are built by the same pool as the parsed ones
+void ThreadMap::BuildTrees()
+{
+    if (!_threads.empty() || _threadEvents.empty()) {
+        return;
+    }
+    std::vector<int> thread_ids;
+    for (const auto& thread : _threadEvents) {
+        thread_ids.push_back(thread.first);
+        _threads[thread.first] = NULL;
+    }
+    WorkStealingPool pool;
+    pool.parallel_for(0, (unsigned)thread_ids.size(), [&](unsigned i) {
+        const auto& events = _threadEvents.at(thread_ids[i]);
+        std::vector<uint64_t> bounds;
+        for (size_t j = 0; j < events.size(); j++) {
+            if (j == 0 || _sites[events.site[j]].stack_level == 0) {
+                bounds.push_back(j);
+            }
+        }
+        bounds.push_back(events.size());
+        auto tree = build_frames(pool, bounds, 0, (unsigned)bounds.size() - 1, [&](unsigned first, unsigned last, Node& root) {
+            std::vector<Event> batch;
+            batch.reserve((size_t)(bounds[last] - bounds[first]));
+            for (uint64_t j = bounds[first]; j < bounds[last]; j++) {
+                batch.push_back(make_event(events, (size_t)j));
+            }
+            root.AddThreadEvents(batch.data(), batch.size());
+        });
+        _threads[thread_ids[i]] = tree.release();
+    });
+    finalize();
+}
+
+const char* ThreadMap::parse_chunks(const std::vector<chunk_t>& chunks, const log_format_t& format, bool binary, const frame_window_t& window)
+{
+    // chunks of the same thread are merged in the log order by the same task
+    std::map<int, std::vector<const chunk_t*> > threadChunks;
+    for (const auto& chunk : chunks) {
+        threadChunks[chunk.thread_id].push_back(&chunk);
+    }
+    std::vector<std::pair<Node*, const std::vector<const chunk_t*>*> > tasks;
+    for (const auto& thread : threadChunks) {
+        Node*& root = _threads[thread.first];
+        if (!root) {
+            root = new Node();
+        }
+        tasks.emplace_back(root, &thread.second);
+    }
+
+    // both the threads and the frames within a thread are the pool tasks
+    WorkStealingPool pool;
+    std::vector<const char*> errors(tasks.size(), (const char*)NULL);
+    pool.parallel_for(0, (unsigned)tasks.size(), [&](unsigned i) {
+        Node& root = *tasks[i].first;
+        for (const auto chunk : *tasks[i].second) {
+            auto tree = build_chunk_tree(pool, *chunk, format, binary, window, errors[i]);
+            if (errors[i]) {
+                break;
+            }
+            root.AddThreadTree(std::move(*tree));
+        }
+    });
+    for (auto error_pos : errors) {
+        if (error_pos) {
+            return error_pos;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Aggregated trees cache
+    "FPSPROF-CACHE 2\n" u64le(log size) u64le(log hash) u64le(body hash)
+    body, the rest of the cache:
+    props:   penalty_denom penalty_self_nsec penalty_children_nsec
+    names:   count { len bytes }
+    threads: count { thread_id tree }, see Node::Save()
+*/
+#define CACHE_HEADER "FPSPROF-CACHE 2\n"
+
+void ThreadMap::SaveCache(std::ostream& os, uint64_t log_size, uint64_t log_hash) const
+{
+    assert(_penalty_denom);
+
+    std::unordered_map<const char*, unsigned> name_ids;
+    std::vector<const char*> names;
+    varint_writer_t trees;
+    trees.put_varint(_threads.size());
+    for (const auto& thread : _threads) {
+        trees.put_varint((unsigned)thread.first);
+        thread.second->Save(trees, name_ids, names);
+    }
+
+    varint_writer_t body;
+    body.put_varint(_penalty_denom);
+    body.put_varint(_penalty_self_nsec);
+    body.put_varint(_penalty_children_nsec);
+    body.put_varint(names.size());
+    for (auto name : names) {
+        size_t len = strlen(name);
+        body.put_varint(len);
+        body.put_bytes(name, len);
+    }
+    body.put_bytes(trees.data(), trees.size());
+
+    varint_writer_t wr;
+    wr.put_bytes(CACHE_HEADER, strlen(CACHE_HEADER));
+    wr.put_u64le(log_size);
+    wr.put_u64le(log_hash);
+    wr.put_u64le(content_hash((const uint8_t*)body.data(), body.size()));
+    os.write(wr.data(), wr.size());
+    os.write(body.data(), body.size());
+}
+
+// false if the cache belongs to another log or is broken, the map is not changed then.
+// The body hash is checked before anything is decoded, a damaged tree would load fine.
+bool ThreadMap::LoadCache(const uint8_t* data, size_t size, uint64_t log_size, uint64_t log_hash)
+{
+    assert(_penalty_denom == 0 && _threads.empty());
+
+    varint_reader_t rd(data, data + size);
+    const uint8_t* header = rd.get_bytes(strlen(CACHE_HEADER));
+    if (!header || memcmp(header, CACHE_HEADER, strlen(CACHE_HEADER)) != 0) {
+        return false;
+    }
+    if (rd.get_u64le() != log_size || rd.get_u64le() != log_hash) {
+        return false;
+    }
+    uint64_t body_hash = rd.get_u64le();
+    if (rd.fail() || content_hash(data + rd.pos(), size - rd.pos()) != body_hash) {
+        return false;
+    }
+    unsigned penalty_denom = (unsigned)rd.get_varint();
+    uint64_t penalty_self_nsec = rd.get_varint();
+    uint64_t penalty_children_nsec = rd.get_varint();
+
+    std::vector<const char*> names((size_t)std::min<uint64_t>(rd.get_varint(), size));
+    for (auto& name : names) {
+        size_t len = (size_t)rd.get_varint();
+        const char* s = (const char*)rd.get_bytes(len);
+        if (!s) {
+            return false;
+        }
+        name = hash_event_name(std::string(s, len));
+    }
+
+    std::map<int, std::unique_ptr<Node> > threads;
+    for (uint64_t num_threads = rd.get_varint(); num_threads-- && !rd.fail(); ) {
+        int thread_id = (int)rd.get_varint();
+        std::unique_ptr<Node> root(Node::Load(rd, names));
+        if (!root || threads.count(thread_id)) {
+            return false;
+        }
+        threads[thread_id] = std::move(root);
+    }
+    if (rd.fail() || !rd.eof() || penalty_denom == 0 || !threads.count(0)) {
+        return false;
+    }
+
+    _penalty_denom = penalty_denom;
+    _penalty_self_nsec = penalty_self_nsec;
+    _penalty_children_nsec = penalty_children_nsec;
+    for (auto& thread : threads) {
+        _threads[thread.first] = thread.second.release();
+    }
+    return true;
+}
+
+struct EventStream::impl_t {
+    struct thread_t {
+        int thread_id;
+        std::vector<const ThreadMap::chunk_t*> chunks; // in the log order
+        size_t next_chunk = 0;
+        std::unique_ptr<ThreadMap::event_cursor_t> cursor;
+        Event event; // current
+        bool in_window = false; // the current top-level scope starts within the frame range
+    };
+
+    // decodes the next event of the thread, error_pos is set on a parse error
+    bool advance(thread_t& thread) {
+        for (;;) {
+            if (thread.cursor) {
+                if (thread.cursor->next(thread.event)) {
+                    if (!window.enabled()) {
+                        return true;
+                    }
+                    if (thread.event.stack_level() <= 0) {
+                        if (thread.event.start_nsec() >= window.stop_nsec) { // the range is over
+                            thread.cursor.reset();
+                            thread.next_chunk = thread.chunks.size();
+                            return false;
+                        }
+                        thread.in_window = window.contains(thread.event.start_nsec());
+                    }
+                    if (thread.in_window) {
+                        return true;
+                    }
+                    continue;
+                }
+                if (thread.cursor->error_pos) {
+                    error_pos = thread.cursor->error_pos;
+                    return false;
+                }
+            }
+            if (thread.next_chunk == thread.chunks.size()) {
+                return false;
+            }
+            const ThreadMap::chunk_t& chunk = *thread.chunks[thread.next_chunk++];
+            if (window.enabled() && log.binary && thread.chunks.size() == 1 && chunk.frames) {
+                size_t first = ThreadMap::first_frame_entry(chunk, log.format, window.start_nsec);
+                if (first == chunk.frames->size()) {
+                    return false;
+                }
+                const ThreadMap::frame_ref_t& entry = (*chunk.frames)[first];
+                thread.cursor.reset(new ThreadMap::event_cursor_t(chunk, log.format, log.binary, (size_t)entry.payload_offset, &entry));
+            } else {
+                thread.cursor.reset(new ThreadMap::event_cursor_t(chunk, log.format, log.binary));
+            }
+        }
+    }
+    // min-heap by the current event start, the thread order breaks the ties
+    bool later(unsigned a, unsigned b) const {
+        uint64_t ta = threads[a].event.start_nsec(), tb = threads[b].event.start_nsec();
+        return ta != tb ? ta > tb : a > b;
+    }
+
+    ThreadMap::log_t log;
+    ThreadMap::frame_window_t window;
+    std::vector<thread_t> threads;
+    std::vector<unsigned> heap; // threads with a pending event
+    const char* error_pos = NULL;
+};
+
+EventStream::EventStream()
+{
+}
+
+EventStream::~EventStream()
+{
+}
+
+bool EventStream::Open(const uint8_t* data, size_t size, const frame_range_t& range)
+{
+    _impl.reset(new impl_t);
+    _thread_ids.clear();
+    _frame_thread_found = false;
+    _failed = false;
+    _log_start_nsec = 0;
+
+    impl_t& impl = *_impl;
+    if (!ThreadMap::read_log(data, size, impl.log) || !ThreadMap::resolve_frame_window(impl.log, range, impl.window)) {
+        _impl.reset();
+        return false;
+    }
+    std::map<int, std::vector<const ThreadMap::chunk_t*> > threadChunks;
+    uint64_t log_start_nsec = UINT64_MAX;
+    for (const auto& chunk : impl.log.chunks) {
+        threadChunks[chunk.thread_id].push_back(&chunk);
+        ThreadMap::event_cursor_t cursor(chunk, impl.log.format, impl.log.binary);
+        Event event;
+        if (cursor.next(event)) { // the first event of a chunk starts first
+            log_start_nsec = std::min(log_start_nsec, event.start_nsec());
+        }
+    }
+    _log_start_nsec = log_start_nsec == UINT64_MAX ? 0 : log_start_nsec;
+    int mainThreadId = -1;
+    for (auto& chunks : threadChunks) {
+        impl.threads.emplace_back();
+        auto& thread = impl.threads.back();
+        thread.thread_id = chunks.first;
+        thread.chunks = std::move(chunks.second);
+        if (!impl.advance(thread)) {
+            if (impl.error_pos) {
+                ThreadMap::print_parse_error(impl.log, impl.error_pos);
+                _impl.reset();
+                return false;
+            }
+            impl.threads.pop_back();
+            continue;
+        }
+        if (mainThreadId == -1 && thread.event.frame_flag()) {
+            mainThreadId = thread.thread_id;
+        }
+    }
+    // same renumbering as ThreadMap::finalize()
+    _frame_thread_found = mainThreadId != -1;
+    for (unsigned i = 0; i < impl.threads.size(); i++) {
+        auto& thread = impl.threads[i];
+        if (_frame_thread_found && thread.thread_id == mainThreadId) {
+            thread.thread_id = 0;
+        } else if (_frame_thread_found && thread.thread_id == 0) {
+            thread.thread_id = mainThreadId;
+        }
+        _thread_ids.push_back(thread.thread_id);
+        impl.heap.push_back(i);
+    }
+    std::sort(_thread_ids.begin(), _thread_ids.end());
+    std::make_heap(impl.heap.begin(), impl.heap.end(), [&impl](unsigned a, unsigned b) { return impl.later(a, b); });
+    return true;
+}
+
+bool EventStream::Next(int& thread_id, Event& event)
+{
+    if (!_impl || _impl->heap.empty()) {
+        return false;
+    }
+    impl_t& impl = *_impl;
+    auto later = [&impl](unsigned a, unsigned b) { return impl.later(a, b); };
+    std::pop_heap(impl.heap.begin(), impl.heap.end(), later);
+    auto& thread = impl.threads[impl.heap.back()];
+    thread_id = thread.thread_id;
+    event = thread.event;
+    if (impl.advance(thread)) {
+        std::push_heap(impl.heap.begin(), impl.heap.end(), later);
+    } else {
+        impl.heap.pop_back();
+        if (impl.error_pos) {
+            ThreadMap::print_parse_error(impl.log, impl.error_pos);
+            impl.heap.clear();
+            _failed = true;
+        }
+    }
+    return true;
 }
 
 }
@@ -7,33 +7,151 @@
 #include <vector>
 #include <map>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
 
 namespace fpsprof {
 
 class Node;
+class WorkStealingPool;
+
+// Frames [first, last) of the frame thread numbered from 0. The other threads are cut by time,
+// a top-level scope is taken when it starts within the frames.
+struct frame_range_t {
+    unsigned first = 0;
+    unsigned last = ~0u;
+
+    bool enabled() const { return first > 0 || last != ~0u; }
+};
 
 struct ThreadMap
 {
+    friend class EventStream;
+
+    ThreadMap() = default;
+    ThreadMap(const ThreadMap&) = delete;
+    ThreadMap& operator= (const ThreadMap&) = delete;
+    ~ThreadMap();
+
     // ctors
     void AddRawThread(std::list<ProfPoint>&& marks);
-    bool Deserialize(std::ifstream& ifs);
+    // the trees of the events added with AddRawThread(), nothing to do for a deserialized map
+    void BuildTrees();
+    // the events are decoded in batches straight into the trees and not kept; fmt 2 logs are
+    // entered at the frame index entries of the range, the other chunks are scanned for the batches
+    bool Deserialize(const uint8_t* data, size_t size, const frame_range_t& range = frame_range_t());
 
-    void Serialize(std::ostream& os) const;
+    // fmt 1 - text, fmt 2 - binary
+    void Serialize(std::ostream& os, unsigned fmt = 2) const;
+
+    // aggregated trees bound to the source log by its size and content hash
+    void SaveCache(std::ostream& os, uint64_t log_size, uint64_t log_hash) const;
+    bool LoadCache(const uint8_t* data, size_t size, uint64_t log_size, uint64_t log_hash);
 
     unsigned reported_penalty_denom() { return _penalty_denom; }
     uint64_t reported_penalty_self_nsec() const { return _penalty_self_nsec; }
     uint64_t reported_penalty_children_nsec() const { return _penalty_children_nsec; }
     const std::map<int, Node* >& threads() const { return _threads; };
 
-    void set_penalty(double self_nsec = 1, double childer_nsec = -1);
-
 private:
+    void serialize_text(std::ostream& os, unsigned fmt) const;
+    void serialize_binary(std::ostream& os) const;
+    struct log_format_t; // resolved properties and names
+    struct frame_ref_t {  // fmt 2 frame index entry or a batch start found by scan_chunk()
+        uint64_t event_idx;
+        uint64_t payload_offset;
+        int64_t start_time;
+    };
+    struct event_site_t { // shared by all in-process events of the same call site
+        const char* name;
+        int stack_level;
+        bool frame_flag;
+        bool measure_process_time;
+    };
+    struct event_columns_t { // in-process events of one thread in the call order
+        std::vector<uint32_t> site;
+        std::vector<uint64_t> start_nsec;
+        std::vector<uint64_t> duration_nsec;
+        std::vector<uint64_t> cpu_used;
+
+        size_t size() const { return site.size(); }
+    };
+    struct chunk_t {     // single thread events
+        int thread_id;
+        int64_t thread_time;
+        uint64_t num_events; // binary only
+        const std::vector<frame_ref_t>* frames; // binary only, optional
+        const char* begin;
+        const char* end;
+    };
+    struct frame_window_t { // the time span of a frame range
+        uint64_t start_nsec = 0;
+        uint64_t stop_nsec = UINT64_MAX;
+
+        bool enabled() const { return start_nsec > 0 || stop_nsec != UINT64_MAX; }
+        bool contains(uint64_t nsec) const { return nsec >= start_nsec && nsec < stop_nsec; }
+    };
+    struct log_t;          // format and chunks of a log, the events are not decoded
+    struct event_cursor_t; // incremental decoder of a chunk
+    static bool read_log(const uint8_t* data, size_t size, log_t& log);
+    static bool read_text_log(log_t& log);
+    static bool read_binary_log(log_t& log);
+    static void print_parse_error(const log_t& log, const char* pos);
+    static void read_frame_index(const uint8_t* begin, const uint8_t* end, std::vector<chunk_t>& chunks,
+        std::map<int, std::vector<frame_ref_t> >& index);
+    static bool resolve_frame_window(const log_t& log, const frame_range_t& range, frame_window_t& window);
+    static size_t first_frame_entry(const chunk_t& chunk, const log_format_t& format, uint64_t nsec);
+    const char* parse_chunks(const std::vector<chunk_t>& chunks, const log_format_t& format, bool binary, const frame_window_t& window);
+    static std::unique_ptr<Node> build_chunk_tree(WorkStealingPool& pool, const chunk_t& chunk, const log_format_t& format,
+        bool binary, const frame_window_t& window, const char*& error_pos);
+    static bool scan_chunk(const chunk_t& chunk, const log_format_t& format, bool binary, const frame_window_t& window,
+        std::vector<frame_ref_t>& entries, uint64_t& num_events, const char*& error_pos);
+    static bool decode_events(const chunk_t& chunk, const log_format_t& format, bool binary,
+        size_t pos, uint64_t num_events, const frame_ref_t* entry, std::vector<Event>& events, const char*& error_pos);
+    bool finalize();
+    uint32_t site_id(const event_site_t& site);
+    Event make_event(const event_columns_t& events, size_t i) const;
+
     unsigned _penalty_denom = 0;
     uint64_t _penalty_self_nsec = 0;
     uint64_t _penalty_children_nsec = 0;
     std::map<int, Node* > _threads;
 
-    std::map<int, std::list<Event> > _threadEventsMap;
+    std::vector<event_site_t> _sites;
+    std::unordered_map<const char*, std::vector<uint32_t> > _site_ids; // by name
+    std::map<int, event_columns_t> _threadEvents;
+};
+
+// Events of a log in the start time order of all threads. The threads are decoded from the log
+// on the fly and merged, only the current event of every thread is kept in memory.
+class EventStream {
+public:
+    EventStream();
+    ~EventStream();
+    EventStream(const EventStream&) = delete;
+    EventStream& operator= (const EventStream&) = delete;
+
+    // the log must stay mapped while the stream is read; the events of a frame range only,
+    // the threads are entered at the frame index entries of fmt 2 logs
+    bool Open(const uint8_t* data, size_t size, const frame_range_t& range = frame_range_t());
+
+    // the frame thread is reported as thread 0, same as in ThreadMap
+    const std::vector<int>& thread_ids() const { return _thread_ids; }
+    bool frame_thread_found() const { return _frame_thread_found; }
+    // the first event start of the whole log, the frame range does not move it
+    uint64_t log_start_nsec() const { return _log_start_nsec; }
+
+    // false at the end of the log or on a parse error
+    bool Next(int& thread_id, Event& event);
+    bool failed() const { return _failed; }
+
+private:
+    struct impl_t;
+    std::unique_ptr<impl_t> _impl;
+    std::vector<int> _thread_ids;
+    bool _frame_thread_found = false;
+    bool _failed = false;
+    uint64_t _log_start_nsec = 0;
 };
 
 }
@@ -0,0 +1,95 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "timeline.h"
+#include "thread.h"
+#include "writer.h"
+
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace fpsprof {
+
+static void put_json_string(BufferedWriter& w, const char* s)
+{
+    static const char hex[] = "0123456789abcdef";
+    w.put('"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            w.put('\\');
+            w.put((char)c);
+        } else if (c < 0x20) {
+            w.write("\\u00", 4);
+            w.put(hex[c >> 4]);
+            w.put(hex[c & 15]);
+        } else {
+            w.put((char)c);
+        }
+    }
+    w.put('"');
+}
+
+static void put_usec(BufferedWriter& w, uint64_t nsec)
+{
+    w.put_uint(nsec / 1000);
+    unsigned frac = (unsigned)(nsec % 1000);
+    char* p = w.reserve(4);
+    p[0] = '.';
+    p[1] = (char)('0' + frac / 100);
+    p[2] = (char)('0' + frac / 10 % 10);
+    p[3] = (char)('0' + frac % 10);
+    w.commit(4);
+}
+
+bool WriteChromeTrace(BufferedWriter& w, EventStream& events, const char* process_name)
+{
+    w.puts("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    w.puts("{\"ph\":\"M\",\"pid\":1,\"tid\":0,\"name\":\"process_name\",\"args\":{\"name\":");
+    put_json_string(w, process_name);
+    w.puts("}}");
+    for (int thread_id : events.thread_ids()) {
+        std::string name = "thread " + std::to_string(thread_id);
+        if (thread_id == 0 && events.frame_thread_found()) {
+            name += " (frames)";
+        }
+        w.printf(",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}", thread_id, name.c_str());
+        w.printf(",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_sort_index\",\"args\":{\"sort_index\":%d}}", thread_id, thread_id);
+    }
+
+    // names are interned, each one is escaped once
+    std::unordered_map<const char*, std::string> names;
+    uint64_t time_base = events.log_start_nsec();
+    int thread_id;
+    Event event;
+    while (events.Next(thread_id, event)) {
+        auto it = names.find(event.name());
+        if (it == names.end()) {
+            std::string escaped;
+            BufferedWriter ew(escaped, 64);
+            put_json_string(ew, event.name());
+            ew.flush();
+            it = names.emplace(event.name(), std::move(escaped)).first;
+        }
+        w.puts(",\n{\"ph\":\"X\",\"pid\":1,\"tid\":");
+        w.put_uint((unsigned)thread_id);
+        w.puts(",\"name\":");
+        w.write(it->second);
+        if (event.frame_flag()) {
+            w.puts(",\"cat\":\"frame\"");
+        }
+        w.puts(",\"ts\":");
+        put_usec(w, event.start_nsec() - time_base);
+        w.puts(",\"dur\":");
+        put_usec(w, event.stop_nsec() - event.start_nsec());
+        w.put('}');
+    }
+    w.puts("\n]}\n");
+    return !events.failed();
+}
+
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+namespace fpsprof {
+
+class EventStream;
+class BufferedWriter;
+
+// Chrome Trace Event JSON (chrome://tracing, Perfetto UI): thread name metadata followed by
+// a complete "X" event per profiler event in the start time order. The timestamps are
+// microseconds since the first event of the log, nanoseconds are kept as the fraction.
+bool WriteChromeTrace(BufferedWriter& w, EventStream& events, const char* process_name);
+
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+
+namespace fpsprof {
+
+// LEB128 variable length integers, zigzag for the signed values
+static inline uint64_t zigzag_encode(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t zigzag_decode(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static inline uint8_t* varint_put(uint8_t* dst, uint64_t v)
+{
+    while (v >= 0x80) {
+        *dst++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *dst++ = (uint8_t)v;
+    return dst;
+}
+
+// append-only byte buffer
+struct varint_writer_t {
+    enum { VARINT_MAX_BYTES = 10 };
+
+    void put_varint(uint64_t v) {
+        ensure(VARINT_MAX_BYTES);
+        _size = varint_put((uint8_t*)&_buf[_size], v) - (uint8_t*)&_buf[0];
+    }
+    void put_zigzag(int64_t v) { put_varint(zigzag_encode(v)); }
+    void put_bytes(const void* data, size_t size) {
+        ensure(size);
+        memcpy(&_buf[_size], data, size);
+        _size += size;
+    }
+    void put_u64le(uint64_t v) {
+        uint8_t b[8];
+        for (unsigned i = 0; i < 8; i++) {
+            b[i] = (uint8_t)(v >> (8 * i));
+        }
+        put_bytes(b, 8);
+    }
+
+    size_t size() const { return _size; }
+    const char* data() const { return _buf.data(); }
+    void clear() { _size = 0; }
+
+private:
+    void ensure(size_t n) {
+        if (_size + n > _buf.size()) {
+            _buf.resize(std::max(2 * _buf.size(), _size + n + 4096));
+        }
+    }
+    std::string _buf;
+    size_t _size = 0;
+};
+
+// bounds-checked reader, sets 'fail' flag instead of throwing
+struct varint_reader_t {
+    varint_reader_t(const uint8_t* begin, const uint8_t* end) : _begin(begin), _ptr(begin), _end(end) {}
+
+    uint64_t get_varint() {
+        uint64_t v = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (_ptr >= _end) {
+                break;
+            }
+            uint8_t b = *_ptr++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return v;
+            }
+        }
+        _fail = true;
+        return 0;
+    }
+    int64_t get_zigzag() { return zigzag_decode(get_varint()); }
+    const uint8_t* get_bytes(size_t size) {
+        if ((size_t)(_end - _ptr) < size) {
+            _fail = true;
+            return NULL;
+        }
+        const uint8_t* p = _ptr;
+        _ptr += size;
+        return p;
+    }
+    uint64_t get_u64le() {
+        const uint8_t* b = get_bytes(8);
+        uint64_t v = 0;
+        for (unsigned i = 0; b && i < 8; i++) {
+            v |= (uint64_t)b[i] << (8 * i);
+        }
+        return v;
+    }
+
+    bool fail() const { return _fail; }
+    bool eof() const { return _ptr >= _end; }
+    size_t pos() const { return _ptr - _begin; }
+    size_t size() const { return _end - _begin; }
+    void seek(size_t pos) { if (pos > size()) { _fail = true; } else { _ptr = _begin + pos; } }
+
+private:
+    const uint8_t* _begin;
+    const uint8_t* _ptr;
+    const uint8_t* _end;
+    bool _fail = false;
+};
+
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "workpool.h"
+
+#include <chrono>
+
+namespace fpsprof {
+
+static thread_local const WorkStealingPool* t_pool = NULL;
+static thread_local unsigned t_queue_index = 0;
+
+WorkStealingPool::WorkStealingPool(unsigned num_threads)
+{
+    num_threads = std::max(num_threads, 1u);
+    for (unsigned i = 0; i < num_threads; i++) {
+        _queues.emplace_back(new queue_t);
+    }
+    for (unsigned i = 1; i < num_threads; i++) {
+        _threads.emplace_back(&WorkStealingPool::worker_loop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    _stop = true;
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+unsigned WorkStealingPool::queue_index() const
+{
+    return t_pool == this ? t_queue_index : 0;
+}
+
+void WorkStealingPool::push(task_t* task)
+{
+    queue_t& queue = *_queues[queue_index()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(task);
+}
+
+bool WorkStealingPool::pop_if(task_t* task)
+{
+    queue_t& queue = *_queues[queue_index()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty() || queue.tasks.back() != task) {
+        return false; // stolen
+    }
+    queue.tasks.pop_back();
+    return true;
+}
+
+WorkStealingPool::task_t* WorkStealingPool::pop()
+{
+    queue_t& queue = *_queues[queue_index()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return NULL;
+    }
+    task_t* task = queue.tasks.back();
+    queue.tasks.pop_back();
+    return task;
+}
+
+WorkStealingPool::task_t* WorkStealingPool::steal(unsigned thief)
+{
+    unsigned n = (unsigned)_queues.size();
+    for (unsigned i = 1; i < n; i++) {
+        queue_t& queue = *_queues[(thief + i) % n];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task_t* task = queue.tasks.front();
+            queue.tasks.pop_front();
+            return task;
+        }
+    }
+    return NULL;
+}
+
+void WorkStealingPool::run(task_t* task)
+{
+    try {
+        task->fn();
+    } catch (...) {
+        task->error = std::current_exception();
+    }
+    task->done.store(true, std::memory_order_release);
+}
+
+void WorkStealingPool::wait(task_t* task)
+{
+    unsigned index = queue_index();
+    while (!task->done.load(std::memory_order_acquire)) {
+        task_t* other = steal(index);
+        if (other) {
+            run(other);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void WorkStealingPool::worker_loop(unsigned index)
+{
+    t_pool = this;
+    t_queue_index = index;
+
+    unsigned idle = 0;
+    while (!_stop.load(std::memory_order_relaxed)) {
+        task_t* task = pop();
+        if (!task) {
+            task = steal(index);
+        }
+        if (task) {
+            run(task);
+            idle = 0;
+        } else if (++idle < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min(idle, 1000u)));
+        }
+    }
+}
+
+}
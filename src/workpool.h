@@ -0,0 +1,97 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include "parallel.h"
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <functional>
+
+namespace fpsprof {
+
+// Fork-join pool: every worker owns a task deque, pushes and pops at the back,
+// idle workers steal from the front of the others. A thread waiting for a stolen
+// task keeps executing stolen work instead of blocking.
+// The thread which created the pool is a worker too (it owns queue 0), no other
+// external thread may call invoke().
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned num_threads = num_workers());
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator= (const WorkStealingPool&) = delete;
+
+    // run a() and b() possibly in parallel and wait for both
+    template<class fa_t, class fb_t>
+    void invoke(fa_t&& a, fb_t&& b) {
+        task_t tb(b);
+        push(&tb);
+        std::exception_ptr error;
+        try {
+            a();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (pop_if(&tb)) {
+            run(&tb);
+        } else {
+            wait(&tb);
+        }
+        if (!error) {
+            error = tb.error;
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // recursive halving of [first, last), fn(i) is called once for each item
+    template<class fn_t>
+    void parallel_for(unsigned first, unsigned last, const fn_t& fn) {
+        if (last - first == 0) {
+            return;
+        }
+        if (last - first == 1) {
+            fn(first);
+            return;
+        }
+        unsigned mid = first + (last - first) / 2;
+        invoke([&]() { parallel_for(first, mid, fn); }, [&]() { parallel_for(mid, last, fn); });
+    }
+
+private:
+    struct task_t {
+        template<class fn_t> explicit task_t(fn_t& fn) : fn(fn) {}
+        std::function<void()> fn;
+        std::atomic<bool> done{ false };
+        std::exception_ptr error;
+    };
+    struct queue_t {
+        std::mutex mutex;
+        std::deque<task_t*> tasks;
+    };
+
+    unsigned queue_index() const;
+    void push(task_t* task);
+    bool pop_if(task_t* task);
+    task_t* pop();
+    task_t* steal(unsigned thief);
+    static void run(task_t* task);
+    void wait(task_t* task);
+    void worker_loop(unsigned index);
+
+    std::vector<std::unique_ptr<queue_t> > _queues;
+    std::vector<std::thread> _threads;
+    std::atomic<bool> _stop{ false };
+};
+
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "writer.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <cmath>
+#include <algorithm>
+
+#if _WIN32
+    #include <io.h>
+    #define write_fd(fd, data, size) _write(fd, data, (unsigned)(size))
+#else
+    #include <unistd.h>
+    #define write_fd(fd, data, size) ::write(fd, data, size)
+#endif
+
+namespace fpsprof {
+
+BufferedWriter::BufferedWriter(FILE* fp, size_t buffer_size)
+    : _fp(fp), _buf(buffer_size, '\0')
+{
+}
+BufferedWriter::BufferedWriter(int fd, size_t buffer_size)
+    : _fd(fd), _buf(buffer_size, '\0')
+{
+}
+BufferedWriter::BufferedWriter(std::string& str, size_t buffer_size)
+    : _str(&str), _buf(buffer_size, '\0')
+{
+}
+
+// the buffer only grows for a single reservation larger than its size
+void BufferedWriter::grow(size_t n)
+{
+    flush();
+    if (n > _buf.size()) {
+        _buf.resize(n);
+    }
+}
+
+bool BufferedWriter::flush()
+{
+    const char* data = _buf.data();
+    size_t size = _pos;
+    _pos = 0;
+    if (_fail || size == 0) {
+        return !_fail;
+    }
+    if (_str) {
+        _str->append(data, size);
+    } else if (_fp) {
+        _fail = fwrite(data, 1, size, _fp) != size;
+    } else {
+        while (size) {
+            auto n = write_fd(_fd, data, size);
+            if (n <= 0) {
+                _fail = true;
+                break;
+            }
+            data += n;
+            size -= (size_t)n;
+        }
+    }
+    return !_fail;
+}
+
+void BufferedWriter::puts(const char* s)
+{
+    write(s, strlen(s));
+}
+
+// The scaled value is rounded directly unless it is close to a rounding tie or too large,
+// then snprintf decides. The margin covers the scaling error, half an ulp of the scaled value.
+void BufferedWriter::put_fixed(double v, int width, int prec, bool sign)
+{
+    static const double scales[] = { 1, 10, 100, 1e3, 1e4, 1e5, 1e6 };
+    const int max_prec = int(sizeof(scales) / sizeof(scales[0])) - 1;
+    double scaled = fabs(v) * scales[std::min(std::max(prec, 0), max_prec)];
+    double frac = scaled - floor(scaled);
+    if (prec < 0 || prec > max_prec || !(scaled < 1e15) || fabs(frac - 0.5) < 1e-6 + scaled * 1e-15) {
+        if (sign) {
+            printf("%+*.*f", width, prec, v);
+        } else {
+            printf("%*.*f", width, prec, v);
+        }
+        return;
+    }
+    uint64_t n = (uint64_t)(scaled + 0.5);
+    char digits[32];
+    int len = 0;
+    for (int i = 0; n || i <= prec; i++) {
+        if (i == prec && prec) {
+            digits[len++] = '.';
+        }
+        digits[len++] = (char)('0' + n % 10);
+        n /= 10;
+    }
+    if (std::signbit(v)) {
+        digits[len++] = '-';
+    } else if (sign) {
+        digits[len++] = '+';
+    }
+    char* row = reserve(std::max(width, len));
+    char* p = row;
+    for (int i = len; i < width; i++) {
+        *p++ = ' ';
+    }
+    while (len) {
+        *p++ = digits[--len];
+    }
+    commit(p - row);
+}
+
+void BufferedWriter::fill(char c, size_t n)
+{
+    memset(reserve(n), c, n);
+    commit(n);
+}
+
+void BufferedWriter::printf(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    size_t room = _buf.size() - _pos;
+    int n = vsnprintf(&_buf[_pos], room, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        _fail = true;
+        return;
+    }
+    if ((size_t)n >= room) { // retry with the room for the whole row and the terminator
+        va_start(args, fmt);
+        vsnprintf(reserve((size_t)n + 1), (size_t)n + 1, fmt, args);
+        va_end(args);
+    }
+    commit((size_t)n);
+}
+
+FileOStream::Buf::int_type FileOStream::Buf::overflow(int_type ch)
+{
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+        return traits_type::not_eof(ch);
+    }
+    return fputc(ch, _fp) == EOF ? traits_type::eof() : ch;
+}
+
+std::streamsize FileOStream::Buf::xsputn(const char* s, std::streamsize n)
+{
+    return (std::streamsize)fwrite(s, 1, (size_t)n, _fp);
+}
+
+int FileOStream::Buf::sync()
+{
+    return fflush(_fp) == 0 ? 0 : -1;
+}
+
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <streambuf>
+#include <ostream>
+
+namespace fpsprof {
+
+// Buffered text output to a FILE*, a file descriptor or a string.
+// Rows are formatted in place: reserve() returns the room at the buffer tail, commit() keeps the written part.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(FILE* fp, size_t buffer_size = 1 << 16);
+    explicit BufferedWriter(int fd, size_t buffer_size = 1 << 16);
+    explicit BufferedWriter(std::string& str, size_t buffer_size = 1 << 16);
+    ~BufferedWriter() { flush(); }
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator= (const BufferedWriter&) = delete;
+
+    char* reserve(size_t n) {
+        if (_pos + n > _buf.size()) {
+            grow(n);
+        }
+        return &_buf[_pos];
+    }
+    void commit(size_t n) { _pos += n; }
+
+    void write(const char* s, size_t n) { memcpy(reserve(n), s, n); commit(n); }
+    void write(const std::string& s) { write(s.data(), s.size()); }
+    void puts(const char* s);
+    void put(char c) { *reserve(1) = c; commit(1); }
+    void put_uint(uint64_t v) {
+        char digits[20];
+        size_t len = 0;
+        do {
+            digits[len++] = (char)('0' + v % 10);
+            v /= 10;
+        } while (v);
+        char* p = reserve(len);
+        for (size_t i = 0; i < len; i++) {
+            p[i] = digits[len - 1 - i];
+        }
+        commit(len);
+    }
+    // "%*.*f", "%+*.*f" with 'sign', without the printf machinery; 'prec' is 0..2
+    void put_fixed(double v, int width, int prec, bool sign = false);
+    void fill(char c, size_t n);
+    void printf(const char* fmt, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 2, 3)))
+#endif
+        ;
+
+    bool flush();
+    bool fail() const { return _fail; }
+
+private:
+    void grow(size_t n);
+
+    FILE* _fp = NULL;
+    int _fd = -1;
+    std::string* _str = NULL;
+    std::string _buf;
+    size_t _pos = 0;
+    bool _fail = false;
+};
+
+// std::ostream over a FILE*, the FILE buffering is used as is
+class FileOStream : public std::ostream {
+public:
+    explicit FileOStream(FILE* fp) : std::ostream(&_buf), _buf(fp) {}
+
+private:
+    class Buf : public std::streambuf {
+    public:
+        explicit Buf(FILE* fp) : _fp(fp) {}
+
+    protected:
+        int_type overflow(int_type ch) override;
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+        int sync() override;
+
+    private:
+        FILE* _fp;
+    };
+    Buf _buf;
+};
+
+}
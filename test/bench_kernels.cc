@@ -0,0 +1,130 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "../src/kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+using namespace fpsprof;
+
+static double now_sec()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// first bin at which the cumulative count reaches 'fraction' of the total
+static size_t percentile_bin(const uint32_t* hist, size_t hist_size, double fraction)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < hist_size; i++) {
+        total += hist[i];
+    }
+    uint64_t target = (uint64_t)ceil(total * fraction);
+    uint64_t cum = 0;
+    for (size_t i = 0; i < hist_size; i++) {
+        cum += hist[i];
+        if (cum >= target && cum > 0) {
+            return i;
+        }
+    }
+    return hist_size ? hist_size - 1 : 0;
+}
+
+template<class fn_t>
+static double measure(unsigned repeat, fn_t fn)
+{
+    double best = 1e30;
+    for (unsigned i = 0; i < repeat; i++) {
+        double t = now_sec();
+        fn();
+        best = std::min(best, now_sec() - t);
+    }
+    return best;
+}
+
+struct result_t {
+    uint64_t min, max, sum, sum_below;
+    size_t cnt_below, cnt_range;
+    double sum_f, sq_dev_f, sum_range_f;
+    std::vector<uint32_t> hist;
+    size_t p50, p99;
+};
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atof(argv[1]) : 100000000;
+    unsigned repeat = argc > 2 ? (unsigned)atoi(argv[2]) : 3;
+    const unsigned hist_sz = 1024;
+
+    // event durations: mostly short calls with a long tail
+    std::vector<uint64_t> data(n);
+    std::vector<double> data_f(n);
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t r = (uint32_t)(seed >> 33);
+        data[i] = 20 + (r & 0xff) + ((r >> 8) % 1000 == 0 ? (r >> 12) : 0);
+        data_f[i] = (double)data[i];
+    }
+
+    printf("%zu durations, best of %u\n", n, repeat);
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "level", "minmax", "sum", "below", "hist", "sum_f", "sq_dev_f", "range_f");
+
+    std::vector<result_t> results;
+    const char* levels[] = { "scalar", "sse4", "avx2" };
+    for (const char* name : levels) {
+        if (strcmp(set_simd_level(name), name)) {
+            printf("%-8s not supported\n", name);
+            continue;
+        }
+        result_t r;
+        r.hist.resize(hist_sz);
+        double t[7];
+        t[0] = measure(repeat, [&]() { minmax_u64(data.data(), n, r.min, r.max); });
+        uint64_t bin_width = r.max/hist_sz + 1;
+        t[1] = measure(repeat, [&]() { r.sum = sum_u64(data.data(), n); });
+        t[2] = measure(repeat, [&]() { r.sum_below = sum_below_u64(data.data(), n, 200, r.cnt_below); });
+        t[3] = measure(repeat, [&]() {
+            memset(r.hist.data(), 0, hist_sz*sizeof(uint32_t));
+            histogram_u64(data.data(), n, bin_width, r.hist.data(), hist_sz);
+        });
+        r.p50 = percentile_bin(r.hist.data(), hist_sz, .5);
+        r.p99 = percentile_bin(r.hist.data(), hist_sz, .99);
+        t[4] = measure(repeat, [&]() { r.sum_f = sum_f64(data_f.data(), n); });
+        double mean = r.sum_f / n;
+        t[5] = measure(repeat, [&]() { r.sq_dev_f = sum_sq_dev_f64(data_f.data(), n, mean); });
+        double sigma = sqrt(r.sq_dev_f / n);
+        t[6] = measure(repeat, [&]() { r.sum_range_f = sum_in_range_f64(data_f.data(), n, mean - sigma, mean + sigma, r.cnt_range); });
+
+        printf("%-8s", name);
+        for (double ti : t) {
+            printf(" %8.1fms", ti*1000);
+        }
+        printf("\n");
+        results.push_back(std::move(r));
+    }
+
+    // all levels must agree with the scalar reference
+    const result_t& ref = results.front();
+    auto close = [](double a, double b) { return fabs(a - b) <= 1e-9*fabs(b); };
+    for (const auto& r : results) {
+        if (r.min != ref.min || r.max != ref.max || r.sum != ref.sum || r.sum_below != ref.sum_below ||
+            r.cnt_below != ref.cnt_below || r.cnt_range != ref.cnt_range || r.hist != ref.hist ||
+            r.p50 != ref.p50 || r.p99 != ref.p99 ||
+            !close(r.sum_f, ref.sum_f) || !close(r.sq_dev_f, ref.sq_dev_f) || !close(r.sum_range_f, ref.sum_range_f)) {
+            fprintf(stderr, "error: results differ from the scalar reference\n");
+            return 1;
+        }
+    }
+    printf("min %llu, max %llu, p50 bin %zu, p99 bin %zu\n", (unsigned long long)ref.min, (unsigned long long)ref.max, ref.p50, ref.p99);
+    return 0;
+}
@@ -4,10 +4,33 @@
  */
 
 #include "../src/reporter.h"
+#include "../src/writer.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 
+#include <vector>
+#include <algorithm>
+
+enum {
+    OPT_FORMAT = 256,
+    OPT_MIN_INCL_PERCENT,
+    OPT_MAX_DEPTH,
+    OPT_TOP_N_CHILDREN,
+    OPT_TREE,
+    OPT_DIFF,
+    OPT_SIGNIFICANCE,
+    OPT_FAIL_ABOVE,
+    OPT_MERGE,
+    OPT_SCALING,
+    OPT_SLOWEST_FRAMES,
+    OPT_CRITICAL_PATH,
+    OPT_CONCURRENCY,
+    OPT_FRAMES,
+    OPT_SKIP_WARMUP,
+};
+
 static void usage(void)
 {
     printf(
@@ -15,9 +38,65 @@ static void usage(void)
 "\n"
 "Usage:\n"
 "  fpsprof <options> profiler.log\n"
+"  fpsprof --diff <options> base.log new.log\n"
+"  fpsprof --merge <options> run1.log run2.log ...\n"
+"  fpsprof --scaling <options> 1:run1.log 2:run2.log 4:run4.log ...\n"
 "\n"
 "Options:\n"
-"  -h, --help     Print this help.\n"
+"  -h, --help              Print this help.\n"
+"  -s, --self <list>       Comma separated self penalty values, nsec per call.\n"
+"  -c, --children <list>   Comma separated children penalty values, nsec per call.\n"
+"                          Negative value stands for the one stored in the log.\n"
+"                          A report is printed for every (self, children) pair.\n"
+"  -I, --interactive       Read '<self> <children>' lines from stdin and print\n"
+"                          a report for each, 'q' quits.\n"
+"  -n, --no-cache          Do not use '<log>.cache' with the aggregated trees.\n"
+"  --format <fmt>          Output format:\n"
+"                            report       - text report (default)\n"
+"                            chrome-trace - Trace Event JSON timeline for\n"
+"                                           chrome://tracing or Perfetto UI\n"
+"                            folded       - collapsed stacks weighted by the\n"
+"                                           exclusive nsec, for flame graph tools\n"
+"                            flamegraph-svg - self-contained SVG flame graph\n"
+"  --tree <full|norec>     Stacks of the folded and SVG output: full call tree\n"
+"                          (default) or the tree with no recursion. The first\n"
+"                          '-s' and '-c' values are used.\n"
+"  --diff                  Compare two logs: call paths and functions sorted by\n"
+"                          the change of the exclusive time per frame (imp%%,\n"
+"                          percent of the base frame time). The first '-s' and\n"
+"                          '-c' values apply to both logs.\n"
+"  --significance <z>      Diff: mark a change significant when the Welch's z\n"
+"                          of the per-frame time reaches <z>, default 3.\n"
+"  --fail-above <p>        Diff: exit with code 2 if a significant change grows\n"
+"                          the frame time by more than <p> percent.\n"
+"  --merge                 Merge the runs of the same workload by call path:\n"
+"                          mean, sd, min and max of every value over the runs.\n"
+"                          The first '-s' and '-c' values apply to all logs.\n"
+"  --scaling               Runs with different thread counts, '<threads>:<log>':\n"
+"                          speedup, parallel efficiency and Amdahl's serial\n"
+"                          fraction of every thread role and call path against\n"
+"                          the smallest thread count, the nodes that stop\n"
+"                          scaling first are marked with '<'.\n"
+"  --slowest-frames <k>    Report: append the event trees of the <k> slowest\n"
+"                          frames with the times since the log start and the\n"
+"                          top-level scopes of the other threads in them.\n"
+"  --critical-path <n>     Report: append the <n> sites that take the most of\n"
+"                          the frame time on the critical path across threads.\n"
+"                          The frame thread waits for the scope of another\n"
+"                          thread that finishes last within its running scope.\n"
+"  --concurrency           Report: append the time with k busy threads, the\n"
+"                          busy and idle time of every thread and the average\n"
+"                          number of busy threads per frame. A thread is busy\n"
+"                          within its top-level scopes.\n"
+"  --frames <a:b>          Read the frames [a, b) only, numbered from 0, either\n"
+"                          end may be left out. The other threads are cut by\n"
+"                          the frame start times. Applies to all modes, the\n"
+"                          cache is not used.\n"
+"  --skip-warmup <n>       Drop the first <n> frames, same as '--frames <n>:'.\n"
+"  --min-incl-percent <p>  Tree sections: drop nodes below <p> percent of the frame time.\n"
+"  --max-depth <n>         Tree sections: drop nodes deeper than stack level <n>.\n"
+"  --top-n-children <n>    Tree sections: keep only <n> largest children of a node.\n"
+"                          The dropped children are shown as a single '<other>' row.\n"
 "\n"
     );
 }
@@ -31,6 +110,41 @@ static bool check_file_exist(const char *filename)
     return fp != NULL;
 
 }
+// "a:b", "a:" or ":b"
+static bool parse_range(const char *str, fpsprof::frame_range_t& range)
+{
+    range = fpsprof::frame_range_t();
+    int len = 0;
+    if (*str != ':' && (sscanf(str, "%u%n", &range.first, &len) != 1 || str[len] != ':')) {
+        return false;
+    }
+    str += len + 1;
+    if (*str != '\0' && (sscanf(str, "%u%n", &range.last, &len) != 1 || str[len] != '\0')) {
+        return false;
+    }
+    return range.first < range.last;
+}
+
+static bool parse_list(const char *str, std::vector<double>& values)
+{
+    values.clear();
+    for (;;) {
+        double val;
+        int len;
+        if (sscanf(str, "%lf%n", &val, &len) != 1) {
+            return false;
+        }
+        values.push_back(val);
+        str += len;
+        if (*str == '\0') {
+            return true;
+        }
+        if (*str++ != ',') {
+            return false;
+        }
+    }
+}
+
 #ifdef NDEBUG
 #define TRACE_ERR(cond, fmt, ...) if (cond) { fprintf(stderr, "error:" fmt "\n", ##__VA_ARGS__); return 1; }
 #else
@@ -48,13 +162,46 @@ int main(int argc, char *argv[])
         { "input",  required_argument,  0, 'i' },
         { "self",  required_argument,  0, 's' },
         { "children",  required_argument,  0, 'c' },
+        { "interactive",  no_argument,  0, 'I' },
+        { "no-cache",  no_argument,  0, 'n' },
+        { "format",  required_argument,  0, OPT_FORMAT },
+        { "min-incl-percent",  required_argument,  0, OPT_MIN_INCL_PERCENT },
+        { "max-depth",  required_argument,  0, OPT_MAX_DEPTH },
+        { "top-n-children",  required_argument,  0, OPT_TOP_N_CHILDREN },
+        { "tree",  required_argument,  0, OPT_TREE },
+        { "diff",  no_argument,  0, OPT_DIFF },
+        { "significance",  required_argument,  0, OPT_SIGNIFICANCE },
+        { "fail-above",  required_argument,  0, OPT_FAIL_ABOVE },
+        { "merge",  no_argument,  0, OPT_MERGE },
+        { "scaling",  no_argument,  0, OPT_SCALING },
+        { "slowest-frames",  required_argument,  0, OPT_SLOWEST_FRAMES },
+        { "critical-path",  required_argument,  0, OPT_CRITICAL_PATH },
+        { "concurrency",  no_argument,  0, OPT_CONCURRENCY },
+        { "frames",  required_argument,  0, OPT_FRAMES },
+        { "skip-warmup",  required_argument,  0, OPT_SKIP_WARMUP },
         //{ "report", required_argument,  0, 'r' },
         //{ "stack",  required_argument,  0, 's' },
+        { 0, 0, 0, 0 },
     };
     const char* filename = NULL;
-    double self_nsec = -1, children_nsec = -1;
+    std::vector<double> self_nsec(1, -1), children_nsec(1, -1);
+    bool interactive = false;
+    bool use_cache = true;
+    const char* format = "report";
+    fpsprof::Reporter::tree_t tree = fpsprof::Reporter::TREE_FULL;
+    fpsprof::prune_options_t prune;
+    bool diff = false;
+    fpsprof::diff_options_t diff_options;
+    double fail_above = -1;
+    bool merge = false;
+    bool scaling = false;
+    unsigned slowest_frames = 0;
+    unsigned critical_path = 0;
+    bool concurrency = false;
+    fpsprof::frame_range_t range;
+    unsigned skip_warmup = 0;
     int ch;
-    while ((ch = getopt_long(argc, argv, "hi:s:c:", long_options, 0)) != EOF) {
+    while ((ch = getopt_long(argc, argv, "hi:s:c:In", long_options, 0)) != EOF) {
         switch (ch) {
         case 'h':
             return usage(), 0;
@@ -62,15 +209,94 @@ int main(int argc, char *argv[])
             filename = optarg;
             break;
         case 's':
-            if (sscanf(optarg, "%lf", &self_nsec) != 1) {
+            if (!parse_list(optarg, self_nsec)) {
                 TRACE_ERR(1, "invalid argument for '-s' option: %s", optarg)
             }
             break;
         case 'c':
-            if (sscanf(optarg, "%lf", &children_nsec) != 1) {
+            if (!parse_list(optarg, children_nsec)) {
                 TRACE_ERR(1, "invalid argument for '-c' option: %s", optarg)
             }
             break;
+        case 'I':
+            interactive = true;
+            break;
+        case 'n':
+            use_cache = false;
+            break;
+        case OPT_FORMAT:
+            if (strcmp(optarg, "report") && strcmp(optarg, "chrome-trace") &&
+                strcmp(optarg, "folded") && strcmp(optarg, "flamegraph-svg")) {
+                TRACE_ERR(1, "invalid argument for '--format' option: %s", optarg)
+            }
+            format = optarg;
+            break;
+        case OPT_MIN_INCL_PERCENT:
+            if (sscanf(optarg, "%lf", &prune.min_incl_percent) != 1 || prune.min_incl_percent < 0) {
+                TRACE_ERR(1, "invalid argument for '--min-incl-percent' option: %s", optarg)
+            }
+            break;
+        case OPT_MAX_DEPTH:
+            if (sscanf(optarg, "%d", &prune.max_depth) != 1 || prune.max_depth < 0) {
+                TRACE_ERR(1, "invalid argument for '--max-depth' option: %s", optarg)
+            }
+            break;
+        case OPT_TOP_N_CHILDREN:
+            if (sscanf(optarg, "%u", &prune.top_n_children) != 1 || prune.top_n_children == 0) {
+                TRACE_ERR(1, "invalid argument for '--top-n-children' option: %s", optarg)
+            }
+            break;
+        case OPT_TREE:
+            if (!strcmp(optarg, "full")) {
+                tree = fpsprof::Reporter::TREE_FULL;
+            } else if (!strcmp(optarg, "norec")) {
+                tree = fpsprof::Reporter::TREE_NO_RECURSION;
+            } else {
+                TRACE_ERR(1, "invalid argument for '--tree' option: %s", optarg)
+            }
+            break;
+        case OPT_DIFF:
+            diff = true;
+            break;
+        case OPT_MERGE:
+            merge = true;
+            break;
+        case OPT_SCALING:
+            scaling = true;
+            break;
+        case OPT_FRAMES:
+            if (!parse_range(optarg, range)) {
+                TRACE_ERR(1, "invalid argument for '--frames' option: %s", optarg)
+            }
+            break;
+        case OPT_SKIP_WARMUP:
+            if (sscanf(optarg, "%u", &skip_warmup) != 1) {
+                TRACE_ERR(1, "invalid argument for '--skip-warmup' option: %s", optarg)
+            }
+            break;
+        case OPT_SLOWEST_FRAMES:
+            if (sscanf(optarg, "%u", &slowest_frames) != 1 || slowest_frames == 0) {
+                TRACE_ERR(1, "invalid argument for '--slowest-frames' option: %s", optarg)
+            }
+            break;
+        case OPT_CRITICAL_PATH:
+            if (sscanf(optarg, "%u", &critical_path) != 1 || critical_path == 0) {
+                TRACE_ERR(1, "invalid argument for '--critical-path' option: %s", optarg)
+            }
+            break;
+        case OPT_CONCURRENCY:
+            concurrency = true;
+            break;
+        case OPT_SIGNIFICANCE:
+            if (sscanf(optarg, "%lf", &diff_options.z_threshold) != 1 || diff_options.z_threshold <= 0) {
+                TRACE_ERR(1, "invalid argument for '--significance' option: %s", optarg)
+            }
+            break;
+        case OPT_FAIL_ABOVE:
+            if (sscanf(optarg, "%lf", &fail_above) != 1 || fail_above < 0) {
+                TRACE_ERR(1, "invalid argument for '--fail-above' option: %s", optarg)
+            }
+            break;
         //case 'r':
         //    if (sscanf(optarg, "%u", &reportFlags) != 1) {
         //        TRACE_ERR(1, "invalid argument for '-r' option: %s", optarg)
@@ -87,6 +313,51 @@ int main(int argc, char *argv[])
             return 1;
         }
     }
+    if (skip_warmup > range.first) {
+        range.first = skip_warmup;
+        TRACE_ERR(range.first >= range.last, "no frames left after the warm-up")
+    }
+    if (merge) {
+        TRACE_ERR(optind == argc, "input file names required")
+        std::vector<const char*> filenames(argv + optind, argv + argc);
+        for (const char* name : filenames) {
+            TRACE_ERR(!check_file_exist(name), "input file does not exist: %s", name)
+        }
+        fpsprof::BufferedWriter out(stdout);
+        TRACE_ERR(!fpsprof::Reporter::Merge(filenames, out, use_cache, self_nsec[0], children_nsec[0], range), "failed to merge profiler logs")
+        return 0;
+    }
+    if (scaling) {
+        TRACE_ERR(optind == argc, "input file names required")
+        std::vector<unsigned> num_threads;
+        std::vector<const char*> filenames;
+        for (int i = optind; i < argc; i++) {
+            unsigned n;
+            int len = 0;
+            TRACE_ERR(sscanf(argv[i], "%u:%n", &n, &len) != 1 || len == 0 || n == 0, "expected '<threads>:<log>': %s", argv[i])
+            TRACE_ERR(std::find(num_threads.begin(), num_threads.end(), n) != num_threads.end(), "duplicate thread count: %s", argv[i])
+            TRACE_ERR(!check_file_exist(argv[i] + len), "input file does not exist: %s", argv[i] + len)
+            num_threads.push_back(n);
+            filenames.push_back(argv[i] + len);
+        }
+        fpsprof::BufferedWriter out(stdout);
+        TRACE_ERR(!fpsprof::Reporter::Scaling(num_threads, filenames, out, use_cache, self_nsec[0], children_nsec[0], range), "failed to build the scaling report")
+        return 0;
+    }
+    if (diff) {
+        TRACE_ERR(argc - optind != 2, "two input file names required")
+        const char* base = argv[optind], *cur = argv[optind + 1];
+        TRACE_ERR(!check_file_exist(base), "input file does not exist: %s", base)
+        TRACE_ERR(!check_file_exist(cur), "input file does not exist: %s", cur)
+        fpsprof::BufferedWriter out(stdout);
+        fpsprof::diff_result_t result;
+        TRACE_ERR(!fpsprof::Reporter::Diff(base, cur, out, diff_options, result, use_cache, self_nsec[0], children_nsec[0], range), "failed to compare profiler logs")
+        if (fail_above >= 0 && result.max_regression_percent > fail_above) {
+            fprintf(stderr, "regression: +%.2f%% of the frame time, above %.2f%%\n", result.max_regression_percent, fail_above);
+            return 2;
+        }
+        return 0;
+    }
     if (optind < argc && filename == NULL) {
         filename = argv[optind++];
     }
@@ -97,12 +368,69 @@ int main(int argc, char *argv[])
     TRACE_ERR(filename == NULL, "input file name required")
     TRACE_ERR(!check_file_exist(filename), "input file does not exist")
 
+    if (!strcmp(format, "chrome-trace")) {
+        fpsprof::BufferedWriter out(stdout);
+        TRACE_ERR(!fpsprof::Reporter::ExportChromeTrace(filename, out, range), "failed to export profiler log: %s", filename)
+        return 0;
+    }
+
     fpsprof::Reporter reporter;
-    TRACE_ERR(!reporter.Deserialize(filename), "failed to parse profiler log: %s", filename)
+    reporter.SetFrameRange(range);
+    TRACE_ERR(!reporter.Deserialize(filename, use_cache), "failed to parse profiler log: %s", filename)
+    reporter.SetPruning(prune);
+
+    if (!strcmp(format, "folded")) {
+        fpsprof::BufferedWriter out(stdout);
+        TRACE_ERR(!reporter.ExportFolded(out, tree, self_nsec[0], children_nsec[0]), "failed to export profiler log: %s", filename)
+        return 0;
+    }
+    if (!strcmp(format, "flamegraph-svg")) {
+        fpsprof::BufferedWriter out(stdout);
+        TRACE_ERR(!reporter.ExportFlameGraph(out, tree, filename, self_nsec[0], children_nsec[0]), "failed to export profiler log: %s", filename)
+        return 0;
+    }
 
-    std::string report = reporter.Report(self_nsec, children_nsec);
-    printf("%s\n", report.c_str());
+    // the trees are built by the first report, the next ones only redo the penalty compensation
+    fpsprof::BufferedWriter out(stdout);
+    bool sweep = self_nsec.size()*children_nsec.size() > 1;
+    for (double self : self_nsec) {
+        for (double children : children_nsec) {
+            if (sweep) {
+                out.printf("=== self %g, children %g\n", self, children);
+            }
+            reporter.Report(out, self, children);
+            out.put('\n');
+        }
+    }
+    out.flush();
+    if (slowest_frames) {
+        TRACE_ERR(!fpsprof::Reporter::ReportSlowestFrames(filename, slowest_frames, out, range), "failed to read the frames: %s", filename)
+    }
+    if (critical_path) {
+        TRACE_ERR(!fpsprof::Reporter::ReportCriticalPath(filename, critical_path, out, range), "failed to read the frames: %s", filename)
+    }
+    if (concurrency) {
+        TRACE_ERR(!fpsprof::Reporter::ReportConcurrency(filename, out, range), "failed to read the frames: %s", filename)
+    }
 
+    if (interactive) {
+        char line[256];
+        for (;;) {
+            fprintf(stderr, "self children> ");
+            if (!fgets(line, sizeof(line), stdin) || line[0] == 'q') {
+                break;
+            }
+            double self, children;
+            if (sscanf(line, "%lf %lf", &self, &children) != 2) {
+                fprintf(stderr, "expected: <self> <children>\n");
+                continue;
+            }
+            reporter.Report(out, self, children);
+            out.put('\n');
+            out.flush();
+            fflush(stdout);
+        }
+    }
 
     return 0;
 }
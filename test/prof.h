@@ -12,6 +12,8 @@
 #else
     #define FPSPROF_SERIALIZE_STREAM(stream)
     #define FPSPROF_SERIALIZE_FILE(filename)
+    #define FPSPROF_SERIALIZE_FORMAT(fmt)
+    #define FPSPROF_SERIALIZE_COMPRESS(enable)
     #define FPSPROF_REPORT_STREAM(stream)
     #define FPSPROF_REPORT_FILE(filename)
 
@@ -0,0 +1,97 @@
+/*
+ * Copyright  2021 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "../src/reporter.h"
+#include "../src/writer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+// Two runs of a log with a frame thread and a worker thread are merged. Every thread keeps
+// its own root and its own function statistics: the frame thread takes the whole frame time,
+// the worker a half of it.
+
+#define TEST_LOG "test_merge.log"
+#define NUM_FRAMES 10
+#define FRAME_NSEC 1000000
+
+#define CHECK(cond, ...) if (!(cond)) { fprintf(stderr, "error: " __VA_ARGS__); fprintf(stderr, "\n"); return 1; }
+
+static bool write_log(const char* filename)
+{
+    FILE* fp = fopen(filename, "w");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, "F: 1\nP: 10000 0 0 0 0\nN: 0 frame\nN: 1 job\n");
+    fprintf(fp, "T: 0 %d\n", FRAME_NSEC);
+    for (unsigned i = 0; i < NUM_FRAMES; i++) {
+        fprintf(fp, "E: 1 0 0 %d %d\n", i ? FRAME_NSEC : 0, FRAME_NSEC);
+    }
+    fprintf(fp, "T: 1 %d\n", FRAME_NSEC);
+    for (unsigned i = 0; i < NUM_FRAMES; i++) {
+        fprintf(fp, "E: 0 0 1 %d %d\n", i ? FRAME_NSEC : 0, FRAME_NSEC / 2);
+    }
+    return fclose(fp) == 0;
+}
+
+// the lines of the section up to the next blank line, the header lines are skipped
+static std::vector<std::string> section_rows(const std::string& report, const char* title)
+{
+    std::vector<std::string> rows;
+    size_t pos = report.find(title);
+    if (pos == std::string::npos) {
+        return rows;
+    }
+    for (unsigned skip = 0; skip < 3; skip++) { // title, separator, column names
+        pos = report.find('\n', pos) + 1;
+    }
+    while (pos < report.size() && report[pos] != '\n') {
+        size_t end = report.find('\n', pos);
+        rows.push_back(report.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return rows;
+}
+
+static unsigned count_rows(const std::vector<std::string>& rows, const char* name)
+{
+    unsigned n = 0;
+    for (const auto& row : rows) {
+        n += row.find(name) != std::string::npos;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    CHECK(write_log(TEST_LOG), "failed to write '%s'", TEST_LOG)
+
+    std::string report;
+    {
+        fpsprof::BufferedWriter out(report);
+        std::vector<const char*> filenames = { TEST_LOG, TEST_LOG };
+        CHECK(fpsprof::Reporter::Merge(filenames, out, false, 0, 0), "failed to merge")
+    }
+    remove(TEST_LOG);
+
+    std::vector<std::string> threads = section_rows(report, "Threads summary");
+    CHECK(threads.size() == 2, "expected 2 threads, got %zu", threads.size())
+    CHECK(threads[0] != threads[1], "thread rows are the same:\n%s", threads[0].c_str())
+    CHECK(threads[0].find(" 100.00 ") != std::string::npos, "frame thread is not 100%%:\n%s", threads[0].c_str())
+    CHECK(threads[1].find(" 50.00 ") != std::string::npos, "worker thread is not 50%%:\n%s", threads[1].c_str())
+
+    std::vector<std::string> detailed = section_rows(report, "Detailed report");
+    CHECK(count_rows(detailed, " frame ") == 1 && count_rows(detailed, " job ") == 1, "trees are mixed:\n%s", report.c_str())
+
+    std::vector<std::string> stats = section_rows(report, "Function statistics (Full)");
+    CHECK(count_rows(stats, " frame ") == 1 && count_rows(stats, " job ") == 1, "statistics are mixed:\n%s", report.c_str())
+
+    printf("ok\n");
+    return 0;
+}